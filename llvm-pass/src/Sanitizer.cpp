@@ -3,23 +3,80 @@
 #include <stack>
 
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/IntrinsicInst.h"
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Passes/PassPlugin.h"
 #include "llvm/Support/FileSystem.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
 #include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/Mem2Reg.h"
 
 #include "functionTransformer.h"
 #include "redzone.h"
 
 using namespace llvm;
 
+cl::opt<ProtectionLevel> Protection(
+    "structzone-protection", cl::desc("Which struct fields get redzones"),
+    cl::values(clEnumValN(ProtectionLevel::Full, "full",
+                          "Before every field and after the last one (default)"),
+               clEnumValN(ProtectionLevel::Tail, "tail",
+                          "Only after the last field, against overflows out of the struct"),
+               clEnumValN(ProtectionLevel::Buffers, "buffers",
+                          "Only around array fields, where overflows within a struct start")),
+    cl::init(ProtectionLevel::Full));
+
+enum class LayoutMode { Fixed, Planned, Padding };
+
+static cl::opt<LayoutMode> Layout(
+    "structzone-layout", cl::desc("How the redzones of an inflated struct are sized"),
+    cl::values(clEnumValN(LayoutMode::Fixed, "fixed", "Every redzone is 32 bytes (default)"),
+               clEnumValN(LayoutMode::Planned, "planned",
+                          "Size each redzone after its neighbouring fields, within the "
+                          "inflation budget, and keep small fields within a cache line"),
+               clEnumValN(LayoutMode::Padding, "padding",
+                          "Turn the alignment padding between fields into redzones, and only "
+                          "add 32-byte redzones where there is none")),
+    cl::init(LayoutMode::Fixed));
+
+cl::opt<bool> DebugTrace("structzone-debug",
+                         cl::desc("Trace the functions the pass works on and save the module to "
+                                  "./last_executed_module.ll after every step"),
+                         cl::init(false));
+
+static cl::opt<double> InflationBudget(
+    "structzone-inflation-budget",
+    cl::desc("With -structzone-layout=planned, the largest inflated struct size as a multiple of "
+             "the original size (0 for no limit)"),
+    cl::init(2.0));
+
+// The smallest redzone the planned layout uses; still catches off-by-one and most small overflows.
+const size_t MIN_REDZONE_SIZE = 8;
+const size_t CACHE_LINE_SIZE = 64;
+// The most calls a struct copy or memset is split into; larger copies include the redzones, and
+// larger memsets set the payload in a loop over the structs.
+const size_t MAX_COPY_SPANS = 16;
+
 namespace {
 // typedefs for the long types we use in the pass.
 typedef std::vector<std::function<void(LLVMContext &)>> UpdateInstMap;
 
+// mem2reg, but also on optnone functions. At clang -O0 every function is optnone, and PromotePass
+// on its own would be skipped there, leaving the sanitizer with unpromoted locals.
+struct RequiredPromotePass : PassInfoMixin<RequiredPromotePass> {
+    static bool isRequired() { return true; }
+
+    PreservedAnalyses run(Function &F, FunctionAnalysisManager &AM) {
+        return PromotePass().run(F, AM);
+    }
+};
+
 struct StructZoneSanitizer : PassInfoMixin<StructZoneSanitizer> {
+    // Also run on optnone functions (clang -O0); the program is not valid without the inflation.
+    static bool isRequired() { return true; }
+
     // mapping from old struct to new struct
     std::map<Type *, std::shared_ptr<StructInfo>> struct_mapping;
 
@@ -34,22 +91,184 @@ struct StructZoneSanitizer : PassInfoMixin<StructZoneSanitizer> {
         }
     }
 
+    // Decides where the redzones of a struct go under the protection level: slot i stands for the
+    // redzone in front of field i, and the last slot for the one after the last field.
+    std::vector<bool> PlanRedzones(StructType *s) {
+        size_t count = s->getNumElements();
+        std::vector<bool> plan(count + 1, false);
+        // A forward declaration is left alone.
+        if (s->isOpaque()) {
+            return plan;
+        }
+        for (size_t i = 0; i <= count; i++) {
+            switch (Protection) {
+            case ProtectionLevel::Full:
+                plan[i] = true;
+                break;
+            case ProtectionLevel::Tail:
+                plan[i] = i == count;
+                break;
+            case ProtectionLevel::Buffers:
+                plan[i] = (i < count && s->getElementType(i)->isArrayTy()) ||
+                          (i > 0 && s->getElementType(i - 1)->isArrayTy());
+                break;
+            }
+        }
+        return plan;
+    }
+
+    // Builds the body of an inflated struct: a redzone of sizes[i] bytes in front of field i (none
+    // if 0), and the last one after the last field. positions receives the index of every field.
+    std::vector<Type *> LayOut(const std::vector<Type *> &fieldTypes,
+                               const std::vector<size_t> &sizes, LLVMContext &ctx,
+                               std::vector<size_t> *positions = nullptr) {
+        std::vector<Type *> body;
+        for (size_t i = 0; i <= fieldTypes.size(); i++) {
+            if (sizes[i] > 0) {
+                body.push_back(ArrayType::get(Type::getInt8Ty(ctx), sizes[i]));
+            }
+            if (i < fieldTypes.size()) {
+                if (positions) {
+                    positions->push_back(body.size());
+                }
+                body.push_back(fieldTypes[i]);
+            }
+        }
+        return body;
+    }
+
+    // Sizes the redzones that PlanRedzones asked for, given the (shallowly) inflated field types;
+    // 0 means no redzone in that slot. The fixed layout gives every redzone REDZONE_SIZE bytes.
+    //
+    // The planned layout sizes each redzone after its neighbours, since an overflow out of a
+    // buffer runs further than one out of a scalar, and rounds it up to the alignment of the next
+    // field so that it takes up the padding instead of adding to it. If that puts the struct over
+    // the inflation budget, the redzones are shrunk to MIN_REDZONE_SIZE, and then the ones that do
+    // not border a buffer are given up: the leading one first and the trailing one last. Any room
+    // left in the budget goes to keeping small fields from straddling a cache line (counted from
+    // the start of the struct, so this assumes line-aligned objects).
+    std::vector<size_t> SizeRedzones(StructType *s, const std::vector<Type *> &fieldTypes,
+                                     const std::vector<bool> &plan, DataLayout &dl,
+                                     LLVMContext &ctx) {
+        size_t count = fieldTypes.size();
+        std::vector<size_t> sizes(count + 1, 0);
+        for (size_t i = 0; i <= count; i++) {
+            sizes[i] = plan[i] ? REDZONE_SIZE : 0;
+        }
+        if (Layout == LayoutMode::Fixed || s->isOpaque() || !s->isSized()) {
+            return sizes;
+        }
+        if (Layout == LayoutMode::Padding) {
+            return PaddingRedzones(fieldTypes, plan, dl);
+        }
+
+        auto isBuffer = [&](size_t field) { return fieldTypes[field]->isArrayTy(); };
+        auto wanted = [&](size_t field) -> size_t {
+            // A nested struct has redzones of its own.
+            if (fieldTypes[field]->isStructTy() || !fieldTypes[field]->isSized()) {
+                return MIN_REDZONE_SIZE;
+            }
+            size_t size = dl.getTypeAllocSize(fieldTypes[field]);
+            return std::min(REDZONE_SIZE, std::max(MIN_REDZONE_SIZE, size));
+        };
+        auto aligned = [&](size_t size, size_t slot) -> size_t {
+            if (slot == count || !fieldTypes[slot]->isSized()) {
+                return size;
+            }
+            return alignTo(size, dl.getABITypeAlign(fieldTypes[slot]));
+        };
+        auto bordersBuffer = [&](size_t slot) {
+            return (slot > 0 && isBuffer(slot - 1)) || (slot < count && isBuffer(slot));
+        };
+        auto inflatedSize = [&]() -> uint64_t {
+            return dl.getTypeAllocSize(StructType::get(ctx, LayOut(fieldTypes, sizes, ctx)));
+        };
+
+        for (size_t i = 0; i <= count; i++) {
+            if (sizes[i] > 0) {
+                size_t size = std::max(i > 0 ? wanted(i - 1) : 0, i < count ? wanted(i) : 0);
+                sizes[i] = aligned(size, i);
+            }
+        }
+
+        uint64_t budget = UINT64_MAX;
+        if (InflationBudget > 0) {
+            budget = InflationBudget * dl.getTypeAllocSize(s).getFixedSize();
+        }
+        if (inflatedSize() > budget) {
+            for (size_t i = 0; i <= count; i++) {
+                if (sizes[i] > 0) {
+                    sizes[i] = aligned(MIN_REDZONE_SIZE, i);
+                }
+            }
+        }
+        // In slot order, so the trailing redzone, which guards against overflows out of the whole
+        // object, goes last.
+        for (size_t i = 0; i <= count; i++) {
+            if (inflatedSize() <= budget) {
+                break;
+            }
+            if (sizes[i] > 0 && !bordersBuffer(i)) {
+                sizes[i] = 0;
+            }
+        }
+
+        for (size_t i = 0; i < count; i++) {
+            if (sizes[i] == 0 || !fieldTypes[i]->isSized()) {
+                continue;
+            }
+            std::vector<size_t> positions;
+            auto *layout = dl.getStructLayout(
+                StructType::get(ctx, LayOut(fieldTypes, sizes, ctx, &positions)));
+            size_t start = layout->getElementOffset(positions[i]);
+            size_t size = dl.getTypeStoreSize(fieldTypes[i]);
+            if (size == 0 || size > CACHE_LINE_SIZE ||
+                start / CACHE_LINE_SIZE == (start + size - 1) / CACHE_LINE_SIZE) {
+                continue;
+            }
+            size_t previous = sizes[i];
+            sizes[i] += CACHE_LINE_SIZE - start % CACHE_LINE_SIZE;
+            if (inflatedSize() > budget) {
+                sizes[i] = previous;
+            }
+        }
+        return sizes;
+    }
+
+    // The padding layout: a redzone that falls where the data layout already leaves a hole (in
+    // front of a field with a larger alignment, or at the end of the struct) is just that hole,
+    // so it costs no memory. Only where there is no padding does it add a REDZONE_SIZE redzone,
+    // rounded up to the alignment of the next field so that it does not open up a new,
+    // uncolored, hole behind it. The holes are measured as the fields are laid out, so that they
+    // stay right when an earlier redzone or a nested inflated struct moves the fields.
+    std::vector<size_t> PaddingRedzones(const std::vector<Type *> &fieldTypes,
+                                        const std::vector<bool> &plan, DataLayout &dl) {
+        size_t count = fieldTypes.size();
+        std::vector<size_t> sizes(count + 1, 0);
+        uint64_t offset = 0;
+        Align structAlign(1);
+        for (size_t i = 0; i <= count; i++) {
+            Align align = i < count ? dl.getABITypeAlign(fieldTypes[i]) : structAlign;
+            size_t hole = alignTo(offset, align) - offset;
+            if (plan[i]) {
+                sizes[i] = hole > 0 ? hole : alignTo(REDZONE_SIZE, align);
+            }
+            offset = alignTo(offset + sizes[i], align);
+            if (i < count) {
+                offset += dl.getTypeAllocSize(fieldTypes[i]);
+                structAlign = std::max(structAlign, align);
+            }
+        }
+        return sizes;
+    }
+
     // Performs a _shallow_ walk over all the fields of the struct.
     // In particular, this means pointer types will not be updated, to avoid infinite recursion.
     std::shared_ptr<StructInfo> ShallowWalk(StructType *s, DataLayout &dl, LLVMContext &ctx) {
         // Metadata info on each field of the struct
         std::vector<FieldInfo> fields;
-        // The fields, but with redzone types inserted in between them.
-        std::vector<Type *> mappedFields;
-        std::vector<size_t> redzone_offsets;
-        std::map<size_t, size_t> offset_mapping;
-        // We add a redzone before the first field, so that we can detect underflows.
-        // However, if the type is opaque (i.e., a forward declaration), we should not touch it.
-        if (!s->isOpaque()) {
-            redzone_offsets.push_back(mappedFields.size());
-            mappedFields.push_back(ArrayType::get(Type::getInt8Ty(ctx), REDZONE_SIZE));
-        }
-        size_t base_offset = 0;
+        // The (shallowly inflated) types of the fields, without redzones.
+        std::vector<Type *> fieldTypes;
         for (auto fieldType : s->elements()) {
             FieldInfo field = {
                 fieldType, nullptr,
@@ -71,7 +290,7 @@ struct StructZoneSanitizer : PassInfoMixin<StructZoneSanitizer> {
             } while (currType && !currType->isStructTy());
 
             if (!currType) {
-                mappedFields.push_back(fieldType);
+                fieldTypes.push_back(fieldType);
             } else {
                 // Now, we can recurse over the struct type we found.
                 auto innerStructInfo = ShallowWalk(dyn_cast<StructType>(currType), dl, ctx);
@@ -87,15 +306,28 @@ struct StructZoneSanitizer : PassInfoMixin<StructZoneSanitizer> {
                     nestingInfo.pop();
                     inflatedInnerType = ArrayType::get(inflatedInnerType, size);
                 }
-                mappedFields.push_back(inflatedInnerType);
+                fieldTypes.push_back(inflatedInnerType);
             }
             fields.push_back(field);
-            // and an array of chars with a given size to store the redzone in.
-            redzone_offsets.push_back(mappedFields.size());
-            mappedFields.push_back(ArrayType::get(Type::getInt8Ty(ctx), REDZONE_SIZE));
-            // Finally, we store the difference in offsets that accumulates due to redzones.
-            offset_mapping[base_offset] = base_offset * 2 + 1;
-            base_offset += 1;
+        }
+        // Then put the redzones in between them, and an array of chars after the last field to
+        // store the trailing redzone in.
+        std::vector<size_t> sizes = SizeRedzones(s, fieldTypes, PlanRedzones(s), dl, ctx);
+        std::vector<size_t> positions;
+        std::vector<Type *> mappedFields = LayOut(fieldTypes, sizes, ctx, &positions);
+        std::map<size_t, size_t> offset_mapping;
+        for (size_t i = 0; i < positions.size(); i++) {
+            offset_mapping[i] = positions[i];
+        }
+        std::vector<size_t> redzone_offsets;
+        std::vector<size_t> redzone_sizes;
+        for (size_t i = 0; i <= fieldTypes.size(); i++) {
+            if (sizes[i] > 0) {
+                // Right in front of field i, or at the end for the trailing one.
+                redzone_offsets.push_back(i < positions.size() ? positions[i] - 1
+                                                               : mappedFields.size() - 1);
+                redzone_sizes.push_back(sizes[i]);
+            }
         }
         // If the inflated type doesn't exist yet, create it. For recursion, it will already exist,
         // so lets not create duplicates.
@@ -111,7 +343,7 @@ struct StructZoneSanitizer : PassInfoMixin<StructZoneSanitizer> {
                                 // For an opaque struct, we of course cannot infer the size.
                                 s->isSized() ? dl.getTypeAllocSize(s) : 0ul,
                                 inflated_type->isSized() ? dl.getTypeAllocSize(inflated_type) : 0ul,
-                                offset_mapping, redzone_offsets};
+                                offset_mapping, redzone_offsets, redzone_sizes};
         return std::make_shared<StructInfo>(si);
     }
 
@@ -122,8 +354,12 @@ struct StructZoneSanitizer : PassInfoMixin<StructZoneSanitizer> {
             if (si->type->isOpaque()) {
                 continue;
             }
-            std::vector<Type *> mappedFields;
-            mappedFields.push_back(ArrayType::get(Type::getInt8Ty(ctx), REDZONE_SIZE));
+            // The redzones stay where ShallowWalk put them.
+            std::vector<Type *> mappedFields(si->fields.size() + si->redzone_offsets.size());
+            for (size_t i = 0; i < si->redzone_offsets.size(); i++) {
+                mappedFields[si->redzone_offsets[i]] =
+                    ArrayType::get(Type::getInt8Ty(ctx), si->redzone_sizes[i]);
+            }
             int idx = 0;
             for (auto fieldType : si->type->elements()) {
                 std::stack<std::tuple<bool, size_t>> nestingInfo;
@@ -142,9 +378,8 @@ struct StructZoneSanitizer : PassInfoMixin<StructZoneSanitizer> {
                     }
                 } while (currType && !currType->isStructTy());
 
-                if (!currType) {
-                    mappedFields.push_back(fieldType);
-                } else {
+                Type *mappedType = fieldType;
+                if (currType) {
                     // Now, we can look up the struct we found
                     auto innerStructInfo = struct_mapping[currType];
                     // Update it here, in case we missed it the first time around
@@ -161,10 +396,9 @@ struct StructZoneSanitizer : PassInfoMixin<StructZoneSanitizer> {
                                 PointerType::get(inflatedInnerType, 0); // default address space
                         }
                     }
-                    mappedFields.push_back(inflatedInnerType);
+                    mappedType = inflatedInnerType;
                 }
-                // and an array of chars with a given size to store the redzone in.
-                mappedFields.push_back(ArrayType::get(Type::getInt8Ty(ctx), REDZONE_SIZE));
+                mappedFields[si->offsetMapping.at(idx)] = mappedType;
                 idx += 1;
             }
             // update the body of the inflated type again, to correct pointer types.
@@ -176,37 +410,48 @@ struct StructZoneSanitizer : PassInfoMixin<StructZoneSanitizer> {
                          LLVMContext &context) {
         IRBuilder<> builder(context);
         builder.SetInsertPoint(inst);
-        auto *newInst =
-            builder.CreateGEP(type,
-                              // NOTE: we _cannot_ move this to the other loop, because this
-                              // gets altered by the alloca instruction replacements!
-                              inst->getPointerOperand(), value);
-        inst->replaceAllUsesWith(newInst);
-        inst->eraseFromParent();
+        // NOTE: we _cannot_ move this to the other loop, because the pointer operand gets altered
+        // by the alloca instruction replacements!
+        // An index that stayed within the original struct stays within the inflated one.
+        auto *newInst = inst->isInBounds()
+                            ? builder.CreateInBoundsGEP(type, inst->getPointerOperand(), value)
+                            : builder.CreateGEP(type, inst->getPointerOperand(), value);
+        replaceKeepingMetadata(inst, newInst);
     }
 
-    void update_inst_alloca(Instruction *inst, Type *type, Value *value, LLVMContext &context) {
+    void update_inst_alloca(AllocaInst *inst, Type *type, Value *value, LLVMContext &context) {
         IRBuilder<> builder(context);
         builder.SetInsertPoint(inst);
         // Note: the second element will be null for non-arrays.
         auto *newInst = builder.CreateAlloca(type, value);
-        inst->replaceAllUsesWith(newInst);
-        inst->eraseFromParent();
+        newInst->setAlignment(std::max(newInst->getAlign(), inst->getAlign()));
+        replaceKeepingMetadata(inst, newInst);
     }
 
     void update_inst_bitcast(BitCastInst *inst, Type *type, LLVMContext &context) {
         IRBuilder<> builder(context);
         builder.SetInsertPoint(inst);
         auto *newInst = builder.CreateBitCast(inst->getOperand(0), type);
-        inst->replaceAllUsesWith(newInst);
-        inst->eraseFromParent();
+        replaceKeepingMetadata(inst, newInst);
     }
 
     void update_inst_load(LoadInst *inst, Type *type, LLVMContext &context) {
         IRBuilder<> builder(context);
         builder.SetInsertPoint(inst);
-        auto *newInst = builder.CreateLoad(type, inst->getPointerOperand());
-        inst->replaceAllUsesWith(newInst);
+        auto *newInst = builder.CreateAlignedLoad(type, inst->getPointerOperand(), inst->getAlign(),
+                                                  inst->isVolatile());
+        newInst->setAtomic(inst->getOrdering(), inst->getSyncScopeID());
+        replaceKeepingMetadata(inst, newInst);
+    }
+
+    // Replaces inst, passing its name and metadata (TBAA, nonnull, debug locations, ...) on to the
+    // replacement if that is an instruction and not a folded constant.
+    void replaceKeepingMetadata(Instruction *inst, Value *replacement) {
+        if (auto *newInst = dyn_cast<Instruction>(replacement)) {
+            newInst->copyMetadata(*inst);
+            newInst->takeName(inst);
+        }
+        inst->replaceAllUsesWith(replacement);
         inst->eraseFromParent();
     }
 
@@ -219,12 +464,40 @@ struct StructZoneSanitizer : PassInfoMixin<StructZoneSanitizer> {
         }
         auto *calledVal = inst->getCalledOperand();
         if (auto *func_ptr = dyn_cast<PointerType>(calledVal->getType())) {
+            SmallVector<OperandBundleDef> bundles;
+            inst->getOperandBundlesAsDefs(bundles);
             auto *new_call = builder.CreateCall(
-                dyn_cast<FunctionType>(func_ptr->getPointerElementType()), calledVal, args);
-            inst->replaceAllUsesWith(new_call);
-            inst->eraseFromParent();
+                dyn_cast<FunctionType>(func_ptr->getPointerElementType()), calledVal, args,
+                bundles);
+            new_call->setCallingConv(inst->getCallingConv());
+            new_call->setTailCallKind(inst->getTailCallKind());
+            new_call->setAttributes(retypeAttributes(inst->getAttributes(), args, context));
+            replaceKeepingMetadata(inst, new_call);
         }
     }
+
+    // The attributes that name the pointee type of an argument (byval, sret, ...) have to name the
+    // inflated type once the argument points to one.
+    AttributeList retypeAttributes(AttributeList attrs, ArrayRef<Value *> args,
+                                   LLVMContext &context) {
+        const Attribute::AttrKind typed[] = {Attribute::ByVal, Attribute::StructRet,
+                                             Attribute::ByRef, Attribute::InAlloca,
+                                             Attribute::Preallocated, Attribute::ElementType};
+        for (unsigned i = 0; i < args.size(); i++) {
+            auto *ptrType = dyn_cast<PointerType>(args[i]->getType());
+            if (!ptrType) {
+                continue;
+            }
+            for (Attribute::AttrKind kind : typed) {
+                if (attrs.hasParamAttr(i, kind)) {
+                    attrs = attrs.removeParamAttribute(context, i, kind);
+                    attrs = attrs.addParamAttribute(
+                        context, i, Attribute::get(context, kind, ptrType->getPointerElementType()));
+                }
+            }
+        }
+        return attrs;
+    }
     std::map<PHINode *, std::tuple<Instruction *, Type *>> to_resolve;
     void update_inst_phi(PHINode *phi_inst, Type *type, LLVMContext &context) {
         IRBuilder<> builder(context);
@@ -253,7 +526,10 @@ struct StructZoneSanitizer : PassInfoMixin<StructZoneSanitizer> {
 
     void handle_gep(GetElementPtrInst *gep_inst, UpdateInstMap &update_insts,
                     LLVMContext &context) {
-        gep_inst->getPointerOperand()->print(errs());
+        if (DebugTrace) {
+            gep_inst->getPointerOperand()->print(errs());
+            errs() << "\n";
+        }
         if (auto *inner_const = dyn_cast<ConstantExpr>(gep_inst->getPointerOperand())) {
         	if (inner_const->getOpcode() == Instruction::GetElementPtr) {
         		auto *inner_gep_inst = dyn_cast<GetElementPtrInst>(inner_const->getAsInstruction());
@@ -285,12 +561,13 @@ struct StructZoneSanitizer : PassInfoMixin<StructZoneSanitizer> {
             // the field that is pointed to.
             else if (struct_mapping.count(curr_type) > 0) {
                 if (auto *const_int = dyn_cast<ConstantInt>(idx)) {
-                    replaced_indices.push_back(
-                        ConstantInt::get(context, const_int->getValue() * 2 + 1));
                     auto si = struct_mapping[curr_type];
                     // Assuming zero extension is fine, because a negative field index is not
                     // semantically correct.
-                    curr_type = si->fields.at(const_int->getValue().getZExtValue()).type;
+                    uint64_t field = const_int->getZExtValue();
+                    replaced_indices.push_back(
+                        ConstantInt::get(const_int->getType(), si->offsetMapping.at(field)));
+                    curr_type = si->fields.at(field).type;
                 } else {
                     // This one is conceptually... weird. A non-constant index really only makes
                     // sense on something like an array, which has a homogeneous element type. But
@@ -528,7 +805,159 @@ struct StructZoneSanitizer : PassInfoMixin<StructZoneSanitizer> {
     	}
     }
 
+    // The struct that a pointer operand of a copy points to (or to an array of), if any.
+    std::shared_ptr<StructInfo> getCopiedStruct(Value *ptr) {
+        auto *ptrType = dyn_cast<PointerType>(ptr->stripPointerCasts()->getType());
+        if (!ptrType || ptrType->isOpaque()) {
+            return nullptr;
+        }
+        Type *type = ptrType->getPointerElementType();
+        while (auto *arrType = dyn_cast<ArrayType>(type)) {
+            type = arrType->getElementType();
+        }
+        auto it = struct_mapping.find(type);
+        return it != struct_mapping.end() ? it->second : nullptr;
+    }
+
+    // Collects the bytes of an inflated type that hold data, as (offset, size) spans, merging
+    // adjacent ones. `size` includes any padding up to the next field, so that fields which are
+    // not separated by a redzone end up in one span. Arrays of inflated structs are taken whole.
+    void collectPayload(Type *type, uint64_t offset, uint64_t size, const DataLayout &dl,
+                        std::vector<std::pair<uint64_t, uint64_t>> *spans) {
+        auto it = struct_mapping.find(type);
+        if (it != struct_mapping.end() && it->second->inflatedType == type && type->isSized()) {
+            auto *structType = cast<StructType>(type);
+            auto *layout = dl.getStructLayout(structType);
+            for (size_t i = 0; i < it->second->fields.size(); i++) {
+                size_t idx = it->second->offsetMapping.at(i);
+                uint64_t start = layout->getElementOffset(idx);
+                uint64_t end = idx + 1 < structType->getNumElements()
+                                   ? layout->getElementOffset(idx + 1)
+                                   : dl.getTypeAllocSize(structType).getFixedSize();
+                collectPayload(structType->getElementType(idx), offset + start, end - start, dl,
+                               spans);
+            }
+            return;
+        }
+        if (!spans->empty() && spans->back().first + spans->back().second == offset) {
+            spans->back().second += size;
+        } else if (size > 0) {
+            spans->push_back(std::make_pair(offset, size));
+        }
+    }
+
+    // Struct assignments come out of clang as an llvm.memcpy of the original struct size, which
+    // would only copy the front of an inflated struct. Copies between two (arrays of) the same
+    // struct are rewritten to copy just the payload: the redzones on both sides already hold the
+    // color, since the destination was colored when it was registered. Likewise, a memset of whole
+    // structs (as in memset(&s, 0, sizeof(s))) only sets their payload, instead of wiping the
+    // color off the first redzones.
+    void handle_struct_mem(MemIntrinsic *inst, UpdateInstMap &update_insts) {
+        auto *length = dyn_cast<ConstantInt>(inst->getLength());
+        auto si = getCopiedStruct(inst->getRawDest());
+        auto *copy = dyn_cast<MemCpyInst>(inst);
+        if (!length || !si || si->size == 0 || si->inflatedSize == 0 ||
+            length->getZExtValue() % si->size != 0 ||
+            (copy && si != getCopiedStruct(copy->getRawSource()))) {
+            return;
+        }
+        if (!copy && !isa<MemSetInst>(inst)) {
+            return;
+        }
+        uint64_t count = length->getZExtValue() / si->size;
+        update_insts.push_back([this, inst, si, count](LLVMContext &context) {
+            this->update_inst_struct_mem(inst, si, count, context);
+        });
+    }
+
+    void update_inst_struct_mem(MemIntrinsic *inst, std::shared_ptr<StructInfo> si,
+                                uint64_t count, LLVMContext &context) {
+        const DataLayout &dl = inst->getModule()->getDataLayout();
+        std::vector<std::pair<uint64_t, uint64_t>> spans;
+        collectPayload(si->inflatedType, 0, si->inflatedSize, dl, &spans);
+        auto *copy = dyn_cast<MemCpyInst>(inst);
+        if (spans.empty() && !copy) {
+            return;
+        }
+        if (spans.empty() || count * spans.size() > MAX_COPY_SPANS) {
+            if (!copy) {
+                // Setting the redzones along would take their color off, so set the payload
+                // one struct at a time instead.
+                update_inst_struct_memset_loop(cast<MemSetInst>(inst), si, spans, count, context);
+                return;
+            }
+            // Not worth unrolling; copying the redzones along is harmless.
+            spans = {std::make_pair(0ul, count * si->inflatedSize)};
+            count = 1;
+        }
+        IRBuilder<> builder(inst);
+        Value *dst = inst->getRawDest();
+        for (uint64_t e = 0; e < count; e++) {
+            for (auto [offset, size] : spans) {
+                uint64_t at = e * si->inflatedSize + offset;
+                MaybeAlign dstAlign;
+                if (inst->getDestAlign()) {
+                    dstAlign = commonAlignment(*inst->getDestAlign(), at);
+                }
+                Value *to = builder.CreateConstInBoundsGEP1_64(builder.getInt8Ty(), dst, at);
+                CallInst *call;
+                if (copy) {
+                    MaybeAlign srcAlign;
+                    if (copy->getSourceAlign()) {
+                        srcAlign = commonAlignment(*copy->getSourceAlign(), at);
+                    }
+                    Value *from = builder.CreateConstInBoundsGEP1_64(builder.getInt8Ty(),
+                                                                     copy->getRawSource(), at);
+                    call = builder.CreateMemCpy(to, dstAlign, from, srcAlign, size,
+                                                inst->isVolatile());
+                } else {
+                    call = builder.CreateMemSet(to, cast<MemSetInst>(inst)->getValue(), size,
+                                                dstAlign, inst->isVolatile());
+                }
+                call->setMetadata(PAYLOAD_COPY_MD, MDNode::get(context, {}));
+            }
+        }
+        inst->eraseFromParent();
+    }
+
+    // Sets the payload of `count` structs in a loop, one memset per span and struct. Used when
+    // unrolling would take too many calls: a single struct with many fields, or a large array.
+    void update_inst_struct_memset_loop(MemSetInst *inst, std::shared_ptr<StructInfo> si,
+                                        const std::vector<std::pair<uint64_t, uint64_t>> &spans,
+                                        uint64_t count, LLVMContext &context) {
+        BasicBlock *pre = inst->getParent();
+        BasicBlock *done = pre->splitBasicBlock(inst, "payload.done");
+        BasicBlock *body = BasicBlock::Create(context, "payload.set", pre->getParent(), done);
+        pre->getTerminator()->setSuccessor(0, body);
+
+        IRBuilder<> builder(body);
+        auto *index = builder.CreatePHI(builder.getInt64Ty(), 2, "payload.idx");
+        index->addIncoming(builder.getInt64(0), pre);
+        Value *element = builder.CreateInBoundsGEP(
+            builder.getInt8Ty(), inst->getRawDest(),
+            builder.CreateMul(index, builder.getInt64(si->inflatedSize)));
+        for (auto [offset, size] : spans) {
+            MaybeAlign dstAlign;
+            if (inst->getDestAlign()) {
+                dstAlign = commonAlignment(commonAlignment(*inst->getDestAlign(),
+                                                           si->inflatedSize), offset);
+            }
+            Value *to = builder.CreateConstInBoundsGEP1_64(builder.getInt8Ty(), element, offset);
+            auto *call = builder.CreateMemSet(to, inst->getValue(), size, dstAlign,
+                                              inst->isVolatile());
+            call->setMetadata(PAYLOAD_COPY_MD, MDNode::get(context, {}));
+        }
+        Value *next = builder.CreateAdd(index, builder.getInt64(1));
+        index->addIncoming(next, body);
+        builder.CreateCondBr(builder.CreateICmpULT(next, builder.getInt64(count)), body, done);
+        inst->eraseFromParent();
+    }
+
     void handle_call(CallInst *call_inst, UpdateInstMap &update_insts, LLVMContext &context) {
+        if (auto *mem_inst = dyn_cast<MemIntrinsic>(call_inst)) {
+            handle_struct_mem(mem_inst, update_insts);
+            return;
+        }
         auto *calledVal = call_inst->getCalledOperand();
         if (!isa<Function>(calledVal)) {
             update_insts.push_back([this, call_inst](LLVMContext &context) {
@@ -591,6 +1020,52 @@ struct StructZoneSanitizer : PassInfoMixin<StructZoneSanitizer> {
         return arg_type_cp;
     }
 
+    // Like getInflatedType, but also looks through (nested) arrays, which globals can hold directly.
+    Type *getInflatedGlobalType(Type *type, bool *changed) {
+        if (auto *arr_type = dyn_cast<ArrayType>(type)) {
+            return ArrayType::get(getInflatedGlobalType(arr_type->getElementType(), changed),
+                                  arr_type->getNumElements());
+        }
+        return getInflatedType(type, changed);
+    }
+
+    // Rebuilds the initializer of a global for its inflated type. Fields keep their values and the
+    // redzones are filled with the redzone color, so they are poisoned from the first instruction on
+    // (and constant globals can stay in read-only memory).
+    Constant *inflateInitializer(Constant *init, Type *inflatedType, LLVMContext &context) {
+        if (init->getType() == inflatedType) {
+            return init;
+        }
+        if (auto *arr_type = dyn_cast<ArrayType>(inflatedType)) {
+            std::vector<Constant *> elements;
+            for (uint64_t i = 0; i < arr_type->getNumElements(); i++) {
+                elements.push_back(inflateInitializer(init->getAggregateElement(i),
+                                                      arr_type->getElementType(), context));
+            }
+            return ConstantArray::get(arr_type, elements);
+        }
+        if (struct_mapping.count(inflatedType) > 0) {
+            auto si = struct_mapping[inflatedType];
+            auto *struct_type = si->inflatedType;
+            std::vector<Constant *> fields(struct_type->getNumElements());
+            for (size_t i = 0; i < si->redzone_offsets.size(); i++) {
+                std::vector<uint8_t> color(si->redzone_sizes[i], REDZONE_COLOR);
+                fields[si->redzone_offsets[i]] =
+                    ConstantDataArray::get(context, ArrayRef<uint8_t>(color));
+            }
+            for (size_t i = 0; i < si->fields.size(); i++) {
+                size_t idx = si->offsetMapping.at(i);
+                fields[idx] = inflateInitializer(init->getAggregateElement(i),
+                                                 struct_type->getElementType(idx), context);
+            }
+            return ConstantStruct::get(struct_type, fields);
+        }
+        if (inflatedType->isPointerTy()) {
+            return ConstantExpr::getPointerCast(init, inflatedType);
+        }
+        return init;
+    }
+
     void rebuildCalls(Module *M, Function *oldFunc, Function *newFunc) {
         for (Function &F : *M) {
             for (BasicBlock &bb : F) {
@@ -641,7 +1116,140 @@ struct StructZoneSanitizer : PassInfoMixin<StructZoneSanitizer> {
         func->deleteBody();
     }
 
+    // Struct-path TBAA (clang -O1 and up) tells the fields of a struct apart by their offsets,
+    // which the inflation moves. The struct type nodes are rebuilt with the inflated offsets and
+    // the access tags are moved along. The redzones are left out of the new nodes, like padding:
+    // the program never accesses them, so no access to them aliases its data.
+    std::map<MDNode *, MDNode *> tbaa_types;
+    std::map<MDNode *, StructInfo *> tbaa_structs;
+
+    // The inflated struct that a TBAA struct type node describes, or NULL. Clang names the node
+    // after the struct (mangled in C++), and it has to list the fields at the original offsets.
+    StructInfo *getTBAAStruct(MDNode *node, const DataLayout &dl) {
+        if (tbaa_structs.count(node) > 0) {
+            return tbaa_structs[node];
+        }
+        tbaa_structs[node] = NULL;
+        auto *name = dyn_cast<MDString>(node->getOperand(0));
+        if (!name || node->getNumOperands() % 2 == 0) {
+            return NULL;
+        }
+        for (auto &[type, si] : struct_mapping) {
+            StructType *deflated = si->deflatedType;
+            if (type != deflated || deflated->getNumElements() != node->getNumOperands() / 2) {
+                continue;
+            }
+            // "struct.Pair.3" -> "Pair"
+            StringRef plain = deflated->getName().split('.').second;
+            StringRef suffix = plain.rsplit('.').second;
+            if (!suffix.empty() && suffix.find_first_not_of("0123456789") == StringRef::npos) {
+                plain = plain.rsplit('.').first;
+            }
+            if (name->getString() != plain &&
+                name->getString() != ("_ZTS" + Twine(plain.size()) + plain).str()) {
+                continue;
+            }
+            const StructLayout *layout = dl.getStructLayout(deflated);
+            bool sameOffsets = true;
+            for (unsigned i = 0; i < deflated->getNumElements(); i++) {
+                auto *offset = mdconst::dyn_extract<ConstantInt>(node->getOperand(2 + 2 * i));
+                sameOffsets &= offset && offset->getZExtValue() == layout->getElementOffset(i);
+            }
+            if (sameOffsets) {
+                tbaa_structs[node] = si.get();
+                return si.get();
+            }
+        }
+        return NULL;
+    }
+
+    // Where member i of a TBAA type node ends up.
+    uint64_t getTBAAMemberOffset(MDNode *node, unsigned i, const DataLayout &dl) {
+        if (StructInfo *si = getTBAAStruct(node, dl)) {
+            return dl.getStructLayout(si->inflatedType)->getElementOffset(si->offsetMapping.at(i));
+        }
+        return mdconst::extract<ConstantInt>(node->getOperand(2 + 2 * i))->getZExtValue();
+    }
+
+    // Every type node that (indirectly) contains a remapped struct is rebuilt as well, so that the
+    // tags that go through it agree with the ones that name the struct directly.
+    MDNode *remapTBAAType(MDNode *node, const DataLayout &dl) {
+        if (tbaa_types.count(node) > 0) {
+            return tbaa_types[node];
+        }
+        tbaa_types[node] = node;
+        if (!isa<MDString>(node->getOperand(0)) || node->getNumOperands() % 2 == 0) {
+            return node;
+        }
+        SmallVector<Metadata *> ops = {node->getOperand(0)};
+        for (unsigned i = 0; 2 + 2 * i < node->getNumOperands(); i++) {
+            auto *member = dyn_cast<MDNode>(node->getOperand(1 + 2 * i));
+            auto *offset = mdconst::dyn_extract<ConstantInt>(node->getOperand(2 + 2 * i));
+            if (!member || !offset) {
+                return node;
+            }
+            ops.push_back(remapTBAAType(member, dl));
+            ops.push_back(ConstantAsMetadata::get(
+                ConstantInt::get(offset->getType(), getTBAAMemberOffset(node, i, dl))));
+        }
+        tbaa_types[node] = MDNode::get(node->getContext(), ops);
+        return tbaa_types[node];
+    }
+
+    uint64_t remapTBAAOffset(MDNode *node, uint64_t offset, const DataLayout &dl) {
+        if (!isa<MDString>(node->getOperand(0)) || node->getNumOperands() % 2 == 0) {
+            return offset;
+        }
+        // The offset lies in the last member that starts at or before it.
+        MDNode *member = NULL;
+        unsigned index = 0;
+        uint64_t start = 0;
+        for (unsigned i = 0; 2 + 2 * i < node->getNumOperands(); i++) {
+            auto *candidate = dyn_cast<MDNode>(node->getOperand(1 + 2 * i));
+            auto *memberOffset = mdconst::dyn_extract<ConstantInt>(node->getOperand(2 + 2 * i));
+            if (!candidate || !memberOffset) {
+                return offset;
+            }
+            if (memberOffset->getZExtValue() <= offset) {
+                member = candidate;
+                index = i;
+                start = memberOffset->getZExtValue();
+            }
+        }
+        if (!member) {
+            return offset;
+        }
+        return getTBAAMemberOffset(node, index, dl) + remapTBAAOffset(member, offset - start, dl);
+    }
+
+    void remapTBAA(Module &M, const DataLayout &dl) {
+        for (Function &F : M) {
+            for (Instruction &inst : instructions(F)) {
+                // Describes a struct copy by the original offsets; the copies of inflated structs
+                // that matter were split into their payload already.
+                inst.setMetadata(LLVMContext::MD_tbaa_struct, NULL);
+                MDNode *tag = inst.getMetadata(LLVMContext::MD_tbaa);
+                if (!tag || tag->getNumOperands() < 3) {
+                    continue;
+                }
+                auto *base = dyn_cast<MDNode>(tag->getOperand(0));
+                auto *offset = mdconst::dyn_extract<ConstantInt>(tag->getOperand(2));
+                if (!base || !offset) {
+                    continue;
+                }
+                SmallVector<Metadata *> ops(tag->op_begin(), tag->op_end());
+                ops[0] = remapTBAAType(base, dl);
+                ops[2] = ConstantAsMetadata::get(ConstantInt::get(
+                    offset->getType(), remapTBAAOffset(base, offset->getZExtValue(), dl)));
+                inst.setMetadata(LLVMContext::MD_tbaa, MDNode::get(M.getContext(), ops));
+            }
+        }
+    }
+
     void save_mod(Module *M) {
+        if (!DebugTrace) {
+            return;
+        }
         std::error_code EC;
         raw_fd_ostream out("./last_executed_module.ll", EC, sys::fs::OF_Text);
         if (EC) {
@@ -664,26 +1272,34 @@ struct StructZoneSanitizer : PassInfoMixin<StructZoneSanitizer> {
         }
         DeepWalk(datalayout, context);
 		
-		std::vector<std::tuple<GlobalVariable*, Type*>> globals;
-		for (auto &glob : M.getGlobalList()) {
-			bool hasChanged = false;
-			auto *inflatedType = getInflatedType(glob.getType(), &hasChanged);
-			if (hasChanged) {
-				globals.push_back(std::make_tuple(&glob, inflatedType->getPointerElementType()));
-			}
-		}
-		for (auto tup : globals) {
-			auto *glob = std::get<0>(tup);
-			auto *inflatedType = std::get<1>(tup);
-			auto *new_glob = new GlobalVariable(M,
-					inflatedType, 
-					glob->isConstant(),
-					glob->getLinkage(),
-					Constant::getNullValue(inflatedType),
-					glob->getName() + ".inflated");
-			glob->replaceAllUsesWith(new_glob);
-			glob->eraseFromParent();
-		}
+        std::vector<std::tuple<GlobalVariable *, Type *>> globals;
+        for (auto &glob : M.getGlobalList()) {
+            bool hasChanged = false;
+            auto *inflatedType = getInflatedGlobalType(glob.getValueType(), &hasChanged);
+            if (hasChanged) {
+                globals.push_back(std::make_tuple(&glob, inflatedType));
+            }
+        }
+        for (auto tup : globals) {
+            auto *glob = std::get<0>(tup);
+            auto *inflatedType = std::get<1>(tup);
+            // Declarations stay declarations; the defining module provides the initializer.
+            Constant *initializer = nullptr;
+            if (glob->hasInitializer()) {
+                initializer = inflateInitializer(glob->getInitializer(), inflatedType, context);
+            }
+            auto *new_glob =
+                new GlobalVariable(M, inflatedType, glob->isConstant(), glob->getLinkage(),
+                                   initializer, glob->getName() + ".inflated");
+            new_glob->copyAttributesFrom(glob);
+            if (new_glob->hasCommonLinkage() && !initializer->isNullValue()) {
+                // Common globals have to be zero. A weak one still merges with the tentative
+                // definitions in other modules.
+                new_glob->setLinkage(GlobalValue::WeakAnyLinkage);
+            }
+            glob->replaceAllUsesWith(new_glob);
+            glob->eraseFromParent();
+        }
         SmallVector<Function *> funcs;
         for (auto &func : M) {
             funcs.push_back(&func);
@@ -692,12 +1308,16 @@ struct StructZoneSanitizer : PassInfoMixin<StructZoneSanitizer> {
             transformFuncSig(func, &struct_mapping);
         }
         for (auto &func : M) {
-        	outs() << "Started resolving function: " << func.getName() << "\n";
-        	to_resolve.clear();
+            if (DebugTrace) {
+                outs() << "Started resolving function: " << func.getName() << "\n";
+            }
+            to_resolve.clear();
             // Then it is an external function, and must be linked. We can't instrument this -
             // though it is probably interesting in a later stage for inflating/deflating structs.
             if (func.isDeclaration()) {
-            	outs() << "Finished function: " << func.getName() << "\n";
+                if (DebugTrace) {
+                    outs() << "Finished function: " << func.getName() << "\n";
+                }
                 continue;
             }
             // Here, we store instructions and the replacements they will get. This construction is
@@ -747,23 +1367,29 @@ struct StructZoneSanitizer : PassInfoMixin<StructZoneSanitizer> {
                     new_phi->addIncoming(phi_inst->getIncomingValue(i),
                                          phi_inst->getIncomingBlock(i));
                 }
+                new_phi->takeName(phi_inst);
                 phi_inst->replaceAllUsesWith(new_phi);
                 phi_inst->eraseFromParent();
                 bitcast->replaceAllUsesWith(new_phi);
                 bitcast->eraseFromParent();
                 save_mod(&M);
             }
-            outs() << "Finished function: " << func.getName() << "\n";
+            if (DebugTrace) {
+                outs() << "Finished function: " << func.getName() << "\n";
+            }
             save_mod(&M);
         }
         // Some more TODO's:
         // see if we can move to storing marker values in redzones, and only walking the tree if
         // we detect a marker value (but what about unaligned reads?)
 
+        remapTBAA(M, datalayout);
         setupRedzoneChecks(&struct_mapping, M, &heapStructInfo);
         populate_delicate_functions(&struct_mapping, &M.getContext());
         save_mod(&M);
-		outs() << "Finished pass!\n";
+        if (DebugTrace) {
+            outs() << "Finished pass!\n";
+        }
         return PreservedAnalyses::none();
     }
 };
@@ -781,5 +1407,12 @@ extern "C" LLVM_ATTRIBUTE_WEAK llvm::PassPluginLibraryInfo llvmGetPassPluginInfo
                     }
                     return false;
                 });
+                // For clang -fpass-plugin: instrument the code before the optimizer sees it, so
+                // that the checks and the inflated structs are optimized along with everything
+                // else. The pass expects the locals promoted, as with the explicit pipeline.
+                PB.registerPipelineStartEPCallback([](ModulePassManager &PM, OptimizationLevel) {
+                    PM.addPass(createModuleToFunctionPassAdaptor(RequiredPromotePass()));
+                    PM.addPass(StructZoneSanitizer());
+                });
             }};
 }
@@ -5,12 +5,26 @@
 #include <map>
 
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/xxhash.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
 #include "llvm/Transforms/Utils/Cloning.h"
 
 #include "functionTransformer.h"
 #include "redzone.h"
-#include "utils.h"
+
+enum class AbiMode { Local, Exported };
+
+static cl::opt<AbiMode> Abi(
+    "structzone-abi", cl::desc("How instrumented functions are linked across translation units"),
+    cl::values(clEnumValN(AbiMode::Local, "local",
+                          "Inflated functions are internal; only main can be called from outside "
+                          "(default)"),
+               clEnumValN(AbiMode::Exported, "exported",
+                          "Inflated functions are exported under a name that encodes their "
+                          "layout, so that instrumented modules call each other without copies")),
+    cl::init(AbiMode::Local));
 
 Type *getInflatedType(Type *arg_type, StructMap *struct_mapping, bool *changed = NULL) {
     int pointer_layers = 0;
@@ -67,6 +81,63 @@ void rebuildCalls(Module *M, Function *oldFunc, Function *newFunc) {
     }
 }
 
+// Spells out a type down to the bodies of the structs in it. Struct names are left out: the same
+// struct may be named differently in two modules, or be laid out differently under the same name.
+void appendTypeSignature(Type *type, raw_ostream &os, std::map<StructType *, unsigned> *seen) {
+    if (auto *s = dyn_cast<StructType>(type)) {
+        if (seen->count(s) > 0) {
+            os << "#" << seen->at(s);
+            return;
+        }
+        unsigned id = seen->size();
+        seen->insert({s, id});
+        if (s->isOpaque()) {
+            os << "opaque";
+            return;
+        }
+        os << (s->isPacked() ? "<{" : "{");
+        for (Type *element : s->elements()) {
+            appendTypeSignature(element, os, seen);
+            os << ",";
+        }
+        os << (s->isPacked() ? "}>" : "}");
+    } else if (auto *p = dyn_cast<PointerType>(type)) {
+        appendTypeSignature(p->getPointerElementType(), os, seen);
+        os << "*" << p->getAddressSpace();
+    } else if (auto *a = dyn_cast<ArrayType>(type)) {
+        os << "[" << a->getNumElements() << "x";
+        appendTypeSignature(a->getElementType(), os, seen);
+        os << "]";
+    } else if (auto *f = dyn_cast<FunctionType>(type)) {
+        appendTypeSignature(f->getReturnType(), os, seen);
+        os << "(";
+        for (Type *param : f->params()) {
+            appendTypeSignature(param, os, seen);
+            os << ",";
+        }
+        os << (f->isVarArg() ? "...)" : ")");
+    } else {
+        type->print(os);
+    }
+}
+
+// The symbol an inflated function is exported under with -structzone-abi=exported. It carries a
+// hash of the inflated signature, so a caller built with a different layout (other options, or a
+// struct that differs between the modules) does not link against it and falls back to copying.
+std::string inflatedAbiName(StringRef name, FunctionType *inflatedType, const DataLayout &dl) {
+    std::string signature;
+    raw_string_ostream os(signature);
+    std::map<StructType *, unsigned> seen;
+    os << dl.getStringRepresentation() << ";";
+    appendTypeSignature(inflatedType, os, &seen);
+    os.flush();
+
+    std::string abiName;
+    raw_string_ostream nameOs(abiName);
+    nameOs << name << ".inflated." << format_hex_no_prefix(xxHash64(signature), 16);
+    return nameOs.str();
+}
+
 void addDeflationToLibFunc(Function *func) {
     // this is a function called by us
 }
@@ -101,17 +172,32 @@ std::map<Function *, Function *> exportedFuncsToWrap; // inflated to original
 std::map<Function *, Function *> libraryFuncsToWrap;  // inflated to original
 
 Function *makeInflatedClone(Function *original, StructMap *struct_mapping) {
-    bool hasStructArgs;
+    bool hasStructArgs = false;
     ValueToValueMapTy map;
 
     Function *newFunc = createInflatedEmpty(original, struct_mapping, &hasStructArgs);
-    errs() << "exported func: " << original->getName() << " has a twin: " << newFunc->getName()
-           << "\n";
     for (size_t i = 0; i < newFunc->arg_size(); i++) {
         map.insert({original->getArg(i), newFunc->getArg(i)});
     }
     SmallVector<ReturnInst *> returns;
     CloneFunctionInto(newFunc, original, map, CloneFunctionChangeType::LocalChangesOnly, returns);
+
+    if (Abi == AbiMode::Exported && !original->hasLocalLinkage()) {
+        // Other modules call the clone directly: it keeps the linkage of the original, and either
+        // its name (nothing changed) or one that pins the inflated layout down.
+        newFunc->setLinkage(original->getLinkage());
+        newFunc->setVisibility(original->getVisibility());
+        newFunc->setDSOLocal(original->isDSOLocal());
+        newFunc->setComdat(original->getComdat());
+        if (!hasStructArgs) {
+            std::string name = original->getName().str();
+            original->eraseFromParent();
+            newFunc->setName(name);
+            return newFunc;
+        }
+        newFunc->setName(inflatedAbiName(original->getName(), newFunc->getFunctionType(),
+                                         original->getParent()->getDataLayout()));
+    }
     original->deleteBody();
 
     exportedFuncsToWrap.insert({newFunc, original});
@@ -124,10 +210,8 @@ Function *makeInflatedClone(Function *original, StructMap *struct_mapping) {
 }
 
 Function *makeInflatedWrapper(Function *original, StructMap *struct_mapping) {
-    bool hasStructArgs;
+    bool hasStructArgs = false;
     Function *newFunc = createInflatedEmpty(original, struct_mapping, &hasStructArgs);
-    errs() << "library func: " << original->getName() << " has a twin " << newFunc->getName()
-           << "\n";
     libraryFuncsToWrap.insert({newFunc, original});
 
     return newFunc;
@@ -137,26 +221,152 @@ void transformFuncSig(Function *original, StructMap *struct_mapping) {
     Function *replacement = NULL;
     if (original->isIntrinsic()) {
         return;
+    } else if (original->isDeclaration() && isIntercepted(original->getName())) {
+        // Calls go to the runtime's checked version instead (see setupRedzoneChecks).
+        return;
     } else if (original->isDeclaration()) {
+        bool hasStructArgs = false;
+        getInflatedType(original->getFunctionType(), struct_mapping, &hasStructArgs);
+        if (!hasStructArgs && original->isVarArg()) {
+            // A wrapper could not pass the variadic arguments of e.g. printf on, and there is
+            // nothing to convert anyway.
+            return;
+        }
         replacement = makeInflatedWrapper(original, struct_mapping);
     } else {
         replacement = makeInflatedClone(original, struct_mapping);
     }
 }
 
-Value *makeStructAccessGEP(IRBuilder<> *b, StructType *structTy, Value *ptrToStruct, int fieldIdx,
-                           std::string annot = "") {
-    LLVMContext *C = &b->getContext();
-    SmallVector<Value *> indeces = {ConstantInt::get(IntegerType::getInt32Ty(*C), 0),
-                                    ConstantInt::get(IntegerType::getInt32Ty(*C), fieldIdx)};
-    errs() << "  GEP " << structTy->getName() << " " << *ptrToStruct << " [0," << fieldIdx << "]\n";
-    return b->CreateGEP(structTy, ptrToStruct, indeces, "sa_" + std::to_string(fieldIdx) + annot);
+// The converters made so far, per (original struct, direction).
+std::map<std::pair<StructType *, bool>, Function *> converters;
+
+Function *getConverter(StructInfo *info, Module *M, StructMap *structMap, bool isInflate);
+
+// Converts `count` consecutive structs, one converter call per element.
+void emitConvertLoop(IRBuilder<> *b, Function *converter, Value *dst, Value *src, uint64_t count) {
+    LLVMContext &C = b->getContext();
+    Function *F = b->GetInsertBlock()->getParent();
+    Type *dstType = dst->getType()->getPointerElementType();
+    Type *srcType = src->getType()->getPointerElementType();
+    BasicBlock *pre = b->GetInsertBlock();
+    BasicBlock *loop = BasicBlock::Create(C, "convert", F);
+    BasicBlock *done = BasicBlock::Create(C, "converted", F);
+    b->CreateBr(loop);
+    b->SetInsertPoint(loop);
+    PHINode *i = b->CreatePHI(b->getInt64Ty(), 2);
+    i->addIncoming(b->getInt64(0), pre);
+    b->CreateCall(converter,
+                  {b->CreateGEP(dstType, dst, i), b->CreateGEP(srcType, src, i)});
+    Value *next = b->CreateAdd(i, b->getInt64(1));
+    i->addIncoming(next, loop);
+    b->CreateCondBr(b->CreateICmpULT(next, b->getInt64(count)), loop, done);
+    b->SetInsertPoint(done);
+}
+
+// Fills in a converter: fields that sit next to each other (with the same padding) on both sides
+// are copied with a single memcpy, and nested structs are handed to their own converters.
+void buildConverter(Function *F, StructInfo *info, StructMap *structMap, bool isInflate) {
+    Module *M = F->getParent();
+    LLVMContext &C = M->getContext();
+    const DataLayout &dl = M->getDataLayout();
+    StructType *from = isInflate ? info->deflatedType : info->inflatedType;
+    StructType *to = isInflate ? info->inflatedType : info->deflatedType;
+    const StructLayout *fromLayout = dl.getStructLayout(from);
+    const StructLayout *toLayout = dl.getStructLayout(to);
+
+    IRBuilder<> b(BasicBlock::Create(C, "ENTRY", F));
+    Value *dst = b.CreateBitCast(F->getArg(0), b.getInt8PtrTy());
+    Value *src = b.CreateBitCast(F->getArg(1), b.getInt8PtrTy());
+
+    // The pending run of fields: where it starts on both sides, its length, and the index of its
+    // last field in the inflated type.
+    uint64_t runFrom = 0, runTo = 0, runSize = 0;
+    size_t runLast = 0;
+    auto flush = [&]() {
+        if (runSize > 0) {
+            b.CreateMemCpy(b.CreateConstInBoundsGEP1_64(b.getInt8Ty(), dst, runTo),
+                           commonAlignment(toLayout->getAlignment(), runTo),
+                           b.CreateConstInBoundsGEP1_64(b.getInt8Ty(), src, runFrom),
+                           commonAlignment(fromLayout->getAlignment(), runFrom), runSize);
+        }
+        runSize = 0;
+    };
+
+    for (size_t i = 0; i < info->fields.size(); i++) {
+        size_t inflatedIdx = info->offsetMapping.at(i);
+        size_t fromIdx = isInflate ? i : inflatedIdx;
+        size_t toIdx = isInflate ? inflatedIdx : i;
+        uint64_t fromOffset = fromLayout->getElementOffset(fromIdx);
+        uint64_t toOffset = toLayout->getElementOffset(toIdx);
+
+        // A nested struct (or array of them) is laid out differently on both sides.
+        Type *fieldType = info->deflatedType->getElementType(i);
+        uint64_t count = 1;
+        while (auto *arrType = dyn_cast<ArrayType>(fieldType)) {
+            count *= arrType->getNumElements();
+            fieldType = arrType->getElementType();
+        }
+        if (fieldType->isStructTy() && count > 0) {
+            flush();
+            StructInfo *nested = structMap->at(fieldType).get();
+            Function *converter = getConverter(nested, M, structMap, isInflate);
+            Type *dstType = isInflate ? nested->inflatedType : nested->deflatedType;
+            Type *srcType = isInflate ? nested->deflatedType : nested->inflatedType;
+            Value *nestedDst = b.CreateBitCast(
+                b.CreateConstInBoundsGEP1_64(b.getInt8Ty(), dst, toOffset), dstType->getPointerTo());
+            Value *nestedSrc =
+                b.CreateBitCast(b.CreateConstInBoundsGEP1_64(b.getInt8Ty(), src, fromOffset),
+                                srcType->getPointerTo());
+            if (count == 1) {
+                b.CreateCall(converter, {nestedDst, nestedSrc});
+            } else {
+                emitConvertLoop(&b, converter, nestedDst, nestedSrc, count);
+            }
+            continue;
+        }
+
+        uint64_t size = dl.getTypeAllocSize(info->deflatedType->getElementType(i));
+        // Without a redzone in between, the padding between the two fields is the same on both
+        // sides, so it can just be copied along.
+        if (runSize > 0 && inflatedIdx == runLast + 1 && fromOffset - runFrom == toOffset - runTo) {
+            runSize = fromOffset + size - runFrom;
+        } else {
+            flush();
+            runFrom = fromOffset;
+            runTo = toOffset;
+            runSize = size;
+        }
+        runLast = inflatedIdx;
+    }
+    flush();
+    b.CreateRetVoid();
+}
+
+// Returns the function that copies the fields of a struct into its inflated twin (or back, when
+// deflating): void (to *dst, from *src). It is made the first time a type needs it, so every
+// wrapper shares a single copy routine per type.
+Function *getConverter(StructInfo *info, Module *M, StructMap *structMap, bool isInflate) {
+    auto key = std::make_pair(info->deflatedType, isInflate);
+    if (converters.count(key) > 0 && converters[key]->getParent() == M) {
+        return converters[key];
+    }
+    StructType *from = isInflate ? info->deflatedType : info->inflatedType;
+    StructType *to = isInflate ? info->inflatedType : info->deflatedType;
+    FunctionType *type = FunctionType::get(Type::getVoidTy(M->getContext()),
+                                           {to->getPointerTo(), from->getPointerTo()}, false);
+    Function *F = Function::Create(type, Function::InternalLinkage,
+                                   info->deflatedType->getName() + (isInflate ? ".inflate" : ".deflate"),
+                                   M);
+    F->addFnAttr(Attribute::NoUnwind);
+    converters[key] = F;
+    buildConverter(F, info, structMap, isInflate);
+    return F;
 }
 
 Value *makeFlator(Value *original, IRBuilder<> *b, StructMap *structMap,
                   std::map<Value *, Value *> *writebackQ, bool isInflate, Value *newStruct = NULL) {
 
-    LLVMContext *C = &b->getContext();
     if (original->getType()->isStructTy()) {
         /* this case is extremely complicated */
         assert(false);
@@ -165,85 +375,256 @@ Value *makeFlator(Value *original, IRBuilder<> *b, StructMap *structMap,
         assert(false);
     } else if (original->getType()->isPointerTy() &&
                original->getType()->getPointerElementType()->isStructTy()) {
-        errs() << "inserting " << (isInflate ? "in" : "de") << "flator for " << *original << "\n";
         StructType *ogType = dyn_cast<StructType>(original->getType()->getPointerElementType());
         StructInfo *info = structMap->at(ogType).get();
         StructType *newType = isInflate ? info->inflatedType : info->deflatedType;
 
         assert(ogType);
-        assert(isInflate ? ogType->elements().size() < newType->elements().size()
-                         : newType->elements().size() < ogType->elements().size());
+        assert(ogType == (isInflate ? info->deflatedType : info->inflatedType));
 
         newStruct = newStruct ? newStruct : b->CreateAlloca(newType, 0, "newStruct");
         assert(newStruct->getType()->isPointerTy());
         assert(newStruct->getType()->getPointerElementType() == newType);
 
-        int i = 0;
-        auto it = isInflate ? ogType->element_begin() : newType->element_begin();
-        auto end = isInflate ? ogType->element_end() : newType->element_end();
-
-        for (; it != end; it++) {
-            Value *ptrToOgField = makeStructAccessGEP(
-                b, ogType, original, (isInflate ? i : info->offsetMapping.at(i)), "_og");
-            Value *ptrToNewField = makeStructAccessGEP(
-                b, newType, newStruct, (isInflate ? info->offsetMapping.at(i) : i), "_new");
-            i++;
-            Value *sizeofField = createSizeof(b, *it);
-            CallInst *memcpy = b->CreateMemCpy(ptrToNewField, MaybeAlign(), ptrToOgField,
-                                               MaybeAlign(), sizeofField);
-        }
+        Module *M = b->GetInsertBlock()->getModule();
+        b->CreateCall(getConverter(info, M, structMap, isInflate), {newStruct, original});
         if (writebackQ) {
             writebackQ->insert({newStruct, original});
         }
 
         return newStruct;
     } else {
-        errs() << "Value does not have to be copied\n";
         return original;
     }
 }
 
+// What a callee does with the struct behind a pointer argument, which decides the copies its
+// wrapper has to make.
+enum class ArgUse {
+    // Anything; copied in before the call and back after it.
+    ReadWrite,
+    // Only read; not copied back.
+    ReadOnly,
+    // Filled in completely if the call returns 0, and left alone otherwise; not copied in, and only
+    // copied back on success.
+    WriteOnly,
+    // Never dereferenced (e.g. an opaque handle); passed through as it is.
+    Opaque,
+};
+
+struct LibcArg {
+    const char *name;
+    unsigned arg;
+    ArgUse use;
+};
+
+// Library functions whose struct arguments are known better than their declarations tell.
+const LibcArg knownLibcArgs[] = {
+    {"asctime", 0, ArgUse::ReadOnly},       {"asctime_r", 0, ArgUse::ReadOnly},
+    {"strftime", 3, ArgUse::ReadOnly},      {"nanosleep", 0, ArgUse::ReadOnly},
+    {"settimeofday", 0, ArgUse::ReadOnly},  {"clock_settime", 1, ArgUse::ReadOnly},
+    {"setrlimit", 1, ArgUse::ReadOnly},     {"setitimer", 1, ArgUse::ReadOnly},
+    {"utime", 1, ArgUse::ReadOnly},         {"bind", 1, ArgUse::ReadOnly},
+    {"connect", 1, ArgUse::ReadOnly},       {"sendto", 4, ArgUse::ReadOnly},
+    {"stat", 1, ArgUse::WriteOnly},         {"lstat", 1, ArgUse::WriteOnly},
+    {"fstat", 1, ArgUse::WriteOnly},        {"fstatat", 2, ArgUse::WriteOnly},
+    {"stat64", 1, ArgUse::WriteOnly},       {"lstat64", 1, ArgUse::WriteOnly},
+    {"fstat64", 1, ArgUse::WriteOnly},      {"statfs", 1, ArgUse::WriteOnly},
+    {"fstatfs", 1, ArgUse::WriteOnly},      {"statvfs", 1, ArgUse::WriteOnly},
+    {"fstatvfs", 1, ArgUse::WriteOnly},     {"gettimeofday", 0, ArgUse::WriteOnly},
+    {"clock_gettime", 1, ArgUse::WriteOnly}, {"clock_getres", 1, ArgUse::WriteOnly},
+    {"getrusage", 1, ArgUse::WriteOnly},    {"getrlimit", 1, ArgUse::WriteOnly},
+    {"getitimer", 1, ArgUse::WriteOnly},    {"uname", 0, ArgUse::WriteOnly},
+    {"sysinfo", 0, ArgUse::WriteOnly},
+};
+
+// Structs that libc only hands out pointers to and takes back as they are, and that programs do not
+// look inside. A copy would be a handle libc does not know, so these are passed through.
+const char *const libcHandles[] = {"struct._IO_FILE"};
+
+bool isLibcHandle(Type *type) {
+    auto *ptrType = dyn_cast<PointerType>(type);
+    auto *structType = ptrType ? dyn_cast<StructType>(ptrType->getPointerElementType()) : nullptr;
+    if (!structType || !structType->hasName()) {
+        return false;
+    }
+    StringRef name = structType->getName();
+    name.consume_back(".inflated");
+    for (const char *handle : libcHandles) {
+        if (name == handle) {
+            return true;
+        }
+    }
+    return false;
+}
+
+ArgUse getArgUse(Function *callee, unsigned arg) {
+    if (isLibcHandle(callee->getArg(arg)->getType())) {
+        return ArgUse::Opaque;
+    }
+    if (callee->hasParamAttribute(arg, Attribute::ReadNone) || callee->doesNotAccessMemory()) {
+        return ArgUse::Opaque;
+    }
+    if (callee->hasParamAttribute(arg, Attribute::ReadOnly) || callee->onlyReadsMemory()) {
+        return ArgUse::ReadOnly;
+    }
+    for (const LibcArg &known : knownLibcArgs) {
+        if (callee->getName() == known.name && arg == known.arg) {
+            return known.use;
+        }
+    }
+    return ArgUse::ReadWrite;
+}
+
+// A struct returned by pointer has to outlive the wrapper, so it is copied into storage of the
+// wrapper's own, per thread, much like localtime and gmtime keep their result: it stays valid
+// until the next call in the same thread. A null result is passed on as it is.
+Value *makeReturnedFlator(CallInst *result, IRBuilder<> *b, StructMap *structMap,
+                          Function *wrapper, bool isInflate) {
+    LLVMContext &C = wrapper->getContext();
+    StructInfo *info = structMap->at(result->getType()->getPointerElementType()).get();
+    StructType *newType = isInflate ? info->inflatedType : info->deflatedType;
+    auto *storage = new GlobalVariable(*wrapper->getParent(), newType, false,
+                                       GlobalValue::InternalLinkage,
+                                       Constant::getNullValue(newType),
+                                       wrapper->getName() + ".result", nullptr,
+                                       GlobalValue::GeneralDynamicTLSModel);
+
+    BasicBlock *callBB = b->GetInsertBlock();
+    BasicBlock *copyBB = BasicBlock::Create(C, "RESULT", wrapper);
+    BasicBlock *retBB = BasicBlock::Create(C, "RETURN", wrapper);
+    b->CreateCondBr(b->CreateIsNull(result), retBB, copyBB);
+    b->SetInsertPoint(copyBB);
+    makeFlator(result, b, structMap, NULL, isInflate, storage);
+    b->CreateBr(retBB);
+    b->SetInsertPoint(retBB);
+    PHINode *returned = b->CreatePHI(storage->getType(), 2);
+    returned->addIncoming(ConstantPointerNull::get(storage->getType()), callBB);
+    returned->addIncoming(storage, copyBB);
+    return returned;
+}
+
 /***
  * @param isInflate means here that we'd be starting with inflated arguments,
  * converting those to deflated arguments, calling and inflating them once again.
  * In other words: we are inflating the original function.
+ * @param direct if set, a weak reference to an inflated version of the callee, which is called
+ * with the arguments as they are whenever it turns out to be linked in.
  */
 void createFlationWrapper(StructMap *structMap, LLVMContext *C, Function *wrapper,
-                          Function *originalFunc, bool isInflate) {
-    errs() << "creating " << (isInflate ? "in" : "de") << "flation for " << originalFunc->getName()
-           << " at " << wrapper->getName() << "\n";
+                          Function *originalFunc, bool isInflate, Function *direct = NULL) {
     IRBuilder<> b(*C);
     BasicBlock *entryBB = BasicBlock::Create(*C, // create a new body in this function
                                              "ENTRY", wrapper);
     b.SetInsertPoint(entryBB);
 
+    if (direct) {
+        BasicBlock *directBB = BasicBlock::Create(*C, "DIRECT", wrapper);
+        BasicBlock *copyBB = BasicBlock::Create(*C, "COPY", wrapper);
+        b.CreateCondBr(b.CreateIsNotNull(direct), directBB, copyBB);
+        b.SetInsertPoint(directBB);
+        SmallVector<Value *> args;
+        for (Argument &arg : wrapper->args()) {
+            args.push_back(&arg);
+        }
+        CallInst *result = b.CreateCall(direct, args);
+        if (result->getType()->isVoidTy()) {
+            b.CreateRetVoid();
+        } else {
+            b.CreateRet(result);
+        }
+        b.SetInsertPoint(copyBB);
+    }
+
     SmallVector<Value *> newArgs;
     std::map<Value *, Value *> structsToWriteBack;
+    // Written back only if the call succeeds.
+    std::map<Value *, Value *> outputsToWriteBack;
     for (Argument &ogArg : wrapper->args()) {
         PointerType *ptrTy = dyn_cast<PointerType>(ogArg.getType());
         if (ptrTy && ptrTy->getPointerElementType()->isStructTy()) {
-            newArgs.push_back(makeFlator(&ogArg, &b, structMap, &structsToWriteBack, !isInflate));
+            Type *paramType = originalFunc->getArg(ogArg.getArgNo())->getType();
+            switch (getArgUse(originalFunc, ogArg.getArgNo())) {
+            case ArgUse::Opaque:
+                newArgs.push_back(b.CreateBitCast(&ogArg, paramType));
+                break;
+            case ArgUse::ReadOnly:
+                newArgs.push_back(makeFlator(&ogArg, &b, structMap, NULL, !isInflate));
+                break;
+            case ArgUse::WriteOnly: {
+                Value *output = b.CreateAlloca(paramType->getPointerElementType(), 0, "newStruct");
+                outputsToWriteBack.insert({output, &ogArg});
+                newArgs.push_back(output);
+                break;
+            }
+            case ArgUse::ReadWrite:
+                newArgs.push_back(
+                    makeFlator(&ogArg, &b, structMap, &structsToWriteBack, !isInflate));
+                break;
+            }
         } else if (ogArg.getType()->isStructTy()) {
             assert(false);
         } else {
-            newArgs.push_back(&ogArg);
+            // Pointers to struct pointers and the like only change type.
+            newArgs.push_back(
+                b.CreateBitCast(&ogArg, originalFunc->getArg(ogArg.getArgNo())->getType()));
         }
     }
     CallInst *ogRetVal = b.CreateCall(originalFunc, newArgs);
 
-    // TODO: write back here
     for (auto [from, to] : structsToWriteBack) {
         makeFlator(from, &b, structMap, NULL, isInflate, to);
     }
+    if (!outputsToWriteBack.empty()) {
+        BasicBlock *writeBack = BasicBlock::Create(*C, "WRITEBACK", wrapper);
+        BasicBlock *done = BasicBlock::Create(*C, "DONE", wrapper);
+        Value *succeeded = ogRetVal->getType()->isIntegerTy()
+                               ? b.CreateICmpEQ(ogRetVal, ConstantInt::get(ogRetVal->getType(), 0))
+                               : b.getTrue();
+        b.CreateCondBr(succeeded, writeBack, done);
+        b.SetInsertPoint(writeBack);
+        for (auto [from, to] : outputsToWriteBack) {
+            makeFlator(from, &b, structMap, NULL, isInflate, to);
+        }
+        b.CreateBr(done);
+        b.SetInsertPoint(done);
+    }
 
     if (originalFunc->getReturnType() != Type::getVoidTy(*C)) {
-        Value *inflRetVal = makeFlator(ogRetVal, &b, structMap, &structsToWriteBack, isInflate);
-        b.CreateRet(inflRetVal);
+        PointerType *retType = dyn_cast<PointerType>(ogRetVal->getType());
+        Value *inflRetVal = ogRetVal;
+        if (retType && isLibcHandle(retType)) {
+            // Passed through, like the handles that go in.
+        } else if (retType && retType->getPointerElementType()->isStructTy()) {
+            inflRetVal = makeReturnedFlator(ogRetVal, &b, structMap, wrapper, isInflate);
+        } else {
+            inflRetVal = makeFlator(ogRetVal, &b, structMap, NULL, isInflate);
+        }
+        b.CreateRet(b.CreateBitCast(inflRetVal, wrapper->getReturnType()));
     } else {
         b.CreateRet(NULL);
     }
 }
 
+// Whether callers that pass deflated structs can be given a wrapper around the inflated version of
+// F. The wrappers copy structs behind pointers only, and those they would return would not outlive
+// the wrapper.
+bool canWrapExported(Function *F) {
+    if (F->isVarArg() || F->getReturnType()->isStructTy()) {
+        return false;
+    }
+    PointerType *ret = dyn_cast<PointerType>(F->getReturnType());
+    if (ret && ret->getPointerElementType()->isStructTy()) {
+        return false;
+    }
+    for (Argument &arg : F->args()) {
+        if (arg.getType()->isStructTy() || arg.getType()->isArrayTy()) {
+            return false;
+        }
+    }
+    return true;
+}
+
 void populate_delicate_functions(StructMap *structMap, LLVMContext *C) {
     /**
      * for every function in the library_call_queue:
@@ -256,7 +637,20 @@ void populate_delicate_functions(StructMap *structMap, LLVMContext *C) {
     for (std::pair<Function *, Function *> pair : libraryFuncsToWrap) {
         Function *inflatedFunc = pair.first;
         Function *originalFunc = pair.second;
-        createFlationWrapper(structMap, C, inflatedFunc, originalFunc, true);
+        Function *direct = NULL;
+        if (Abi == AbiMode::Exported &&
+            inflatedFunc->getFunctionType() != originalFunc->getFunctionType()) {
+            // Defined by a module instrumented with the same layout, if at all.
+            Module *M = originalFunc->getParent();
+            std::string name = inflatedAbiName(originalFunc->getName(),
+                                               inflatedFunc->getFunctionType(), M->getDataLayout());
+            direct = M->getFunction(name);
+            if (!direct) {
+                direct = Function::Create(inflatedFunc->getFunctionType(),
+                                          Function::ExternalWeakLinkage, name, M);
+            }
+        }
+        createFlationWrapper(structMap, C, inflatedFunc, originalFunc, true, direct);
     }
     for (std::pair<Function *, Function *> pair : exportedFuncsToWrap) {
         Function *inflatedFunc = pair.first;
@@ -266,6 +660,14 @@ void populate_delicate_functions(StructMap *structMap, LLVMContext *C) {
         // is create deflator wrappers around all functions; this messes with function pointers.
         if (originalFunc->getName() == "main") {
             createFlationWrapper(structMap, C, originalFunc, inflatedFunc, false);
+        } else if (Abi == AbiMode::Exported && !inflatedFunc->hasLocalLinkage() &&
+                   canWrapExported(originalFunc)) {
+            // For callers that were not instrumented. Calls from within the module already go to
+            // the inflated version, so function pointers are not an issue here.
+            originalFunc->setLinkage(inflatedFunc->getLinkage());
+            originalFunc->setVisibility(inflatedFunc->getVisibility());
+            originalFunc->setComdat(inflatedFunc->getComdat());
+            createFlationWrapper(structMap, C, originalFunc, inflatedFunc, false);
         }
     }
 }
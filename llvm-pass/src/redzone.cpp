@@ -3,20 +3,124 @@
 #include "llvm/Passes/PassPlugin.h"
 #include "llvm/Support/raw_ostream.h"
 
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/BinaryFormat/Dwarf.h"
+#include "llvm/IR/DebugInfo.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/GetElementPtrTypeIterator.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/xxhash.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
 #include <stack>
 #include <stdio.h>
 
+static cl::opt<bool> BatchChecks(
+    "structzone-batch-checks",
+    cl::desc("Group independent redzone checks within a basic block into one "
+             "__rdzone_check_batch call"),
+    cl::init(false));
+
+static cl::opt<bool> ProfileSites(
+    "structzone-profile-sites",
+    cl::desc("Give every check its own site, counted by the runtime and written to "
+             "STRUCTZONE_PROFILE at exit (implies no batching)"),
+    cl::init(false));
+
+static cl::list<std::string>
+    ProfileFiles("structzone-profile",
+                 cl::desc("Profile written by a -structzone-profile-sites build; repeat to merge "
+                          "several runs. Hot checks that never saw a colored byte are dropped"),
+                 cl::value_desc("file"));
+
+static cl::opt<uint64_t> ProfileHotThreshold(
+    "structzone-profile-hot",
+    cl::desc("Executions after which a check without color hits counts as hot"),
+    cl::init(10000));
+
+static cl::opt<bool> SampleChecks(
+    "structzone-sample-checks",
+    cl::desc("Only check about one in STRUCTZONE_SAMPLE_RATE accesses per thread, behind an "
+             "inline countdown (ignored with -structzone-profile-sites)"),
+    cl::init(false));
+
+static cl::opt<bool> Multiversion(
+    "structzone-multiversion",
+    cl::desc("Give every function with checks an unchecked twin, picked at each call through "
+             "the runtime's __rdzone_checks_enabled flag (STRUCTZONE_CHECKS)"),
+    cl::init(false));
+
+// Upper bound on the number of checks in a single batch.
+const size_t MAX_BATCH_SIZE = 16;
+
 struct Runtime {
     Function *rdzone_add_f;
     Function *rdzone_check_f;
     Function *rdzone_rm_f;
     Function *rdzone_heaprm_f;
     Function *rdzone_rm_between_f;
+    Function *rdzone_check_batch_f;
+    Function *rdzone_register_globals_f;
+    Function *rdzone_usable_size_f;
+    Function *rdzone_move_f;
+    Function *rdzone_add_elems_f;
+    Function *rdzone_add_typed_f;
+    Function *rdzone_check_site_f;
+    Function *rdzone_check_sampled_f;
+    Function *rdzone_check_batch_sampled_f;
+    GlobalVariable *rdzone_sample_countdown;
+    GlobalVariable *rdzone_checks_enabled;
 };
 
+// Redzone layout tables by type, with their length in (offset, size) pairs.
+typedef std::map<Type *, std::tuple<Constant *, uint64_t>> LayoutTableMap;
+
+// The type descriptors emitted so far, and the struct types of the debug info by name.
+struct TypeDescriptors {
+    std::map<Type *, Constant *> descs;
+    std::map<std::string, DICompositeType *> debugTypes;
+    bool debugScanned = false;
+};
+
+// Values of enum rdzone_kind in the runtime.
+const uint32_t RDZONE_STACK = 1;
+const uint32_t RDZONE_HEAP = 2;
+
+// Mirrors struct rdzone_global in the runtime: {base, layout, layout_len, stride, count, type}.
+StructType *getGlobalDescType(LLVMContext &C) {
+    Type *i64 = Type::getInt64Ty(C);
+    return StructType::get(Type::getInt8PtrTy(C), i64->getPointerTo(), i64, i64, i64,
+                           Type::getInt8PtrTy(C));
+}
+
+// Mirrors struct rdzone_field in the runtime: {name, offset, size, type}.
+StructType *getFieldDescType(LLVMContext &C) {
+    Type *i64 = Type::getInt64Ty(C);
+    return StructType::get(Type::getInt8PtrTy(C), i64, i64, Type::getInt8PtrTy(C));
+}
+
+// Mirrors struct rdzone_type in the runtime: {name, size, field_count, fields}.
+StructType *getTypeDescType(LLVMContext &C) {
+    Type *i64 = Type::getInt64Ty(C);
+    return StructType::get(Type::getInt8PtrTy(C), i64, i64,
+                           getFieldDescType(C)->getPointerTo());
+}
+
+// Mirrors struct rdzone_site in the runtime:
+// {id, function, file, line, column, executions, color_hits}.
+StructType *getSiteType(LLVMContext &C) {
+    Type *i32 = Type::getInt32Ty(C);
+    Type *i64 = Type::getInt64Ty(C);
+    return StructType::get(i64, Type::getInt8PtrTy(C), Type::getInt8PtrTy(C), i32, i32, i64, i64);
+}
+
 /**
  * This function simply inserts some call to the runtime test function on the
  * first function it sees. This function is used to check if the runtime is correctly
@@ -28,7 +132,9 @@ void add_runtime_test(Function *test_function, Module &M) {
             continue;
         }
 
-        outs() << F.getName() << "\n";
+        if (DebugTrace) {
+            outs() << F.getName() << "\n";
+        }
         for (BasicBlock &bb : F) {
             for (Instruction &I : bb) {
                 CallInst *newCall = CallInst::Create(test_function, "", &I);
@@ -50,12 +156,29 @@ void add_runtime_test(Function *test_function, Module &M) {
  *  __rdzone_dbg_print {void @__rdzone_dbg_print()}
  *  __rdzone_reset {void @__rdzone_reset()}
  *  __rdzone_rm {void @__rdzone_rm(i8* noundef %0)
+ *  __rdzone_check_batch {void @__rdzone_check_batch(i8** noundef %0, i8* noundef %1, i64 %2)}
+ *  __rdzone_register_globals {void @__rdzone_register_globals({...}* noundef %0, i64 %1)}
+ *  __rdzone_usable_size {i64 @__rdzone_usable_size(i8* noundef %0)}
+ *  __rdzone_move {i64 @__rdzone_move(i8* noundef %0, i8* noundef %1, i64 %2, i64 %3)}
+ *  __rdzone_add_elems {void @__rdzone_add_elems(i8* noundef %0, i64* %1, i64 %2, i64 %3, i64 %4,
+ *                                               i64 %5, i8* %6)}
+ *  __rdzone_add_typed {void @__rdzone_add_typed(i8* noundef %0, i64 %1, i8* %2, i64 %3, i32 %4)}
+ *  __rdzone_check_site {void @__rdzone_check_site(i8* noundef %0, i8 noundef zeroext %1, {...}* %2)}
+ *  __rdzone_check_sampled and __rdzone_check_batch_sampled, like their unsampled versions
+ *  __rdzone_sample_countdown {@__rdzone_sample_countdown = external thread_local global i32}
+ *  __rdzone_checks_enabled {@__rdzone_checks_enabled = external global i8}
  *
  * __rdzone_dbg_print (prints the AVL tree)
  * __rdzone_reset (removes all redzones)
  * __rdzone_check (checks ptr for safe access)
  * __rdzone_add (deletes all redzones)
  * __rdzone_rm (removes a redzone)
+ * __rdzone_check_batch (checks several ptrs for safe access at once)
+ * __rdzone_register_globals (registers the redzones of all instrumented globals)
+ * __rdzone_usable_size, __rdzone_move and __rdzone_add_elems (keep redzones across a realloc)
+ * __rdzone_add_typed (adds a redzone, and remembers the struct it is in for error reports)
+ * __rdzone_check_site (__rdzone_check that also counts the check for the site's profile)
+ * __rdzone_check_sampled, __rdzone_check_batch_sampled (checks that draw the next sampled access)
  */
 struct Runtime add_runtime_linkage(Module &M) {
 
@@ -69,6 +192,32 @@ struct Runtime add_runtime_linkage(Module &M) {
     SmallVector<Type *> rdzone_heaprm_args = {PointerType::get(Type::getInt8Ty(M.getContext()), 0)};
     SmallVector<Type *> rdzone_rm_between_args = {
         PointerType::get(Type::getInt8Ty(M.getContext()), 0), Type::getInt64Ty(M.getContext())};
+    SmallVector<Type *> rdzone_check_batch_args = {
+        PointerType::get(Type::getInt8PtrTy(M.getContext()), 0),
+        PointerType::get(Type::getInt8Ty(M.getContext()), 0), Type::getInt64Ty(M.getContext())};
+    SmallVector<Type *> rdzone_register_globals_args = {
+        getGlobalDescType(M.getContext())->getPointerTo(), Type::getInt64Ty(M.getContext())};
+    SmallVector<Type *> rdzone_usable_size_args = {
+        PointerType::get(Type::getInt8Ty(M.getContext()), 0)};
+    SmallVector<Type *> rdzone_move_args = {PointerType::get(Type::getInt8Ty(M.getContext()), 0),
+                                            PointerType::get(Type::getInt8Ty(M.getContext()), 0),
+                                            Type::getInt64Ty(M.getContext()),
+                                            Type::getInt64Ty(M.getContext())};
+    SmallVector<Type *> rdzone_add_elems_args = {
+        PointerType::get(Type::getInt8Ty(M.getContext()), 0),
+        Type::getInt64PtrTy(M.getContext()),
+        Type::getInt64Ty(M.getContext()),
+        Type::getInt64Ty(M.getContext()),
+        Type::getInt64Ty(M.getContext()),
+        Type::getInt64Ty(M.getContext()),
+        Type::getInt8PtrTy(M.getContext())};
+    SmallVector<Type *> rdzone_add_typed_args = {
+        PointerType::get(Type::getInt8Ty(M.getContext()), 0), Type::getInt64Ty(M.getContext()),
+        Type::getInt8PtrTy(M.getContext()), Type::getInt64Ty(M.getContext()),
+        Type::getInt32Ty(M.getContext())};
+    SmallVector<Type *> rdzone_check_site_args = {
+        PointerType::get(Type::getInt8Ty(M.getContext()), 0), Type::getInt8Ty(M.getContext()),
+        getSiteType(M.getContext())->getPointerTo()};
 
     // Function types
     FunctionType *test_runtime_t = FunctionType::get(Type::getVoidTy(M.getContext()),
@@ -84,6 +233,20 @@ struct Runtime add_runtime_linkage(Module &M) {
 
     FunctionType *rdzone_rm_between_t = FunctionType::get(
         Type::getVoidTy(M.getContext()), ArrayRef<Type *>(rdzone_rm_between_args), false);
+    FunctionType *rdzone_check_batch_t = FunctionType::get(
+        Type::getVoidTy(M.getContext()), ArrayRef<Type *>(rdzone_check_batch_args), false);
+    FunctionType *rdzone_register_globals_t = FunctionType::get(
+        Type::getVoidTy(M.getContext()), ArrayRef<Type *>(rdzone_register_globals_args), false);
+    FunctionType *rdzone_usable_size_t = FunctionType::get(
+        Type::getInt64Ty(M.getContext()), ArrayRef<Type *>(rdzone_usable_size_args), false);
+    FunctionType *rdzone_move_t = FunctionType::get(
+        Type::getInt64Ty(M.getContext()), ArrayRef<Type *>(rdzone_move_args), false);
+    FunctionType *rdzone_add_elems_t = FunctionType::get(
+        Type::getVoidTy(M.getContext()), ArrayRef<Type *>(rdzone_add_elems_args), false);
+    FunctionType *rdzone_add_typed_t = FunctionType::get(
+        Type::getVoidTy(M.getContext()), ArrayRef<Type *>(rdzone_add_typed_args), false);
+    FunctionType *rdzone_check_site_t = FunctionType::get(
+        Type::getVoidTy(M.getContext()), ArrayRef<Type *>(rdzone_check_site_args), false);
 
     // FunctionCallee prototype = M.getOrInsertFunction("test_runtime_link", f);
     Function *test_runtime_f =
@@ -98,14 +261,159 @@ struct Runtime add_runtime_linkage(Module &M) {
         Function::Create(rdzone_heaprm_t, Function::ExternalLinkage, "__rdzone_heaprm", M);
     Function *rdzone_rm_between_f =
         Function::Create(rdzone_rm_between_t, Function::ExternalLinkage, "__rdzone_rm_between", M);
+    Function *rdzone_check_batch_f = Function::Create(
+        rdzone_check_batch_t, Function::ExternalLinkage, "__rdzone_check_batch", M);
+    Function *rdzone_register_globals_f = Function::Create(
+        rdzone_register_globals_t, Function::ExternalLinkage, "__rdzone_register_globals", M);
+    Function *rdzone_usable_size_f = Function::Create(
+        rdzone_usable_size_t, Function::ExternalLinkage, "__rdzone_usable_size", M);
+    Function *rdzone_move_f =
+        Function::Create(rdzone_move_t, Function::ExternalLinkage, "__rdzone_move", M);
+    Function *rdzone_add_elems_f =
+        Function::Create(rdzone_add_elems_t, Function::ExternalLinkage, "__rdzone_add_elems", M);
+    Function *rdzone_add_typed_f =
+        Function::Create(rdzone_add_typed_t, Function::ExternalLinkage, "__rdzone_add_typed", M);
+    Function *rdzone_check_site_f = Function::Create(
+        rdzone_check_site_t, Function::ExternalLinkage, "__rdzone_check_site", M);
+    Function *rdzone_check_sampled_f = Function::Create(
+        rdzone_check_t, Function::ExternalLinkage, "__rdzone_check_sampled", M);
+    Function *rdzone_check_batch_sampled_f = Function::Create(
+        rdzone_check_batch_t, Function::ExternalLinkage, "__rdzone_check_batch_sampled", M);
+    auto *rdzone_sample_countdown = new GlobalVariable(
+        M, Type::getInt32Ty(M.getContext()), false, GlobalValue::ExternalLinkage, nullptr,
+        "__rdzone_sample_countdown", nullptr, GlobalValue::InitialExecTLSModel);
+    auto *rdzone_checks_enabled =
+        new GlobalVariable(M, Type::getInt8Ty(M.getContext()), false,
+                           GlobalValue::ExternalLinkage, nullptr, "__rdzone_checks_enabled");
 
-    struct Runtime runtime = {rdzone_add_f, rdzone_check_f, rdzone_rm_f, rdzone_heaprm_f,
-                              rdzone_rm_between_f};
+    struct Runtime runtime = {rdzone_add_f,
+                              rdzone_check_f,
+                              rdzone_rm_f,
+                              rdzone_heaprm_f,
+                              rdzone_rm_between_f,
+                              rdzone_check_batch_f,
+                              rdzone_register_globals_f,
+                              rdzone_usable_size_f,
+                              rdzone_move_f,
+                              rdzone_add_elems_f,
+                              rdzone_add_typed_f,
+                              rdzone_check_site_f,
+                              rdzone_check_sampled_f,
+                              rdzone_check_batch_sampled_f,
+                              rdzone_sample_countdown,
+                              rdzone_checks_enabled};
 
     add_runtime_test(test_runtime_f, M);
     return runtime;
 }
 
+// A private constant C string, as an i8*.
+Constant *getStringConstant(Module &M, StringRef str) {
+    Constant *init = ConstantDataArray::getString(M.getContext(), str);
+    auto *global = new GlobalVariable(M, init->getType(), true, GlobalValue::PrivateLinkage, init,
+                                      "rdzone_str");
+    global->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+    return ConstantExpr::getPointerCast(global, Type::getInt8PtrTy(M.getContext()));
+}
+
+// The source-level name of a struct type: struct.Foo becomes Foo.
+StringRef getSourceStructName(StructType *type) {
+    StringRef name = type->getName();
+    name.consume_front("struct.") || name.consume_front("union.");
+    return name;
+}
+
+/**
+ * Looks up the names of the fields of `type` in the debug info, matching members by offset. Fields
+ * without a match (padding, or no debug info at all) get an empty name.
+ */
+std::vector<std::string> getFieldNames(Module &M, StructType *type, TypeDescriptors *typeDescs) {
+    if (!typeDescs->debugScanned) {
+        DebugInfoFinder finder;
+        finder.processModule(M);
+        for (DIType *diType : finder.types()) {
+            auto *composite = dyn_cast<DICompositeType>(diType);
+            if (composite && !composite->isForwardDecl() && !composite->getName().empty() &&
+                (composite->getTag() == dwarf::DW_TAG_structure_type ||
+                 composite->getTag() == dwarf::DW_TAG_union_type)) {
+                typeDescs->debugTypes.emplace(composite->getName().str(), composite);
+            }
+        }
+        typeDescs->debugScanned = true;
+    }
+    std::vector<std::string> names(type->getNumElements());
+    auto found = typeDescs->debugTypes.find(getSourceStructName(type).str());
+    if (found == typeDescs->debugTypes.end() || !type->isSized()) {
+        return names;
+    }
+    const StructLayout *layout = M.getDataLayout().getStructLayout(type);
+    for (DINode *element : found->second->getElements()) {
+        auto *member = dyn_cast<DIDerivedType>(element);
+        if (!member || member->getTag() != dwarf::DW_TAG_member || member->isStaticMember()) {
+            continue;
+        }
+        for (unsigned i = 0; i < type->getNumElements(); i++) {
+            if (names[i].empty() && layout->getElementOffsetInBits(i) == member->getOffsetInBits()) {
+                names[i] = member->getName().str();
+                break;
+            }
+        }
+    }
+    return names;
+}
+
+/**
+ * Returns the descriptor of an inflated struct type (see struct rdzone_type in the runtime), which
+ * error reports use to name the struct and its fields. Descriptors live in the structzone_types
+ * section. Types without redzones get a null pointer.
+ */
+Constant *getTypeDescriptor(Module &M, Type *type,
+                            std::map<StringRef, std::shared_ptr<StructInfo>> *redzoneInfo,
+                            TypeDescriptors *typeDescs) {
+    LLVMContext &C = M.getContext();
+    auto *structType = dyn_cast<StructType>(type);
+    if (!structType || !structType->hasName() || !structType->isSized() ||
+        redzoneInfo->count(structType->getName()) == 0) {
+        return ConstantPointerNull::get(Type::getInt8PtrTy(C));
+    }
+    if (typeDescs->descs.count(type) > 0) {
+        return typeDescs->descs.at(type);
+    }
+    const DataLayout &dl = M.getDataLayout();
+    std::shared_ptr<StructInfo> info = redzoneInfo->at(structType->getName());
+    const StructLayout *layout = dl.getStructLayout(structType);
+    std::vector<std::string> names = getFieldNames(M, info->deflatedType, typeDescs);
+    Type *i64 = Type::getInt64Ty(C);
+
+    std::vector<Constant *> fields;
+    for (size_t i = 0; i < info->fields.size(); i++) {
+        unsigned element = info->offsetMapping.at(i);
+        Type *fieldType = structType->getElementType(element);
+        Type *innerType = fieldType;
+        while (innerType->isArrayTy()) {
+            innerType = innerType->getArrayElementType();
+        }
+        SmallVector<Constant *> field = {
+            getStringConstant(M, names[i]), ConstantInt::get(i64, layout->getElementOffset(element)),
+            ConstantInt::get(i64, dl.getTypeAllocSize(fieldType)),
+            getTypeDescriptor(M, innerType, redzoneInfo, typeDescs)};
+        fields.push_back(ConstantStruct::get(getFieldDescType(C), field));
+    }
+    ArrayType *fieldsType = ArrayType::get(getFieldDescType(C), fields.size());
+    auto *fieldTable = new GlobalVariable(M, fieldsType, true, GlobalValue::PrivateLinkage,
+                                          ConstantArray::get(fieldsType, fields), "rdzone_fields");
+    SmallVector<Constant *> desc = {
+        getStringConstant(M, getSourceStructName(info->deflatedType)),
+        ConstantInt::get(i64, dl.getTypeAllocSize(structType)), ConstantInt::get(i64, fields.size()),
+        ConstantExpr::getPointerCast(fieldTable, getFieldDescType(C)->getPointerTo())};
+    auto *descGlobal = new GlobalVariable(M, getTypeDescType(C), true, GlobalValue::PrivateLinkage,
+                                          ConstantStruct::get(getTypeDescType(C), desc),
+                                          "rdzone_type." + getSourceStructName(info->deflatedType));
+    descGlobal->setSection("structzone_types");
+    typeDescs->descs[type] = ConstantExpr::getPointerCast(descGlobal, Type::getInt8PtrTy(C));
+    return typeDescs->descs.at(type);
+}
+
 /**
  * Helper function that finds all the returns in the function and instruments them.
  * @param returns the output for a list of returns.
@@ -129,9 +437,11 @@ void findReturnInsts(SmallVector<ReturnInst *> *returns, Function *function) {
  * @param runtime The collection of linked runtime functions.
  * @param type The struct type to be implemented
  * @param redzoneInfo A map from struct name to the struct info.
+ * @param typeDescs The type descriptors for error reports.
  */
 void insert_rdzone_init(Instruction *ptrToStruct, Runtime *runtime, Type *type, size_t elem_count,
-                        std::map<StringRef, std::shared_ptr<StructInfo>> *redzoneInfo) {
+                        std::map<StringRef, std::shared_ptr<StructInfo>> *redzoneInfo,
+                        TypeDescriptors *typeDescs) {
     assert(type->isStructTy() || type->getArrayElementType()->isStructTy());
     assert(ptrToStruct && runtime && type);
 
@@ -149,6 +459,11 @@ void insert_rdzone_init(Instruction *ptrToStruct, Runtime *runtime, Type *type,
     }
     assert(structType);
     std::shared_ptr<StructInfo> structInfo = redzoneInfo->at(inflatedStructName);
+    Module *M = ptrToStruct->getModule();
+    const StructLayout *layout = M->getDataLayout().getStructLayout(structType);
+    Constant *typeDesc = getTypeDescriptor(*M, structType, redzoneInfo, typeDescs);
+    uint32_t kind =
+        isa<AllocaInst>(getUnderlyingObject(ptrToStruct)) ? RDZONE_STACK : RDZONE_HEAP;
 
     SmallVector<ReturnInst *> functionExits = {};
     findReturnInsts(&functionExits, ptrToStruct->getParent()->getParent());
@@ -159,12 +474,10 @@ void insert_rdzone_init(Instruction *ptrToStruct, Runtime *runtime, Type *type,
             builder.SetInsertPoint(ptrToStruct->getNextNode());
 
             SmallVector<Value *> indices = {};
-            if (auto *alloc_test = dyn_cast<AllocaInst>(ptrToStruct)) {
-                if (alloc_test->getAllocatedType()->isArrayTy()) {
-                    // Then we have an array of structs with as source an alloca.
-                    // Which means the source is a _pointer_, so we need a 0 at the beginning.
-                    indices.push_back(ConstantInt::get(IntegerType::getInt32Ty(*C), 0, false));
-                }
+            if (type->isArrayTy()) {
+                // Then we have an array of structs, either an alloca or a field of an outer struct.
+                // Which means the source is a _pointer_, so we need a 0 at the beginning.
+                indices.push_back(ConstantInt::get(IntegerType::getInt32Ty(*C), 0, false));
             }
             indices.push_back(ConstantInt::get(IntegerType::getInt32Ty(*C), x, false));
             indices.push_back(ConstantInt::get(IntegerType::getInt32Ty(*C), y, false));
@@ -179,12 +492,17 @@ void insert_rdzone_init(Instruction *ptrToStruct, Runtime *runtime, Type *type,
             }
             Value *redzone_addr = builder.CreateGEP(type, structPtr, indices);
 
-            // create CALL to void @__rdzone_add(i8*, i64)
+            // create CALL to void @__rdzone_add_typed(i8*, i64, i8*, i64, i32)
             SmallVector<Value *> argsAdd = {
                 builder.CreateBitCast(redzone_addr,
                                       PointerType::get(IntegerType::getInt8Ty(*C), 0)),
-                ConstantInt::get(IntegerType::getInt64Ty(*C), REDZONE_SIZE, false)};
-            builder.CreateCall(runtime->rdzone_add_f, argsAdd);
+                ConstantInt::get(IntegerType::getInt64Ty(*C),
+                                 M->getDataLayout().getTypeAllocSize(structType->getElementType(y)),
+                                 false),
+                typeDesc,
+                ConstantInt::get(IntegerType::getInt64Ty(*C), layout->getElementOffset(y)),
+                ConstantInt::get(IntegerType::getInt32Ty(*C), kind)};
+            builder.CreateCall(runtime->rdzone_add_typed_f, argsAdd);
 
             if (AllocaInst *allocaInst = dyn_cast<AllocaInst>(ptrToStruct)) {
                 // create CALL to void @__rdzone_rm(i8*)
@@ -212,7 +530,7 @@ void insert_rdzone_init(Instruction *ptrToStruct, Runtime *runtime, Type *type,
 
                 Value *ptrToInner = builder.CreateGEP(structType, ptrToStruct, indeces);
                 insert_rdzone_init(dyn_cast<Instruction>(ptrToInner), runtime, field,
-                                   field->getArrayNumElements(), redzoneInfo);
+                                   field->getArrayNumElements(), redzoneInfo, typeDescs);
             } else if (field->isStructTy()) {
                 /**
                  * check if field is structTy
@@ -228,26 +546,44 @@ void insert_rdzone_init(Instruction *ptrToStruct, Runtime *runtime, Type *type,
 
                 Value *ptrToInner = builder.CreateGEP(structType, ptrToStruct, indeces);
                 insert_rdzone_init(dyn_cast<Instruction>(ptrToInner), runtime, field, 1,
-                                   redzoneInfo);
+                                   redzoneInfo, typeDescs);
             }
             i++;
         }
     }
 }
 
+/**
+ * Counts `accesses` down from the thread's sample countdown in front of `ins`, and branches to a new
+ * block when it runs out. Returns the terminator of that block, in front of which the (sampled)
+ * check goes. Sampled-out accesses cost the decrement and a well-predicted branch.
+ */
+Instruction *insertSampleGuard(Instruction *ins, uint64_t accesses, Runtime *runtime) {
+    IRBuilder<> builder(ins);
+    GlobalVariable *countdown = runtime->rdzone_sample_countdown;
+    Value *left = builder.CreateSub(builder.CreateLoad(builder.getInt32Ty(), countdown),
+                                    builder.getInt32(accesses));
+    builder.CreateStore(left, countdown);
+    Value *sampled = builder.CreateICmpSLE(left, builder.getInt32(0));
+    return SplitBlockAndInsertIfThen(sampled, ins, false,
+                                     MDBuilder(ins->getContext()).createBranchWeights(1, 100));
+}
+
 /**
  * Instrument loads or stores with access checks.
  * @param ins Instruction to insert above (typically load or store)
  * @param ptrOperand The address to check.
  * @param acessedType The type of variable that is loaded (so we understand how large the load is)
  * @param runtime The collection of runtime functions to insert.
+ * @param site The site descriptor to count the check in, or NULL.
  */
 void insertMemAccessCheck(Instruction *ins, Value *ptrOperand, Type *accessedType,
-                          Runtime *runtime) {
+                          Runtime *runtime, Constant *site) {
     assert(ptrOperand && ins);
     LLVMContext *C = &ins->getContext();
     IRBuilder<> builder(*C);
-    builder.SetInsertPoint(ins);
+    bool sampled = SampleChecks && site == NULL;
+    builder.SetInsertPoint(sampled ? insertSampleGuard(ins, 1, runtime) : ins);
     // find a way to get the ptr type of the operand.
     // cast it to a i8*
     // insert a call to __rdzone_check
@@ -271,7 +607,321 @@ void insertMemAccessCheck(Instruction *ins, Value *ptrOperand, Type *accessedTyp
 
     SmallVector<Value *> args = {castedPtr, sizeofInt};
 
-    builder.CreateCall(runtime->rdzone_check_f, args);
+    if (site != NULL) {
+        args.push_back(site);
+        builder.CreateCall(runtime->rdzone_check_site_f, args);
+        return;
+    }
+    builder.CreateCall(sampled ? runtime->rdzone_check_sampled_f : runtime->rdzone_check_f, args);
+}
+
+// A load or store that needs a redzone check.
+struct CheckSite {
+    Instruction *ins;
+    Value *ptrOperand;
+    Type *accessedType;
+    // Identifies the access across builds of the same source, see getSiteId.
+    uint64_t id;
+};
+
+// How often a check site ran and touched a colored byte, summed over all given profiles.
+struct SiteCounts {
+    uint64_t executions = 0;
+    uint64_t colorHits = 0;
+};
+typedef std::map<uint64_t, SiteCounts> SiteProfile;
+
+/**
+ * A check site is identified by its function and the position of the access among the loads and
+ * stores of the function. Unlike line numbers, that survives edits elsewhere in the file, and it
+ * stays stable as long as the function itself is unchanged.
+ */
+uint64_t getSiteId(Function &func, uint64_t ordinal) {
+    return xxHash64((func.getName() + "#" + Twine(ordinal)).str());
+}
+
+// Reads the profiles written by the runtime (see __rdzone_write_profile).
+SiteProfile loadSiteProfile() {
+    SiteProfile profile;
+    for (const std::string &path : ProfileFiles) {
+        auto buffer = MemoryBuffer::getFile(path);
+        if (!buffer) {
+            errs() << "structzone: cannot read profile " << path << ": "
+                   << buffer.getError().message() << "\n";
+            continue;
+        }
+        SmallVector<StringRef> lines;
+        (*buffer)->getBuffer().split(lines, '\n', -1, false);
+        for (StringRef line : lines) {
+            if (line.startswith("#")) {
+                continue;
+            }
+            SmallVector<StringRef> parts;
+            line.split(parts, ' ', 3, false);
+            uint64_t id, executions, colorHits;
+            if (parts.size() < 3 || parts[0].getAsInteger(16, id) ||
+                parts[1].getAsInteger(10, executions) || parts[2].getAsInteger(10, colorHits)) {
+                errs() << "structzone: malformed line in profile " << path << ": " << line << "\n";
+                continue;
+            }
+            profile[id].executions += executions;
+            profile[id].colorHits += colorHits;
+        }
+    }
+    return profile;
+}
+
+// Whether the profile shows the check as hot without it ever having touched a colored byte.
+bool isHotCleanCheck(const SiteProfile &profile, uint64_t id) {
+    auto counts = profile.find(id);
+    return counts != profile.end() && counts->second.executions >= ProfileHotThreshold &&
+           counts->second.colorHits == 0;
+}
+
+/**
+ * Whether the access is a field of an instrumented struct, addressed by a GEP with constant indices
+ * that stay within the struct, and of the field's own width. Such an access cannot reach a redzone
+ * of its own struct; below full protection it is not checked, so that the tier cuts checks along
+ * with the redzones. (Full protection still checks it, to catch struct pointers that point past an
+ * array of structs.)
+ */
+bool isStaticFieldAccess(Value *ptrOperand, Type *accessedType,
+                         std::map<StringRef, std::shared_ptr<StructInfo>> *redzoneInfo) {
+    auto *gep = dyn_cast<GEPOperator>(ptrOperand);
+    if (Protection == ProtectionLevel::Full || !gep || gep->getNumIndices() < 2 ||
+        gep->getResultElementType() != accessedType) {
+        return false;
+    }
+    auto *structType = dyn_cast<StructType>(gep->getSourceElementType());
+    if (!structType || !structType->hasName() || redzoneInfo->count(structType->getName()) == 0) {
+        return false;
+    }
+    auto *first = dyn_cast<ConstantInt>(gep->idx_begin()->get());
+    if (!first || !first->isZero()) {
+        return false;
+    }
+    Type *current = structType;
+    for (auto idx = gep->idx_begin() + 1; idx != gep->idx_end(); idx++) {
+        auto *index = dyn_cast<ConstantInt>(idx->get());
+        if (!index) {
+            return false;
+        }
+        if (auto *arrayType = dyn_cast<ArrayType>(current)) {
+            if (index->getZExtValue() >= arrayType->getNumElements()) {
+                return false;
+            }
+            current = arrayType->getElementType();
+        } else if (auto *innerStruct = dyn_cast<StructType>(current)) {
+            current = innerStruct->getElementType(index->getZExtValue());
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Emits the rdzone_site for a check into the structzone_sites section.
+Constant *getSiteDescriptor(CheckSite &check) {
+    Function *func = check.ins->getFunction();
+    Module &M = *func->getParent();
+    LLVMContext &C = M.getContext();
+    Type *i32 = Type::getInt32Ty(C);
+    Type *i64 = Type::getInt64Ty(C);
+    const DebugLoc &loc = check.ins->getDebugLoc();
+    StringRef file = loc ? cast<DIScope>(loc.getScope())->getFilename() : "";
+    StructType *siteType = getSiteType(C);
+    Constant *init = ConstantStruct::get(
+        siteType, {ConstantInt::get(i64, check.id), getStringConstant(M, func->getName()),
+                   getStringConstant(M, file), ConstantInt::get(i32, loc ? loc.getLine() : 0),
+                   ConstantInt::get(i32, loc ? loc.getCol() : 0), ConstantInt::get(i64, 0),
+                   ConstantInt::get(i64, 0)});
+    auto *site =
+        new GlobalVariable(M, siteType, false, GlobalValue::PrivateLinkage, init, "rdzone_site");
+    site->setSection("structzone_sites");
+    site->setAlignment(Align(8));
+    appendToCompilerUsed(M, {site});
+    return site;
+}
+
+/**
+ * Makes sure `val` is available right before `pt`, which lives in the same basic block. Address
+ * computations (GEPs and bitcasts) that are defined later in the block are hoisted when their own
+ * operands allow it; anything else (e.g. a loaded pointer) makes the value unavailable.
+ */
+bool makeAvailableBefore(Value *val, Instruction *pt, int depth) {
+    auto *inst = dyn_cast<Instruction>(val);
+    // Arguments, constants and values from other (dominating) blocks are available everywhere.
+    if (!inst || inst->getParent() != pt->getParent() || inst->comesBefore(pt)) {
+        return true;
+    }
+    if (depth == 0 || !(isa<GetElementPtrInst>(inst) || isa<BitCastInst>(inst))) {
+        return false;
+    }
+    for (Value *op : inst->operands()) {
+        if (!makeAvailableBefore(op, pt, depth - 1)) {
+            return false;
+        }
+    }
+    inst->moveBefore(pt);
+    return true;
+}
+
+/**
+ * Whether anything between two accesses may change the registered redzones. Calls can (they may
+ * reach the runtime or free memory), so they end a batch.
+ */
+bool hasBarrierBetween(Instruction *from, Instruction *to) {
+    for (Instruction *curr = from->getNextNode(); curr && curr != to; curr = curr->getNextNode()) {
+        if (isa<CallBase>(curr) && !isa<DbgInfoIntrinsic>(curr)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Emits a single __rdzone_check_batch call in front of the first access of the group. The
+ * pointers go into a per-function scratch array, the widths into a constant table.
+ */
+void insertBatchedAccessCheck(std::vector<CheckSite *> &group, Runtime *runtime,
+                              std::map<Function *, AllocaInst *> *scratchArrays) {
+    Instruction *first = group.front()->ins;
+    Function *func = first->getFunction();
+    Module *M = func->getParent();
+    LLVMContext *C = &M->getContext();
+    const DataLayout &dl = M->getDataLayout();
+    ArrayType *scratchType = ArrayType::get(Type::getInt8PtrTy(*C), MAX_BATCH_SIZE);
+
+    if (scratchArrays->count(func) == 0) {
+        IRBuilder<> entryBuilder(&*func->getEntryBlock().getFirstInsertionPt());
+        (*scratchArrays)[func] = entryBuilder.CreateAlloca(scratchType, nullptr, "rdzone_batch");
+    }
+    AllocaInst *scratch = scratchArrays->at(func);
+
+    SmallVector<uint8_t> widths;
+    IRBuilder<> builder(SampleChecks ? insertSampleGuard(first, group.size(), runtime) : first);
+    for (size_t i = 0; i < group.size(); i++) {
+        uint64_t width = dl.getTypeStoreSize(group[i]->accessedType);
+        widths.push_back(width > UINT8_MAX ? UINT8_MAX : width);
+        Value *slot = builder.CreateConstInBoundsGEP2_32(scratchType, scratch, 0, i);
+        builder.CreateStore(builder.CreateBitCast(group[i]->ptrOperand, Type::getInt8PtrTy(*C)),
+                            slot);
+    }
+    Constant *widthsInit = ConstantDataArray::get(*C, ArrayRef<uint8_t>(widths));
+    auto *widthTable = new GlobalVariable(*M, widthsInit->getType(), true,
+                                          GlobalValue::PrivateLinkage, widthsInit, "rdzone_widths");
+    widthTable->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+
+    SmallVector<Value *> args = {
+        builder.CreateConstInBoundsGEP2_32(scratchType, scratch, 0, 0),
+        builder.CreateConstInBoundsGEP2_32(widthsInit->getType(), widthTable, 0, 0),
+        ConstantInt::get(IntegerType::getInt64Ty(*C), group.size())};
+    builder.CreateCall(
+        SampleChecks ? runtime->rdzone_check_batch_sampled_f : runtime->rdzone_check_batch_f, args);
+}
+
+/**
+ * Inserts the checks for the accesses of one basic block. With -structzone-batch-checks, runs of
+ * accesses whose addresses do not depend on each other (and are not separated by calls) share a
+ * single batched check, placed before the first access of the run.
+ */
+void insertMemAccessChecks(std::vector<CheckSite> &sites, Runtime *runtime,
+                           std::map<Function *, AllocaInst *> *scratchArrays) {
+    size_t i = 0;
+    while (i < sites.size()) {
+        std::vector<CheckSite *> group = {&sites[i]};
+        size_t next = i + 1;
+        while (BatchChecks && !ProfileSites && next < sites.size() && group.size() < MAX_BATCH_SIZE &&
+               !hasBarrierBetween(group.back()->ins, sites[next].ins) &&
+               makeAvailableBefore(sites[next].ptrOperand, group.front()->ins, 4)) {
+            group.push_back(&sites[next]);
+            next++;
+        }
+        if (group.size() == 1) {
+            insertMemAccessCheck(sites[i].ins, sites[i].ptrOperand, sites[i].accessedType,
+                                 runtime, ProfileSites ? getSiteDescriptor(sites[i]) : NULL);
+        } else {
+            insertBatchedAccessCheck(group, runtime, scratchArrays);
+        }
+        i = next;
+    }
+}
+
+/**
+ * Splits `func` into a checked and an unchecked version, and turns `func` itself into a dispatcher
+ * that calls one of them depending on the runtime's __rdzone_checks_enabled flag. Both versions
+ * keep the redzone bookkeeping that is already in `func`; the checks that are yet to be inserted
+ * are moved over to the checked version. Callers and the address of `func` are unaffected.
+ */
+void splitCheckedVersion(Function &func, std::vector<std::vector<CheckSite>> *blockChecks,
+                         Runtime *runtime) {
+    ValueToValueMapTy checkedMap;
+    ValueToValueMapTy uncheckedMap;
+    Function *checked = CloneFunction(&func, checkedMap);
+    Function *unchecked = CloneFunction(&func, uncheckedMap);
+    checked->setName(func.getName() + ".checked");
+    unchecked->setName(func.getName() + ".unchecked");
+    for (Function *version : {checked, unchecked}) {
+        version->setLinkage(GlobalValue::InternalLinkage);
+        version->setComdat(nullptr);
+    }
+    for (std::vector<CheckSite> &checks : *blockChecks) {
+        for (CheckSite &check : checks) {
+            check.ins = cast<Instruction>(checkedMap[check.ins]);
+            if (Value *mapped = checkedMap.lookup(check.ptrOperand)) {
+                check.ptrOperand = mapped;
+            }
+        }
+    }
+
+    GlobalValue::LinkageTypes linkage = func.getLinkage();
+    func.deleteBody();
+    func.setLinkage(linkage);
+    LLVMContext &C = func.getContext();
+    IRBuilder<> builder(BasicBlock::Create(C, "entry", &func));
+    LoadInst *enabled = builder.CreateLoad(builder.getInt8Ty(), runtime->rdzone_checks_enabled);
+    enabled->setAtomic(AtomicOrdering::Monotonic);
+    enabled->setAlignment(Align(1));
+    BasicBlock *checkedBlock = BasicBlock::Create(C, "checked", &func);
+    BasicBlock *uncheckedBlock = BasicBlock::Create(C, "unchecked", &func);
+    builder.CreateCondBr(builder.CreateICmpNE(enabled, builder.getInt8(0)), checkedBlock,
+                         uncheckedBlock);
+
+    SmallVector<Value *> args;
+    bool byval = false;
+    for (Argument &arg : func.args()) {
+        args.push_back(&arg);
+        byval |= arg.hasPassPointeeByValueCopyAttr();
+    }
+    for (auto [block, version] : {std::make_pair(checkedBlock, checked),
+                                  std::make_pair(uncheckedBlock, unchecked)}) {
+        builder.SetInsertPoint(block);
+        CallInst *call = builder.CreateCall(version, args);
+        call->setAttributes(func.getAttributes());
+        call->setCallingConv(func.getCallingConv());
+        // Arguments copied into the dispatcher's frame rule out a tail call.
+        call->setTailCall(!byval);
+        if (func.getReturnType()->isVoidTy()) {
+            builder.CreateRetVoid();
+        } else {
+            builder.CreateRet(call);
+        }
+    }
+}
+
+// Whether `func` gets a checked and an unchecked version, see splitCheckedVersion.
+bool shouldSplitCheckedVersion(Function &func,
+                               const std::vector<std::vector<CheckSite>> &blockChecks) {
+    if (!Multiversion || func.isDeclaration() || func.isVarArg() ||
+        func.hasFnAttribute(Attribute::Naked)) {
+        return false;
+    }
+    for (const std::vector<CheckSite> &checks : blockChecks) {
+        if (!checks.empty()) {
+            return true;
+        }
+    }
+    return false;
 }
 
 void insert_heap_free(CallInst *callToFree, struct Runtime *runtime,
@@ -295,12 +945,14 @@ void insert_heap_free(CallInst *callToFree, struct Runtime *runtime,
             if (auto *uInstr = dyn_cast<Instruction>(U)) {
                 // To ensure we don't walk overlapping use-def chains
                 if (!seen.count(uInstr)) {
-                    workList.push(uInstr);
                     seen.insert(uInstr);
                     auto *callInst = dyn_cast<CallInst>(uInstr);
                     if (callInst && heapStructInfo->count(callInst) > 0) {
                         allocations.insert(callInst);
+                        // Do not walk past it; the operand of a realloc is the block it replaced.
+                        continue;
                     }
+                    workList.push(uInstr);
                 }
             }
         }
@@ -335,6 +987,175 @@ void insert_heap_free(CallInst *callToFree, struct Runtime *runtime,
     builder.CreateCall(runtime->rdzone_rm_between_f, args);
 }
 
+/**
+ * Appends the (offset, size) pair of every redzone inside a value of the given inflated type,
+ * sorted by offset.
+ */
+void collectRedzoneLayout(Type *type, uint64_t base, const DataLayout &dl,
+                          std::map<StringRef, std::shared_ptr<StructInfo>> *redzoneInfo,
+                          std::vector<uint64_t> *layout) {
+    if (auto *arr_type = dyn_cast<ArrayType>(type)) {
+        // Every element has the same layout, so only walk the element type once.
+        std::vector<uint64_t> elemLayout;
+        collectRedzoneLayout(arr_type->getElementType(), 0, dl, redzoneInfo, &elemLayout);
+        uint64_t stride = dl.getTypeAllocSize(arr_type->getElementType());
+        for (uint64_t i = 0; i < arr_type->getNumElements() && !elemLayout.empty(); i++) {
+            for (size_t j = 0; j < elemLayout.size(); j += 2) {
+                layout->push_back(base + i * stride + elemLayout[j]);
+                layout->push_back(elemLayout[j + 1]);
+            }
+        }
+    } else if (auto *struct_type = dyn_cast<StructType>(type)) {
+        if (!struct_type->isSized()) {
+            return;
+        }
+        const StructLayout *sl = dl.getStructLayout(struct_type);
+        std::vector<size_t> redzoneFields;
+        if (struct_type->hasName() && redzoneInfo->count(struct_type->getName()) > 0) {
+            redzoneFields = redzoneInfo->at(struct_type->getName())->redzone_offsets;
+        }
+        for (unsigned i = 0; i < struct_type->getNumElements(); i++) {
+            uint64_t offset = base + sl->getElementOffset(i);
+            Type *field = struct_type->getElementType(i);
+            if (std::find(redzoneFields.begin(), redzoneFields.end(), i) != redzoneFields.end()) {
+                layout->push_back(offset);
+                layout->push_back(dl.getTypeAllocSize(field));
+            } else {
+                collectRedzoneLayout(field, offset, dl, redzoneInfo, layout);
+            }
+        }
+    }
+}
+
+/**
+ * Returns a pointer to a constant table with the redzone layout of `type` (see
+ * collectRedzoneLayout), and its length in redzones. The pointer is null if the type has no
+ * redzones. Tables are created once per type.
+ */
+std::tuple<Constant *, uint64_t>
+getRedzoneLayoutTable(Module &M, Type *type,
+                      std::map<StringRef, std::shared_ptr<StructInfo>> *redzoneInfo,
+                      LayoutTableMap *tables) {
+    if (tables->count(type) > 0) {
+        return tables->at(type);
+    }
+    LLVMContext *C = &M.getContext();
+    std::vector<uint64_t> layout;
+    collectRedzoneLayout(type, 0, M.getDataLayout(), redzoneInfo, &layout);
+    Constant *table = nullptr;
+    if (!layout.empty()) {
+        Constant *zero = ConstantInt::get(IntegerType::getInt32Ty(*C), 0);
+        Constant *init = ConstantDataArray::get(*C, ArrayRef<uint64_t>(layout));
+        auto *tableGlobal = new GlobalVariable(M, init->getType(), true, GlobalValue::PrivateLinkage,
+                                               init, "rdzone_layout");
+        tableGlobal->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+        SmallVector<Constant *> indices = {zero, zero};
+        table = ConstantExpr::getInBoundsGetElementPtr(init->getType(), tableGlobal, indices);
+    }
+    (*tables)[type] = std::make_tuple(table, layout.size() / 2);
+    return tables->at(type);
+}
+
+/**
+ * A realloc copies the elements of the old block, redzones included. So rather than registering the
+ * redzones of all elements again, the runtime moves the existing ones along with the block and only
+ * the elements past the old end get new redzones.
+ * @param callToRealloc the call to realloc.inflated
+ * @param info The struct type of the elements
+ * @param elem_count The number of elements after the realloc
+ */
+void insert_realloc(CallInst *callToRealloc, Runtime *runtime, StructInfo *info, size_t elem_count,
+                    std::map<StringRef, std::shared_ptr<StructInfo>> *redzoneInfo,
+                    LayoutTableMap *layoutTables, TypeDescriptors *typeDescs) {
+    Module *M = callToRealloc->getModule();
+    LLVMContext *C = &M->getContext();
+    IRBuilder<> builder(callToRealloc);
+    Value *oldPtr = callToRealloc->getArgOperand(0);
+    // The old block is gone after the call, so its size has to be taken before.
+    SmallVector<Value *> argsSize = {oldPtr};
+    Value *oldSize = builder.CreateCall(runtime->rdzone_usable_size_f, argsSize);
+
+    builder.SetInsertPoint(callToRealloc->getNextNode());
+    SmallVector<Value *> argsMove = {oldPtr, callToRealloc, oldSize,
+                                     callToRealloc->getArgOperand(1)};
+    Value *covered = builder.CreateCall(runtime->rdzone_move_f, argsMove);
+
+    auto [table, layoutLen] =
+        getRedzoneLayoutTable(*M, info->inflatedType, redzoneInfo, layoutTables);
+    if (!table) {
+        return;
+    }
+    SmallVector<Value *> argsAdd = {
+        callToRealloc,
+        table,
+        ConstantInt::get(IntegerType::getInt64Ty(*C), layoutLen),
+        ConstantInt::get(IntegerType::getInt64Ty(*C), info->inflatedSize),
+        covered,
+        ConstantInt::get(IntegerType::getInt64Ty(*C), elem_count),
+        getTypeDescriptor(*M, info->inflatedType, redzoneInfo, typeDescs)};
+    builder.CreateCall(runtime->rdzone_add_elems_f, argsAdd);
+}
+
+/**
+ * Registers the redzones of all instrumented globals from a module constructor. Each global gets a
+ * descriptor that points to the redzone layout of its type (or of its element type, for arrays),
+ * from which the runtime can produce the redzones already sorted and bulk load them.
+ * The redzones themselves are colored by the initializers of the globals.
+ */
+void registerGlobalRedzones(Module &M, Runtime *runtime,
+                            std::map<StringRef, std::shared_ptr<StructInfo>> *redzoneInfo,
+                            LayoutTableMap *layoutTables, TypeDescriptors *typeDescs) {
+    LLVMContext *C = &M.getContext();
+    const DataLayout &dl = M.getDataLayout();
+    StructType *descType = getGlobalDescType(*C);
+    Type *i64 = Type::getInt64Ty(*C);
+
+    std::vector<Constant *> descs;
+    std::vector<GlobalVariable *> globals;
+    for (GlobalVariable &glob : M.globals()) {
+        globals.push_back(&glob);
+    }
+    for (GlobalVariable *glob : globals) {
+        // Skips our own tables as well.
+        if (!glob->hasInitializer() || !glob->getValueType()->isSized()) {
+            continue;
+        }
+        Type *elemType = glob->getValueType();
+        uint64_t count = 1;
+        if (auto *arr_type = dyn_cast<ArrayType>(elemType)) {
+            elemType = arr_type->getElementType();
+            count = arr_type->getNumElements();
+        }
+        auto [table, layoutLen] = getRedzoneLayoutTable(M, elemType, redzoneInfo, layoutTables);
+        if (!table) {
+            continue;
+        }
+        SmallVector<Constant *> fields = {
+            ConstantExpr::getPointerCast(glob, Type::getInt8PtrTy(*C)), table,
+            ConstantInt::get(i64, layoutLen), ConstantInt::get(i64, dl.getTypeAllocSize(elemType)),
+            ConstantInt::get(i64, count), getTypeDescriptor(M, elemType, redzoneInfo, typeDescs)};
+        descs.push_back(ConstantStruct::get(descType, fields));
+    }
+    if (descs.empty()) {
+        return;
+    }
+
+    ArrayType *descsType = ArrayType::get(descType, descs.size());
+    auto *descTable = new GlobalVariable(M, descsType, true, GlobalValue::PrivateLinkage,
+                                         ConstantArray::get(descsType, descs), "rdzone_globals");
+    Function *ctor =
+        Function::Create(FunctionType::get(Type::getVoidTy(*C), false),
+                         Function::InternalLinkage, "__rdzone_module_register_globals", M);
+    IRBuilder<> builder(BasicBlock::Create(*C, "entry", ctor));
+    SmallVector<Value *> args = {builder.CreateConstInBoundsGEP2_32(descsType, descTable, 0, 0),
+                                 ConstantInt::get(i64, descs.size())};
+    builder.CreateCall(runtime->rdzone_register_globals_f, args);
+    builder.CreateRetVoid();
+    // Right after the runtime has set up its index (priority 101), before any other constructor
+    // can touch the globals.
+    appendToGlobalCtors(M, ctor, 102);
+}
+
 /**
  * Takes a module with inflated structs, and sets up actual redzones in the inflations.
  * @param redzoneInfo Should contain information about which struct fields are redzones
@@ -344,48 +1165,69 @@ void insert_heap_free(CallInst *callToFree, struct Runtime *runtime,
 void setupRedzones(std::map<StringRef, std::shared_ptr<StructInfo>> *redzoneInfo, Module &M,
                    std::map<CallInst *, std::tuple<StructInfo, size_t>> *heapStructInfo) {
     struct Runtime runtime = add_runtime_linkage(M);
-    // TODO: add checks for global structs as well.
+    std::map<Function *, AllocaInst *> scratchArrays;
+    // Layout tables are shared between globals and reallocs of the same type.
+    LayoutTableMap layoutTables;
+    TypeDescriptors typeDescs;
+    SiteProfile profile = loadSiteProfile();
+    // Multiversioning adds functions while we go.
+    std::vector<Function *> functions;
     for (Function &func : M) {
+        functions.push_back(&func);
+    }
+    for (Function *funcPtr : functions) {
+        Function &func = *funcPtr;
+        uint64_t ordinal = 0;
+        // The checks are only inserted once the whole function has been walked, since sampled
+        // checks split blocks.
+        std::vector<std::vector<CheckSite>> blockChecks;
         for (BasicBlock &bb : func) {
+            std::vector<CheckSite> &checks = blockChecks.emplace_back();
             for (Instruction &inst : bb) {
                 if (auto *alloca_inst = dyn_cast<AllocaInst>(&inst)) {
                     if (alloca_inst->getAllocatedType()->isStructTy()) {
                         // An easy case; if we are allocating a single struct we can just pass a
                         // constant 1 as the number of elements.
                         insert_rdzone_init(alloca_inst, &runtime, alloca_inst->getAllocatedType(),
-                                           1, redzoneInfo);
+                                           1, redzoneInfo, &typeDescs);
                     } else if (auto *arr_ty =
                                    dyn_cast<ArrayType>(alloca_inst->getAllocatedType())) {
                         if (arr_ty->getElementType()->isStructTy()) {
                             // But if it is an array, we can pass the number of elements.
                             insert_rdzone_init(alloca_inst, &runtime,
                                                alloca_inst->getAllocatedType(),
-                                               arr_ty->getNumElements(), redzoneInfo);
+                                               arr_ty->getNumElements(), redzoneInfo, &typeDescs);
                         }
                     }
                     continue;
                 }
 
                 LoadInst *loadInst = dyn_cast<LoadInst>(&inst);
-                if (loadInst) {
-                    assert(loadInst->getType()->isSized());
-                    insertMemAccessCheck(&inst, loadInst->getOperand(0), loadInst->getType(),
-                                         &runtime);
-                    continue;
-                }
-
                 StoreInst *storeInst = dyn_cast<StoreInst>(&inst);
-                if (storeInst) {
-                    insertMemAccessCheck(&inst, storeInst->getOperand(1),
-                                         storeInst->getOperand(0)->getType(), &runtime);
+                if (loadInst || storeInst) {
+                    uint64_t id = getSiteId(func, ordinal++);
+                    CheckSite check =
+                        loadInst ? CheckSite{&inst, loadInst->getOperand(0), loadInst->getType(), id}
+                                 : CheckSite{&inst, storeInst->getOperand(1),
+                                             storeInst->getOperand(0)->getType(), id};
+                    assert(check.accessedType->isSized());
+                    if (!isHotCleanCheck(profile, id) &&
+                        !isStaticFieldAccess(check.ptrOperand, check.accessedType, redzoneInfo)) {
+                        checks.push_back(check);
+                    }
                     continue;
                 }
                 // Note: this deals with (m/re/c)alloc, not just any called function.
                 CallInst *callInst = dyn_cast<CallInst>(&inst);
                 if (callInst && (heapStructInfo->count(callInst) > 0)) {
                     auto tup = heapStructInfo->at(callInst);
-                    insert_rdzone_init(callInst, &runtime, std::get<0>(tup).inflatedType,
-                                       std::get<1>(tup), redzoneInfo);
+                    if (callInst->getCalledFunction()->getName().equals("realloc.inflated")) {
+                        insert_realloc(callInst, &runtime, &std::get<0>(tup), std::get<1>(tup),
+                                       redzoneInfo, &layoutTables, &typeDescs);
+                    } else {
+                        insert_rdzone_init(callInst, &runtime, std::get<0>(tup).inflatedType,
+                                           std::get<1>(tup), redzoneInfo, &typeDescs);
+                    }
                     continue;
                 } else if (callInst && callInst->getCalledFunction() &&
                            callInst->getCalledFunction()->getName().equals("free.inflated")) {
@@ -393,6 +1235,112 @@ void setupRedzones(std::map<StringRef, std::shared_ptr<StructInfo>> *redzoneInfo
                 }
             }
         }
+        if (shouldSplitCheckedVersion(func, blockChecks)) {
+            splitCheckedVersion(func, &blockChecks, &runtime);
+        }
+        for (std::vector<CheckSite> &checks : blockChecks) {
+            insertMemAccessChecks(checks, &runtime, &scratchArrays);
+        }
+    }
+    registerGlobalRedzones(M, &runtime, redzoneInfo, &layoutTables, &typeDescs);
+}
+
+// The libc functions that the runtime has checked versions of, as __rdzone_<name>.
+const char *const INTERCEPTED_LIBC[] = {"memcpy",  "memmove",  "memset", "strcpy",
+                                        "strncpy", "snprintf", "read",   "fread"};
+
+bool isIntercepted(StringRef name) {
+    for (const char *intercepted : INTERCEPTED_LIBC) {
+        if (name == intercepted) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Whether ptr points into a field of an inflated struct, looking through casts and GEPs. Pointers
+// to whole structs do not count: operations on those are laid out by the pass itself.
+bool pointsIntoField(Value *ptr, std::map<StringRef, std::shared_ptr<StructInfo>> *redzoneInfo) {
+    while (auto *gep = dyn_cast<GEPOperator>(ptr->stripPointerCasts())) {
+        for (auto it = gep_type_begin(gep); it != gep_type_end(gep); it++) {
+            StructType *structType = it.getStructTypeOrNull();
+            if (structType && structType->hasName() &&
+                redzoneInfo->count(structType->getName()) > 0) {
+                return true;
+            }
+        }
+        ptr = gep->getPointerOperand();
+    }
+    return false;
+}
+
+/**
+ * Sends the intercepted libc functions to their checked versions in the runtime, which check the
+ * whole range they touch at once. The memcpy, memmove and memset intrinsics are sent there too
+ * when they write to or read from a struct field, unless they are volatile.
+ */
+void interceptLibcCalls(Module &M, std::map<StringRef, std::shared_ptr<StructInfo>> *redzoneInfo) {
+    for (const char *name : INTERCEPTED_LIBC) {
+        Function *libcFunc = M.getFunction(name);
+        if (!libcFunc || !libcFunc->isDeclaration()) {
+            continue;
+        }
+        // The other arguments (the FILE of fread) were retyped along with the structs they point
+        // to, but the call is not wrapped: they go back to the declared types.
+        for (User *user : libcFunc->users()) {
+            auto *call = dyn_cast<CallInst>(user);
+            if (!call || call->getCalledOperand() != libcFunc) {
+                continue;
+            }
+            for (unsigned i = 0; i < call->arg_size() && i < libcFunc->arg_size(); i++) {
+                Type *paramType = libcFunc->getArg(i)->getType();
+                if (call->getArgOperand(i)->getType() != paramType) {
+                    call->setArgOperand(
+                        i, CastInst::CreatePointerCast(call->getArgOperand(i), paramType, "", call));
+                }
+            }
+        }
+        FunctionCallee checked =
+            M.getOrInsertFunction(std::string("__rdzone_") + name, libcFunc->getFunctionType());
+        libcFunc->replaceAllUsesWith(
+            ConstantExpr::getBitCast(cast<Constant>(checked.getCallee()), libcFunc->getType()));
+    }
+
+    std::vector<MemIntrinsic *> intrinsics;
+    for (Function &func : M) {
+        for (Instruction &inst : instructions(func)) {
+            auto *mem = dyn_cast<MemIntrinsic>(&inst);
+            if (!mem || mem->isVolatile() || mem->getMetadata(PAYLOAD_COPY_MD)) {
+                continue;
+            }
+            auto *transfer = dyn_cast<MemTransferInst>(mem);
+            if (pointsIntoField(mem->getRawDest(), redzoneInfo) ||
+                (transfer && pointsIntoField(transfer->getRawSource(), redzoneInfo))) {
+                intrinsics.push_back(mem);
+            }
+        }
+    }
+    LLVMContext &C = M.getContext();
+    Type *i8Ptr = Type::getInt8PtrTy(C);
+    Type *sizeType = M.getDataLayout().getIntPtrType(C);
+    for (MemIntrinsic *mem : intrinsics) {
+        IRBuilder<> builder(mem);
+        Value *length = builder.CreateZExtOrTrunc(mem->getLength(), sizeType);
+        if (auto *set = dyn_cast<MemSetInst>(mem)) {
+            FunctionCallee checked = M.getOrInsertFunction(
+                "__rdzone_memset", i8Ptr, i8Ptr, Type::getInt32Ty(C), sizeType);
+            builder.CreateCall(checked, {set->getRawDest(),
+                                         builder.CreateZExt(set->getValue(), builder.getInt32Ty()),
+                                         length});
+        } else {
+            auto *transfer = cast<MemTransferInst>(mem);
+            FunctionCallee checked = M.getOrInsertFunction(
+                isa<MemMoveInst>(mem) ? "__rdzone_memmove" : "__rdzone_memcpy", i8Ptr, i8Ptr,
+                i8Ptr, sizeType);
+            builder.CreateCall(checked,
+                               {transfer->getRawDest(), transfer->getRawSource(), length});
+        }
+        mem->eraseFromParent();
     }
 }
 
@@ -407,5 +1355,6 @@ void setupRedzoneChecks(std::map<Type *, std::shared_ptr<StructInfo>> *info, Mod
                         std::map<CallInst *, std::tuple<StructInfo, size_t>> *heapStructInfo) {
     std::map<StringRef, std::shared_ptr<StructInfo>> redzoneInfo;
     refactor_structinfo(info, &redzoneInfo);
+    interceptLibcCalls(M, &redzoneInfo);
     setupRedzones(&redzoneInfo, M, heapStructInfo);
 }
@@ -4,12 +4,29 @@
 #include <map>
 
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
 
 #ifndef REDZONE_HEADER
 #define REDZONE_HEADER
 using namespace llvm;
+// The size of a redzone, unless -structzone-layout=planned sizes them per field.
 const size_t REDZONE_SIZE = 32;
+// The byte redzones are filled with. Must match COLOR in the runtime.
+const uint8_t REDZONE_COLOR = 0xaa;
+
+// Where structs get redzones, see -structzone-protection.
+enum class ProtectionLevel {
+    // Before every field and after the last one.
+    Full,
+    // Only after the last field, against overflows out of the struct.
+    Tail,
+    // Only around fields that are arrays, where overflows within a struct come from.
+    Buffers
+};
+extern cl::opt<ProtectionLevel> Protection;
+// -structzone-debug: trace the pass and save the module after every step.
+extern cl::opt<bool> DebugTrace;
 
 struct StructInfo;
 
@@ -41,8 +58,15 @@ struct StructInfo {
     // A mapping from offsets in the unmapped type into the mapped type.
     std::map<size_t, size_t> offsetMapping;
     std::vector<size_t> redzone_offsets;
+    // The size of each of those redzones, in the same order.
+    std::vector<size_t> redzone_sizes;
 };
 typedef std::map<Type *, std::shared_ptr<StructInfo>> StructMap;
+// Marks the memcpys and memsets of the payload of a struct, which stay within its fields by
+// construction and so are not checked.
+const char *const PAYLOAD_COPY_MD = "structzone.payload";
+// Whether the runtime has a checked version (__rdzone_<name>) of this libc function.
+bool isIntercepted(StringRef name);
 void setupRedzoneChecks(std::map<Type *, std::shared_ptr<StructInfo>> *info, Module &M,
                         std::map<CallInst *, std::tuple<StructInfo, size_t>> *heapStructInfo);
 #endif
@@ -0,0 +1,102 @@
+#include "Runtime.h"
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+/**
+ * Persistent-mode driver for fuzz targets written against the libFuzzer interface
+ * (LLVMFuzzerTestOneInput). Link it together with the instrumented target and Runtime.a:
+ *
+ *  - Built with afl-clang-fast(++), it runs AFL++'s persistent loop over the shared memory
+ *    testcase, many inputs per fork.
+ *  - Otherwise it runs every file given on the command line (or stdin), which is enough to replay
+ *    crashes. -runs=N repeats them N times and prints the throughput.
+ *
+ * The redzones are snapshotted once the target is initialized, and __rdzone_iteration_reset()
+ * returns to that snapshot after every input, so redzones left behind by one input do not pile up
+ * in the index or trigger on memory that a later input reuses. The snapshot also keeps the index
+ * pages that forked children write to few. When fuzzing with libFuzzer itself (which brings its
+ * own main), call __rdzone_iteration_reset() at the start of LLVMFuzzerTestOneInput instead.
+ */
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+extern "C" __attribute__((weak)) int LLVMFuzzerInitialize(int *argc, char ***argv);
+
+static void run_one(const uint8_t *data, size_t size) {
+    LLVMFuzzerTestOneInput(data, size);
+    __rdzone_iteration_reset();
+}
+
+#ifdef __AFL_HAVE_MANUAL_CONTROL
+__AFL_FUZZ_INIT();
+#endif
+
+static bool read_input(FILE *file, std::vector<uint8_t> *input) {
+    uint8_t buf[4096];
+    size_t n;
+    input->clear();
+    while ((n = fread(buf, 1, sizeof(buf), file)) > 0) {
+        input->insert(input->end(), buf, buf + n);
+    }
+    return !ferror(file);
+}
+
+int main(int argc, char **argv) {
+    if (LLVMFuzzerInitialize) {
+        LLVMFuzzerInitialize(&argc, &argv);
+    }
+    __rdzone_snapshot();
+
+#ifdef __AFL_HAVE_MANUAL_CONTROL
+    // Everything before this point (including the global redzones) is done once per fork server.
+    __AFL_INIT();
+    const uint8_t *buf = __AFL_FUZZ_TESTCASE_BUF;
+    while (__AFL_LOOP(10000)) {
+        run_one(buf, __AFL_FUZZ_TESTCASE_LEN);
+    }
+    return 0;
+#endif
+
+    long runs = 1;
+    std::vector<std::vector<uint8_t>> inputs;
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "-runs=", 6) == 0) {
+            runs = atol(argv[i] + 6);
+            continue;
+        }
+        FILE *file = fopen(argv[i], "rb");
+        if (file == NULL) {
+            perror(argv[i]);
+            return 1;
+        }
+        inputs.emplace_back();
+        bool ok = read_input(file, &inputs.back());
+        fclose(file);
+        if (!ok) {
+            perror(argv[i]);
+            return 1;
+        }
+    }
+    if (inputs.empty()) {
+        inputs.emplace_back();
+        if (!read_input(stdin, &inputs.back())) {
+            perror("stdin");
+            return 1;
+        }
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    for (long run = 0; run < runs; run++) {
+        for (auto &input : inputs) {
+            run_one(input.data(), input.size());
+        }
+    }
+    if (runs > 1) {
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        fprintf(stderr, "%ld execs in %.3fs (%.0f exec/s)\n", runs * (long)inputs.size(),
+                elapsed.count(), runs * inputs.size() / elapsed.count());
+    }
+    return 0;
+}
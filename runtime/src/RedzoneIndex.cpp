@@ -0,0 +1,1286 @@
+#include "RedzoneIndex.h"
+#include <algorithm>
+#include <assert.h>
+#include <iostream>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+void RedzoneIndex::CheckPoisonBatch(const uint64_t *probes, const uint8_t *widths, size_t n,
+                                   bool *hits) {
+    for (size_t i = 0; i < n; i++) {
+        hits[i] = CheckPoison(probes[i], widths[i]);
+    }
+}
+
+bool RedzoneIndex::snapshot() { return false; }
+bool RedzoneIndex::restore() { return false; }
+unsigned RedzoneIndex::LookupDepth(uint64_t) { return 0; }
+
+/**
+ * Merges two runs of redzones that are sorted by start. When both contain the same start, the
+ * existing redzone is kept. The redzones taken from `incoming` are also appended to `inserted`.
+ */
+static void mergeZones(const std::vector<std::pair<uint64_t, uint64_t>> &existing,
+                       const std::vector<std::pair<uint64_t, uint64_t>> &incoming,
+                       std::vector<std::pair<uint64_t, uint64_t>> *merged,
+                       std::vector<std::pair<uint64_t, uint64_t>> *inserted) {
+    merged->reserve(existing.size() + incoming.size());
+    size_t i = 0;
+    size_t j = 0;
+    while (i < existing.size() || j < incoming.size()) {
+        if (j == incoming.size() ||
+            (i < existing.size() && existing[i].first <= incoming[j].first)) {
+            merged->push_back(existing[i++]);
+        } else if (!merged->empty() && merged->back().first == incoming[j].first) {
+            j++;
+        } else {
+            merged->push_back(incoming[j]);
+            if (inserted) {
+                inserted->push_back(incoming[j]);
+            }
+            j++;
+        }
+    }
+}
+
+// AVL tree implementation in C++
+
+#define max(a, b) ((a > b) ? a : b)
+
+using namespace std;
+
+#pragma region NodeArena
+
+NodeArena::~NodeArena() {
+    if (base != NULL) {
+        munmap(base, RESERVED_NODES * sizeof(Node));
+    }
+    if (snapshotFd >= 0) {
+        close(snapshotFd);
+    }
+}
+
+Node *NodeArena::alloc() {
+    if (freeList != NULL) {
+        Node *node = freeList;
+        freeList = node->left;
+        return node;
+    }
+    if (base == NULL) {
+        void *region = mmap(NULL, RESERVED_NODES * sizeof(Node), PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (region == MAP_FAILED) {
+            perror("structzone: reserving the index");
+            abort();
+        }
+        base = (Node *)region;
+    }
+    if (top == RESERVED_NODES) {
+        cerr << "structzone: more than " << RESERVED_NODES << " redzones\n";
+        abort();
+    }
+    return &base[top++];
+}
+
+void NodeArena::free(Node *node) {
+    // Linking a snapshot node into the free list would dirty its page for nothing.
+    if (node < base + floor) {
+        return;
+    }
+    node->left = freeList;
+    freeList = node;
+}
+
+void NodeArena::reset() {
+    top = 0;
+    floor = 0;
+    freeList = NULL;
+}
+
+static size_t pageAligned(size_t bytes) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    return (bytes + page - 1) / page * page;
+}
+
+bool NodeArena::snapshot() {
+    size_t bytes = pageAligned(top * sizeof(Node));
+    if (bytes > 0) {
+        if (snapshotFd < 0) {
+            snapshotFd = memfd_create("structzone-index", MFD_CLOEXEC);
+            if (snapshotFd < 0) {
+                return false;
+            }
+        }
+        // Never shrink the file: nodes above the new snapshot may still be mapped from a bigger
+        // one that was restored earlier, and would turn into holes that fault when written.
+        if (bytes > snapshotFileBytes) {
+            if (ftruncate(snapshotFd, bytes) != 0) {
+                return false;
+            }
+            snapshotFileBytes = bytes;
+        }
+        for (size_t done = 0; done < bytes;) {
+            ssize_t n = pwrite(snapshotFd, (char *)base + done, bytes - done, done);
+            if (n <= 0) {
+                return false;
+            }
+            done += n;
+        }
+    }
+    snapshotTop = top;
+    floor = top;
+    // The free nodes are below floor now; they are lost until the next reset.
+    freeList = NULL;
+    hasSnapshot = true;
+    return true;
+}
+
+bool NodeArena::restore() {
+    if (!hasSnapshot) {
+        return false;
+    }
+    size_t bytes = pageAligned(snapshotTop * sizeof(Node));
+    // Replaces whatever was written since with private copy-on-write mappings of the snapshot.
+    if (bytes > 0 && mmap(base, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+                          snapshotFd, 0) == MAP_FAILED) {
+        perror("structzone: restoring the index");
+        abort();
+    }
+    top = snapshotTop;
+    floor = top;
+    freeList = NULL;
+    return true;
+}
+
+#pragma endregion
+
+#pragma region AVLtree
+
+// New node creation
+Node *AVLTree::newNode(uint64_t key, uint64_t size) {
+    Node *node = arena.alloc();
+    count++;
+    node->key = key;
+    node->size = size;
+    node->left = NULL;
+    node->right = NULL;
+    node->height = 1;
+    return (node);
+}
+
+// Calculate height
+int AVLTree::height(Node *N) {
+    if (N == NULL)
+        return 0;
+    return N->height;
+}
+
+// Rotate right
+Node *AVLTree::rightRotate(Node *y) {
+    Node *x = y->left;
+    Node *T2 = x->right;
+    x->right = y;
+    y->left = T2;
+    y->height = max(height(y->left), height(y->right)) + 1;
+    x->height = max(height(x->left), height(x->right)) + 1;
+    return x;
+}
+
+// Rotate left
+Node *AVLTree::leftRotate(Node *x) {
+    Node *y = x->right;
+    Node *T2 = y->left;
+    y->left = x;
+    x->right = T2;
+    x->height = max(height(x->left), height(x->right)) + 1;
+    y->height = max(height(y->left), height(y->right)) + 1;
+    return y;
+}
+
+// Get the balance factor of each node
+int AVLTree::getBalanceFactor(Node *N) {
+    if (N == NULL)
+        return 0;
+    return height(N->left) - height(N->right);
+}
+
+// Insert a node
+Node *AVLTree::insertNode(Node *node, uint64_t key, uint64_t size, bool *inserted) {
+    // Find the correct postion and insert the node
+    if (node == NULL) {
+        *inserted = true;
+        return (newNode(key, size));
+    }
+    if (key < node->key)
+        node->left = insertNode(node->left, key, size, inserted);
+    else if (key > node->key)
+        node->right = insertNode(node->right, key, size, inserted);
+    else
+        return node;
+
+    // Update the balance factor of each node and
+    // balance the tree
+    node->height = 1 + max(height(node->left), height(node->right));
+    int balanceFactor = getBalanceFactor(node);
+    if (balanceFactor > 1) {
+        if (key < node->left->key) {
+            return rightRotate(node);
+        } else if (key > node->left->key) {
+            node->left = leftRotate(node->left);
+            return rightRotate(node);
+        }
+    }
+    if (balanceFactor < -1) {
+        if (key > node->right->key) {
+            return leftRotate(node);
+        } else if (key < node->right->key) {
+            node->right = rightRotate(node->right);
+            return leftRotate(node);
+        }
+    }
+    return node;
+}
+
+// Node with minimum value
+Node *AVLTree::nodeWithMimumValue(Node *node) {
+    Node *current = node;
+    while (current->left != NULL)
+        current = current->left;
+    return current;
+}
+
+// Delete a node
+Node *AVLTree::deleteNode(Node *root, uint64_t key) {
+    // Find the node and delete it
+    if (root == NULL)
+        return root;
+    if (key < root->key)
+        root->left = deleteNode(root->left, key);
+    else if (key > root->key)
+        root->right = deleteNode(root->right, key);
+    else {
+        if ((root->left == NULL) || (root->right == NULL)) {
+            Node *temp = root->left ? root->left : root->right;
+            if (temp == NULL) {
+                temp = root;
+                root = NULL;
+            } else
+                *root = *temp;
+            arena.free(temp);
+            count--;
+        } else {
+            Node *temp = nodeWithMimumValue(root->right);
+            root->key = temp->key;
+            root->size = temp->size;
+            root->right = deleteNode(root->right, temp->key);
+        }
+    }
+
+    if (root == NULL)
+        return root;
+
+    // Update the balance factor of each node and
+    // balance the tree
+    root->height = 1 + max(height(root->left), height(root->right));
+    int balanceFactor = getBalanceFactor(root);
+    if (balanceFactor > 1) {
+        if (getBalanceFactor(root->left) >= 0) {
+            return rightRotate(root);
+        } else {
+            root->left = leftRotate(root->left);
+            return rightRotate(root);
+        }
+    }
+    if (balanceFactor < -1) {
+        if (getBalanceFactor(root->right) <= 0) {
+            return leftRotate(root);
+        } else {
+            root->right = rightRotate(root->right);
+            return leftRotate(root);
+        }
+    }
+    return root;
+}
+
+// Print the tree
+void AVLTree::_printTree(Node *root, string indent, bool last) {
+    if (root != nullptr) {
+        cerr << indent;
+        if (last) {
+            cerr << "R----";
+            indent += "   ";
+        } else {
+            cerr << "L----";
+            indent += "|  ";
+        }
+        cerr << std::hex << root->key << std::endl;
+        _printTree(root->left, indent, false);
+        _printTree(root->right, indent, true);
+    }
+}
+
+/**
+ * If you go left, you're the right parent and vice versa
+ * When done, one is exactly between the left and right node.
+ */
+bool AVLTree::_CheckPoison(Node *root, uint64_t probe, uint8_t readWidth, Node *leftPar,
+                           Node *rightPar) {
+
+    DBG(cerr << std::hex << "probe: " << probe << " on node " << (root ? root->key : 0);)
+
+    if (root == NULL) {
+        // cerr << " is null\n";
+        // return false;
+    } else if (root->key == probe) {
+        DBG(cerr << " exact hit";)
+        leftPar = root;
+    } else if (root->key < probe) {
+        DBG(cerr << " Right\n";)
+        return _CheckPoison(root->right, probe, readWidth, root, rightPar);
+    } else if (root->key > probe) {
+        DBG(cerr << " Left\n";)
+        return _CheckPoison(root->left, probe, readWidth, leftPar, root);
+    }
+
+    uint64_t leftKey = leftPar != NULL ? leftPar->key : 0;
+    uint64_t rightKey = rightPar != NULL ? rightPar->key : 0;
+    DBG(cerr << " left: " << leftKey << " right: " << rightKey;)
+
+    /**
+     * Left parent is the node which is immediately left in the ordering. If null,
+     * there is no node immediately left of us in the ordering, which happens if
+     * we are the left-most node. Right is similar.
+     */
+    if (leftPar != NULL && (leftPar->key + leftPar->size) > probe) {
+        DBG(cerr << " first byte hit\n";)
+        return true;
+    } else if (rightPar != NULL && (rightPar->key) < (probe + readWidth)) {
+        DBG(cerr << " partial overflow detected!\n";)
+        return true;
+    }
+    DBG(cerr << " all clear\n";)
+    return false;
+}
+
+void AVLTree::_get_between(Node *root, uint64_t start, uint64_t end, std::vector<Node *> *to_Ret) {
+    DBG(cerr << std::hex << "looking for: " << start << " to " << end << " on node "
+             << (root ? root->key : 0);)
+    assert(start < end);
+    if (root == NULL) {
+        DBG(cerr << "\n");
+        return;
+    } else if (root->key >= start && root->key <= end) {
+        DBG(cerr << " M\n");
+        to_Ret->push_back(root);
+        _get_between(root->left, start, end, to_Ret);
+        _get_between(root->right, start, end, to_Ret);
+
+    } else if (root->key > end) {
+        DBG(cerr << " L\n");
+        _get_between(root->left, start, end, to_Ret);
+    } else if (root->key < start) {
+        DBG(cerr << " R\n");
+        _get_between(root->right, start, end, to_Ret);
+    }
+}
+
+#pragma endregion
+
+#pragma region
+
+bool AVLTree::InsertRedzone(uint64_t start, uint64_t size) {
+    bool inserted = false;
+    root = insertNode(root, start, size, &inserted);
+    return inserted;
+}
+
+void AVLTree::RemoveRedzone(uint64_t start) { root = deleteNode(root, start); }
+
+// Returns the size of the redzone starting at `start`, or 0 if there is none.
+uint64_t AVLTree::RedzoneSize(uint64_t start) {
+    Node *current = root;
+    while (current != NULL && current->key != start)
+        current = start < current->key ? current->left : current->right;
+    return current != NULL ? current->size : 0;
+}
+
+bool AVLTree::Predecessor(uint64_t key, std::pair<uint64_t, uint64_t> *zone) {
+    Node *current = root;
+    Node *best = NULL;
+    while (current != NULL) {
+        if (current->key <= key) {
+            best = current;
+            current = current->right;
+        } else {
+            current = current->left;
+        }
+    }
+    if (best == NULL) {
+        return false;
+    }
+    *zone = {best->key, best->size};
+    return true;
+}
+
+bool AVLTree::CheckPoison(uint64_t probe, uint8_t readWidth) {
+    return _CheckPoison(root, probe, readWidth, NULL, NULL);
+}
+// The nodes all live in the arena, so there is nothing to walk.
+void AVLTree::reset() {
+    root = nullptr;
+    count = 0;
+    arena.reset();
+}
+void AVLTree::printTree() { _printTree(root, "", false); }
+bool AVLTree::snapshot() {
+    if (!arena.snapshot()) {
+        return false;
+    }
+    snapshotRoot = root;
+    snapshotCount = count;
+    return true;
+}
+bool AVLTree::restore() {
+    if (!arena.restore()) {
+        return false;
+    }
+    root = snapshotRoot;
+    count = snapshotCount;
+    return true;
+}
+unsigned AVLTree::LookupDepth(uint64_t key) {
+    unsigned depth = 0;
+    for (Node *node = root; node != NULL && node->key != key;
+         node = node->key < key ? node->right : node->left) {
+        depth++;
+    }
+    return depth;
+}
+size_t AVLTree::bytes() { return arena.bytes(); }
+void AVLTree::remove_between(uint64_t start, uint64_t end,
+                             std::vector<std::pair<uint64_t, uint64_t>> *removed) {
+    assert(start < end);
+    std::vector<Node *> nodesToRm;
+    _get_between(root, start, end, &nodesToRm);
+
+    DBG(cerr << "Removing " << nodesToRm.size() << " nodes\n");
+    // Copy the keys first; deleting a node may move another node's contents into it.
+    std::vector<std::pair<uint64_t, uint64_t>> zones;
+    for (Node *node : nodesToRm) {
+        zones.push_back({node->key, node->size});
+    }
+    for (auto &zone : zones) {
+        DBG(cerr << "rm " << zone.first << "\n");
+        RemoveRedzone(zone.first);
+    }
+    if (removed) {
+        removed->insert(removed->end(), zones.begin(), zones.end());
+    }
+}
+size_t AVLTree::size() { return count; }
+
+// Builds a perfectly balanced subtree out of zones[begin, end).
+Node *AVLTree::buildBalanced(const std::vector<std::pair<uint64_t, uint64_t>> &zones, size_t begin,
+                             size_t end) {
+    if (begin >= end) {
+        return NULL;
+    }
+    size_t mid = begin + (end - begin) / 2;
+    Node *node = newNode(zones[mid].first, zones[mid].second);
+    node->left = buildBalanced(zones, begin, mid);
+    node->right = buildBalanced(zones, mid + 1, end);
+    node->height = max(height(node->left), height(node->right)) + 1;
+    return node;
+}
+
+/**
+ * Rebuilds the tree from the merged, sorted redzones in O(n), instead of rebalancing after each of
+ * the n inserts. A handful of redzones on a big tree is still cheaper to insert one by one.
+ */
+void AVLTree::InsertSorted(const std::vector<std::pair<uint64_t, uint64_t>> &zones,
+                           std::vector<std::pair<uint64_t, uint64_t>> *inserted) {
+    if (zones.size() * height(root) < count) {
+        for (auto &zone : zones) {
+            if (InsertRedzone(zone.first, zone.second) && inserted) {
+                inserted->push_back(zone);
+            }
+        }
+        return;
+    }
+    std::vector<std::pair<uint64_t, uint64_t>> existing;
+    std::vector<std::pair<uint64_t, uint64_t>> merged;
+    collect(&existing);
+    mergeZones(existing, zones, &merged, inserted);
+    reset();
+    root = buildBalanced(merged, 0, merged.size());
+}
+
+/**
+ * Walks the descents of several probes in lockstep, one level at a time, and prefetches the next
+ * node of every descent before taking the next step. The cache misses of independent descents
+ * then overlap instead of being paid one after the other.
+ */
+void AVLTree::CheckPoisonBatch(const uint64_t *probes, const uint8_t *widths, size_t n,
+                               bool *hits) {
+    // Interleaving only pays off once the tree no longer fits in cache; below that the extra
+    // bookkeeping makes it slower than plain descents (see RuntimeBench.cpp).
+    if (count < BATCH_MIN_NODES) {
+        RedzoneIndex::CheckPoisonBatch(probes, widths, n, hits);
+        return;
+    }
+    const size_t LANES = 8;
+    for (size_t base = 0; base < n; base += LANES) {
+        size_t lanes = n - base < LANES ? n - base : LANES;
+        Node *current[LANES];
+        Node *leftPar[LANES];
+        Node *rightPar[LANES];
+        for (size_t l = 0; l < lanes; l++) {
+            current[l] = root;
+            leftPar[l] = NULL;
+            rightPar[l] = NULL;
+        }
+        size_t active = root ? lanes : 0;
+        while (active > 0) {
+            active = 0;
+            for (size_t l = 0; l < lanes; l++) {
+                Node *node = current[l];
+                if (node == NULL) {
+                    continue;
+                }
+                uint64_t probe = probes[base + l];
+                // Written as selects rather than branches: the lanes go left and right at random,
+                // which the branch predictor cannot follow. An exact hit makes this node the left
+                // parent and ends the descent, as in _CheckPoison.
+                bool goRight = node->key <= probe;
+                leftPar[l] = goRight ? node : leftPar[l];
+                rightPar[l] = goRight ? rightPar[l] : node;
+                Node *next = goRight ? node->right : node->left;
+                current[l] = node->key == probe ? NULL : next;
+                if (current[l] != NULL) {
+                    __builtin_prefetch(current[l]);
+                    active++;
+                }
+            }
+        }
+        for (size_t l = 0; l < lanes; l++) {
+            uint64_t probe = probes[base + l];
+            hits[base + l] =
+                (leftPar[l] != NULL && leftPar[l]->key + leftPar[l]->size > probe) ||
+                (rightPar[l] != NULL && rightPar[l]->key < probe + widths[base + l]);
+        }
+    }
+}
+
+// Appends all redzones in ascending order.
+void AVLTree::collect(std::vector<std::pair<uint64_t, uint64_t>> *zones) {
+    std::vector<Node *> stack;
+    Node *current = root;
+    while (current != NULL || !stack.empty()) {
+        while (current != NULL) {
+            stack.push_back(current);
+            current = current->left;
+        }
+        current = stack.back();
+        stack.pop_back();
+        zones->push_back({current->key, current->size});
+        current = current->right;
+    }
+}
+#pragma endregion
+
+#pragma region RedzoneVector
+
+// Lanes of four keys; both gcc and clang lower the comparisons to whatever SIMD the target has.
+typedef uint64_t u64x4 __attribute__((vector_size(32)));
+
+/**
+ * Number of keys <= probe, which is also the index of the first key above it. Scanning the whole
+ * (small) array branch-free is cheaper than a binary search, whose branches are unpredictable.
+ */
+size_t RedzoneVector::countNotAbove(uint64_t probe) {
+    size_t n = keys.size();
+    size_t i = 0;
+    u64x4 needle = {probe, probe, probe, probe};
+    u64x4 acc = {0, 0, 0, 0};
+    for (; i + 4 <= n; i += 4) {
+        u64x4 lane;
+        memcpy(&lane, &keys[i], sizeof(lane));
+        // A true comparison yields all ones, i.e. -1.
+        acc -= (u64x4)(lane <= needle);
+    }
+    size_t result = acc[0] + acc[1] + acc[2] + acc[3];
+    for (; i < n; i++) {
+        result += keys[i] <= probe;
+    }
+    return result;
+}
+
+bool RedzoneVector::InsertRedzone(uint64_t start, uint64_t size) {
+    size_t idx = countNotAbove(start);
+    if (idx > 0 && keys[idx - 1] == start) {
+        return false;
+    }
+    keys.insert(keys.begin() + idx, start);
+    sizes.insert(sizes.begin() + idx, size);
+    return true;
+}
+
+void RedzoneVector::RemoveRedzone(uint64_t start) {
+    size_t idx = countNotAbove(start);
+    if (idx > 0 && keys[idx - 1] == start) {
+        keys.erase(keys.begin() + idx - 1);
+        sizes.erase(sizes.begin() + idx - 1);
+    }
+}
+
+uint64_t RedzoneVector::RedzoneSize(uint64_t start) {
+    size_t idx = countNotAbove(start);
+    return idx > 0 && keys[idx - 1] == start ? sizes[idx - 1] : 0;
+}
+
+// Same semantics as AVLTree::_CheckPoison: only the direct neighbours of the probe matter.
+bool RedzoneVector::Predecessor(uint64_t key, std::pair<uint64_t, uint64_t> *zone) {
+    size_t idx = countNotAbove(key);
+    if (idx == 0) {
+        return false;
+    }
+    *zone = {keys[idx - 1], sizes[idx - 1]};
+    return true;
+}
+
+bool RedzoneVector::CheckPoison(uint64_t probe, uint8_t readWidth) {
+    size_t idx = countNotAbove(probe);
+    if (idx > 0 && keys[idx - 1] + sizes[idx - 1] > probe) {
+        return true;
+    }
+    return idx < keys.size() && keys[idx] < probe + readWidth;
+}
+
+void RedzoneVector::reset() {
+    keys.clear();
+    sizes.clear();
+}
+
+// Small enough to simply be copied.
+bool RedzoneVector::snapshot() {
+    snapshotKeys = keys;
+    snapshotSizes = sizes;
+    return true;
+}
+
+bool RedzoneVector::restore() {
+    keys = snapshotKeys;
+    sizes = snapshotSizes;
+    return true;
+}
+
+size_t RedzoneVector::bytes() { return (keys.capacity() + sizes.capacity()) * sizeof(uint64_t); }
+
+void RedzoneVector::printTree() {
+    for (size_t i = 0; i < keys.size(); i++) {
+        cerr << std::hex << keys[i] << " (" << sizes[i] << ")" << std::endl;
+    }
+}
+
+void RedzoneVector::remove_between(uint64_t start, uint64_t end,
+                                   std::vector<std::pair<uint64_t, uint64_t>> *removed) {
+    assert(start < end);
+    size_t first = countNotAbove(start - 1);
+    if (start == 0) {
+        first = 0;
+    }
+    size_t last = countNotAbove(end);
+    if (first >= last) {
+        return;
+    }
+    if (removed) {
+        for (size_t i = first; i < last; i++) {
+            removed->push_back({keys[i], sizes[i]});
+        }
+    }
+    keys.erase(keys.begin() + first, keys.begin() + last);
+    sizes.erase(sizes.begin() + first, sizes.begin() + last);
+}
+
+size_t RedzoneVector::size() { return keys.size(); }
+
+void RedzoneVector::InsertSorted(const std::vector<std::pair<uint64_t, uint64_t>> &zones,
+                                 std::vector<std::pair<uint64_t, uint64_t>> *inserted) {
+    std::vector<std::pair<uint64_t, uint64_t>> existing;
+    std::vector<std::pair<uint64_t, uint64_t>> merged;
+    collect(&existing);
+    mergeZones(existing, zones, &merged, inserted);
+    reset();
+    keys.reserve(merged.size());
+    sizes.reserve(merged.size());
+    for (auto &zone : merged) {
+        keys.push_back(zone.first);
+        sizes.push_back(zone.second);
+    }
+}
+
+void RedzoneVector::collect(std::vector<std::pair<uint64_t, uint64_t>> *zones) {
+    for (size_t i = 0; i < keys.size(); i++) {
+        zones->push_back({keys[i], sizes[i]});
+    }
+}
+
+#pragma endregion
+
+#pragma region AdaptiveIndex
+
+void AdaptiveIndex::promote() {
+    std::vector<std::pair<uint64_t, uint64_t>> zones;
+    small.collect(&zones);
+    for (auto &zone : zones) {
+        tree.InsertRedzone(zone.first, zone.second);
+    }
+    small.reset();
+    promoted = true;
+}
+
+void AdaptiveIndex::maybeDemote() {
+    if (!promoted || tree.size() > SMALL_INDEX_MAX / 4) {
+        return;
+    }
+    std::vector<std::pair<uint64_t, uint64_t>> zones;
+    tree.collect(&zones);
+    for (auto &zone : zones) {
+        small.InsertRedzone(zone.first, zone.second);
+    }
+    tree.reset();
+    promoted = false;
+}
+
+bool AdaptiveIndex::InsertRedzone(uint64_t start, uint64_t size) {
+    if (promoted) {
+        return tree.InsertRedzone(start, size);
+    }
+    if (!small.InsertRedzone(start, size)) {
+        return false;
+    }
+    if (small.size() > SMALL_INDEX_MAX) {
+        promote();
+    }
+    return true;
+}
+
+void AdaptiveIndex::RemoveRedzone(uint64_t start) {
+    if (promoted) {
+        tree.RemoveRedzone(start);
+        maybeDemote();
+    } else {
+        small.RemoveRedzone(start);
+    }
+}
+
+uint64_t AdaptiveIndex::RedzoneSize(uint64_t start) {
+    return promoted ? tree.RedzoneSize(start) : small.RedzoneSize(start);
+}
+
+bool AdaptiveIndex::Predecessor(uint64_t key, std::pair<uint64_t, uint64_t> *zone) {
+    return promoted ? tree.Predecessor(key, zone) : small.Predecessor(key, zone);
+}
+
+bool AdaptiveIndex::CheckPoison(uint64_t probe, uint8_t readWidth) {
+    return promoted ? tree.CheckPoison(probe, readWidth) : small.CheckPoison(probe, readWidth);
+}
+
+void AdaptiveIndex::CheckPoisonBatch(const uint64_t *probes, const uint8_t *widths, size_t n,
+                                     bool *hits) {
+    if (promoted) {
+        tree.CheckPoisonBatch(probes, widths, n, hits);
+    } else {
+        small.CheckPoisonBatch(probes, widths, n, hits);
+    }
+}
+
+void AdaptiveIndex::reset() {
+    small.reset();
+    tree.reset();
+    promoted = false;
+}
+
+bool AdaptiveIndex::snapshot() {
+    if (!small.snapshot() || !tree.snapshot()) {
+        return false;
+    }
+    snapshotPromoted = promoted;
+    return true;
+}
+
+bool AdaptiveIndex::restore() {
+    if (!small.restore() || !tree.restore()) {
+        return false;
+    }
+    promoted = snapshotPromoted;
+    return true;
+}
+
+unsigned AdaptiveIndex::LookupDepth(uint64_t key) {
+    return promoted ? tree.LookupDepth(key) : small.LookupDepth(key);
+}
+
+size_t AdaptiveIndex::bytes() { return small.bytes() + tree.bytes(); }
+
+void AdaptiveIndex::printTree() {
+    if (promoted) {
+        tree.printTree();
+    } else {
+        small.printTree();
+    }
+}
+
+void AdaptiveIndex::remove_between(uint64_t start, uint64_t end,
+                                   std::vector<std::pair<uint64_t, uint64_t>> *removed) {
+    if (promoted) {
+        tree.remove_between(start, end, removed);
+        maybeDemote();
+    } else {
+        small.remove_between(start, end, removed);
+    }
+}
+
+size_t AdaptiveIndex::size() { return promoted ? tree.size() : small.size(); }
+
+void AdaptiveIndex::InsertSorted(const std::vector<std::pair<uint64_t, uint64_t>> &zones,
+                                 std::vector<std::pair<uint64_t, uint64_t>> *inserted) {
+    if (!promoted && small.size() + zones.size() > SMALL_INDEX_MAX) {
+        promote();
+    }
+    if (promoted) {
+        tree.InsertSorted(zones, inserted);
+    } else {
+        small.InsertSorted(zones, inserted);
+    }
+}
+
+#pragma endregion
+
+#pragma region SnapshotIndex
+
+static bool zoneBefore(const std::pair<uint64_t, uint64_t> &zone, uint64_t key) {
+    return zone.first < key;
+}
+
+static bool keyBefore(uint64_t key, const std::pair<uint64_t, uint64_t> &zone) {
+    return key < zone.first;
+}
+
+/*
+ * Epoch-based reclamation of the versions SnapshotIndex unpublishes. A reader announces the global
+ * epoch in the slot of its thread before it loads the current version, and withdraws it when it is
+ * done. An unpublished version is tagged with the epoch at the time, which is then advanced, and is
+ * freed once every slot is either empty or announces a later epoch: a reader that announced later
+ * loaded the version after it had been replaced. Threads that find no free slot count as one shared
+ * reader, which holds off reclamation altogether while they read.
+ */
+static const size_t EPOCH_SLOTS = 256;
+static const uint64_t QUIESCENT = UINT64_MAX;
+
+struct alignas(64) EpochSlot {
+    std::atomic<uint64_t> epoch{QUIESCENT};
+    std::atomic<bool> used{false};
+};
+
+static std::atomic<uint64_t> globalEpoch{0};
+static EpochSlot epochSlots[EPOCH_SLOTS];
+static std::atomic<uint64_t> slotlessReaders{0};
+
+// Claims a slot on the first read of a thread, and frees it when the thread exits.
+struct SlotOwner {
+    // -2 until the first read, -1 if all slots were taken.
+    long slot = -2;
+
+    long get() {
+        if (slot == -2) {
+            slot = -1;
+            for (size_t i = 0; i < EPOCH_SLOTS; i++) {
+                bool expected = false;
+                if (epochSlots[i].used.compare_exchange_strong(expected, true)) {
+                    slot = i;
+                    break;
+                }
+            }
+        }
+        return slot;
+    }
+    ~SlotOwner() {
+        if (slot >= 0) {
+            epochSlots[slot].epoch.store(QUIESCENT);
+            epochSlots[slot].used.store(false, std::memory_order_release);
+        }
+    }
+};
+
+static thread_local SlotOwner slotOwner;
+
+// Keeps every version that is current while it exists from being freed.
+class ReadGuard {
+  private:
+    long slot;
+    bool announced = false;
+
+  public:
+    ReadGuard() : slot(slotOwner.get()) {
+        if (slot < 0) {
+            slotlessReaders.fetch_add(1);
+        } else if (epochSlots[slot].epoch.load(std::memory_order_relaxed) == QUIESCENT) {
+            // Otherwise this read interrupted another one of the thread (in a signal handler),
+            // which already protects it.
+            epochSlots[slot].epoch.store(globalEpoch.load());
+            announced = true;
+        }
+    }
+    ~ReadGuard() {
+        if (slot < 0) {
+            slotlessReaders.fetch_sub(1);
+        } else if (announced) {
+            epochSlots[slot].epoch.store(QUIESCENT, std::memory_order_release);
+        }
+    }
+};
+
+SnapshotIndex::~SnapshotIndex() {
+    delete current.load();
+    for (auto &[epoch, version] : retired) {
+        delete version;
+    }
+}
+
+bool SnapshotIndex::tombstoned(const Version *version, uint64_t key) {
+    return !version->tombstones.empty() &&
+           std::binary_search(version->tombstones.begin(), version->tombstones.end(), key);
+}
+
+long SnapshotIndex::liveInSnapshot(const Version *version, uint64_t key) {
+    if (version == NULL || !version->base) {
+        return -1;
+    }
+    const Snapshot *snap = version->base.get();
+    auto it = std::lower_bound(snap->keys.begin(), snap->keys.end(), key);
+    if (it == snap->keys.end() || *it != key || tombstoned(version, key)) {
+        return -1;
+    }
+    return it - snap->keys.begin();
+}
+
+SnapshotIndex::Version *SnapshotIndex::edit() {
+    const Version *version = current.load(std::memory_order_relaxed);
+    return version ? new Version(*version) : new Version();
+}
+
+void SnapshotIndex::fold(Version *version) {
+    if (version->added.empty() && version->tombstones.empty()) {
+        return;
+    }
+    const Snapshot *old = version->base.get();
+    auto fresh = std::make_shared<Snapshot>();
+    size_t oldCount = old ? old->keys.size() : 0;
+    fresh->keys.reserve(oldCount + version->added.size());
+    fresh->sizes.reserve(oldCount + version->added.size());
+
+    size_t i = 0;
+    auto addedIt = version->added.begin();
+    while (i < oldCount || addedIt != version->added.end()) {
+        if (i < oldCount && tombstoned(version, old->keys[i])) {
+            i++;
+        } else if (i < oldCount &&
+                   (addedIt == version->added.end() || old->keys[i] < addedIt->first)) {
+            fresh->keys.push_back(old->keys[i]);
+            fresh->sizes.push_back(old->sizes[i]);
+            i++;
+        } else {
+            fresh->keys.push_back(addedIt->first);
+            fresh->sizes.push_back(addedIt->second);
+            addedIt++;
+        }
+    }
+    version->base = fresh;
+    version->added.clear();
+    version->tombstones.clear();
+}
+
+void SnapshotIndex::publish(Version *next) {
+    if (next->added.size() + next->tombstones.size() > DELTA_MAX) {
+        fold(next);
+    }
+    const Version *old = current.exchange(next);
+    if (old != NULL) {
+        retired.push_back({globalEpoch.fetch_add(1), old});
+    }
+    if (retired.size() >= RETIRE_BATCH) {
+        reclaim();
+    }
+}
+
+void SnapshotIndex::reclaim() {
+    if (slotlessReaders.load() > 0) {
+        return;
+    }
+    uint64_t oldest = QUIESCENT;
+    for (EpochSlot &slot : epochSlots) {
+        oldest = std::min(oldest, slot.epoch.load());
+    }
+    size_t kept = 0;
+    for (auto &entry : retired) {
+        if (entry.first < oldest) {
+            delete entry.second;
+        } else {
+            retired[kept++] = entry;
+        }
+    }
+    retired.resize(kept);
+}
+
+void SnapshotIndex::merge() {
+    Version *next = edit();
+    fold(next);
+    publish(next);
+}
+
+bool SnapshotIndex::InsertRedzone(uint64_t start, uint64_t size) {
+    const Version *version = current.load(std::memory_order_relaxed);
+    if (liveInSnapshot(version, start) >= 0) {
+        return false;
+    }
+    if (version != NULL) {
+        auto it = std::lower_bound(version->added.begin(), version->added.end(), start, zoneBefore);
+        if (it != version->added.end() && it->first == start) {
+            return false;
+        }
+    }
+    Version *next = edit();
+    next->added.insert(std::lower_bound(next->added.begin(), next->added.end(), start, zoneBefore),
+                       {start, size});
+    publish(next);
+    return true;
+}
+
+void SnapshotIndex::RemoveRedzone(uint64_t start) {
+    const Version *version = current.load(std::memory_order_relaxed);
+    if (version == NULL) {
+        return;
+    }
+    auto it = std::lower_bound(version->added.begin(), version->added.end(), start, zoneBefore);
+    if (it != version->added.end() && it->first == start) {
+        // A re-added snapshot entry is already tombstoned, so the delta entry is all there is.
+        Version *next = edit();
+        next->added.erase(next->added.begin() + (it - version->added.begin()));
+        publish(next);
+    } else if (liveInSnapshot(version, start) >= 0) {
+        Version *next = edit();
+        next->tombstones.insert(
+            std::lower_bound(next->tombstones.begin(), next->tombstones.end(), start), start);
+        publish(next);
+    }
+}
+
+uint64_t SnapshotIndex::RedzoneSize(uint64_t start) {
+    ReadGuard guard;
+    const Version *version = current.load();
+    if (version == NULL) {
+        return 0;
+    }
+    auto it = std::lower_bound(version->added.begin(), version->added.end(), start, zoneBefore);
+    if (it != version->added.end() && it->first == start) {
+        return it->second;
+    }
+    long idx = liveInSnapshot(version, start);
+    return idx >= 0 ? version->base->sizes[idx] : 0;
+}
+
+// The closest of the delta's and the snapshot's predecessor, skipping removed snapshot entries.
+bool SnapshotIndex::Predecessor(uint64_t key, std::pair<uint64_t, uint64_t> *zone) {
+    ReadGuard guard;
+    const Version *version = current.load();
+    if (version == NULL) {
+        return false;
+    }
+    bool found = false;
+    auto it = std::upper_bound(version->added.begin(), version->added.end(), key, keyBefore);
+    if (it != version->added.begin()) {
+        *zone = *(it - 1);
+        found = true;
+    }
+    const Snapshot *snap = version->base.get();
+    if (snap != NULL) {
+        size_t idx =
+            std::upper_bound(snap->keys.begin(), snap->keys.end(), key) - snap->keys.begin();
+        while (idx > 0 && tombstoned(version, snap->keys[idx - 1])) {
+            idx--;
+        }
+        if (idx > 0 && (!found || snap->keys[idx - 1] > zone->first)) {
+            *zone = {snap->keys[idx - 1], snap->sizes[idx - 1]};
+            found = true;
+        }
+    }
+    return found;
+}
+
+/**
+ * Same semantics as AVLTree::_CheckPoison, where the neighbours of the probe are the closest live
+ * entries of the snapshot and the delta combined.
+ */
+bool SnapshotIndex::CheckPoison(uint64_t probe, uint8_t readWidth) {
+    ReadGuard guard;
+    const Version *version = current.load();
+    if (version == NULL) {
+        return false;
+    }
+    bool hasLeft = false, hasRight = false;
+    uint64_t leftKey = 0, leftSize = 0, rightKey = 0;
+
+    const Snapshot *snap = version->base.get();
+    if (snap != NULL) {
+        size_t n = snap->keys.size();
+        size_t idx = std::upper_bound(snap->keys.begin(), snap->keys.end(), probe) -
+                     snap->keys.begin();
+        // Skipping tombstones is bounded by the size of the delta.
+        for (size_t i = idx; i > 0; i--) {
+            if (!tombstoned(version, snap->keys[i - 1])) {
+                hasLeft = true;
+                leftKey = snap->keys[i - 1];
+                leftSize = snap->sizes[i - 1];
+                break;
+            }
+        }
+        for (size_t i = idx; i < n; i++) {
+            if (!tombstoned(version, snap->keys[i])) {
+                hasRight = true;
+                rightKey = snap->keys[i];
+                break;
+            }
+        }
+    }
+
+    auto it = std::upper_bound(version->added.begin(), version->added.end(), probe, keyBefore);
+    if (it != version->added.begin() && (!hasLeft || (it - 1)->first > leftKey)) {
+        hasLeft = true;
+        leftKey = (it - 1)->first;
+        leftSize = (it - 1)->second;
+    }
+    if (it != version->added.end() && (!hasRight || it->first < rightKey)) {
+        hasRight = true;
+        rightKey = it->first;
+    }
+
+    if (hasLeft && leftKey + leftSize > probe) {
+        return true;
+    }
+    return hasRight && rightKey < probe + readWidth;
+}
+
+void SnapshotIndex::reset() {
+    if (current.load(std::memory_order_relaxed) != NULL) {
+        publish(new Version());
+    }
+}
+
+void SnapshotIndex::printTree() {
+    ReadGuard guard;
+    const Version *version = current.load();
+    if (version == NULL) {
+        return;
+    }
+    const Snapshot *snap = version->base.get();
+    if (snap != NULL) {
+        for (size_t i = 0; i < snap->keys.size(); i++) {
+            cerr << std::hex << snap->keys[i] << " (" << snap->sizes[i] << ")"
+                 << (tombstoned(version, snap->keys[i]) ? " removed" : "") << std::endl;
+        }
+    }
+    for (auto &zone : version->added) {
+        cerr << std::hex << zone.first << " (" << zone.second << ") added" << std::endl;
+    }
+}
+
+void SnapshotIndex::remove_between(uint64_t start, uint64_t end,
+                                   std::vector<std::pair<uint64_t, uint64_t>> *removed) {
+    assert(start < end);
+    if (current.load(std::memory_order_relaxed) == NULL) {
+        return;
+    }
+    Version *next = edit();
+    auto first = std::lower_bound(next->added.begin(), next->added.end(), start, zoneBefore);
+    auto last = std::upper_bound(next->added.begin(), next->added.end(), end, keyBefore);
+    if (removed) {
+        removed->insert(removed->end(), first, last);
+    }
+    next->added.erase(first, last);
+
+    const Snapshot *snap = next->base.get();
+    if (snap != NULL) {
+        size_t i = std::lower_bound(snap->keys.begin(), snap->keys.end(), start) -
+                   snap->keys.begin();
+        std::vector<uint64_t> dead;
+        for (; i < snap->keys.size() && snap->keys[i] <= end; i++) {
+            if (!tombstoned(next, snap->keys[i])) {
+                dead.push_back(snap->keys[i]);
+                if (removed) {
+                    removed->push_back({snap->keys[i], snap->sizes[i]});
+                }
+            }
+        }
+        if (!dead.empty()) {
+            std::vector<uint64_t> merged;
+            merged.reserve(next->tombstones.size() + dead.size());
+            std::merge(next->tombstones.begin(), next->tombstones.end(), dead.begin(), dead.end(),
+                       std::back_inserter(merged));
+            next->tombstones.swap(merged);
+        }
+    }
+    publish(next);
+}
+
+size_t SnapshotIndex::bytes() {
+    ReadGuard guard;
+    const Version *version = current.load();
+    if (version == NULL) {
+        return 0;
+    }
+    size_t bytes = sizeof(Version) + version->added.capacity() * sizeof(Zone) +
+                   version->tombstones.capacity() * sizeof(uint64_t);
+    if (version->base) {
+        bytes += (version->base->keys.capacity() + version->base->sizes.capacity()) *
+                 sizeof(uint64_t);
+    }
+    return bytes;
+}
+
+size_t SnapshotIndex::size() {
+    ReadGuard guard;
+    const Version *version = current.load();
+    if (version == NULL) {
+        return 0;
+    }
+    return (version->base ? version->base->keys.size() : 0) - version->tombstones.size() +
+           version->added.size();
+}
+
+// Goes straight into a new snapshot; the delta is folded in first so there is only one run to merge.
+void SnapshotIndex::InsertSorted(const std::vector<std::pair<uint64_t, uint64_t>> &zones,
+                                 std::vector<std::pair<uint64_t, uint64_t>> *inserted) {
+    Version *next = edit();
+    fold(next);
+    const Snapshot *old = next->base.get();
+    std::vector<Zone> existing;
+    std::vector<Zone> merged;
+    for (size_t i = 0; old != NULL && i < old->keys.size(); i++) {
+        existing.push_back({old->keys[i], old->sizes[i]});
+    }
+    mergeZones(existing, zones, &merged, inserted);
+
+    auto fresh = std::make_shared<Snapshot>();
+    fresh->keys.reserve(merged.size());
+    fresh->sizes.reserve(merged.size());
+    for (auto &zone : merged) {
+        fresh->keys.push_back(zone.first);
+        fresh->sizes.push_back(zone.second);
+    }
+    next->base = fresh;
+    publish(next);
+}
+
+#pragma endregion
@@ -0,0 +1,295 @@
+#ifndef REDZONE_INDEX_H
+#define REDZONE_INDEX_H
+#include <atomic>
+#include <memory>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+// The data structures that keep track of the registered redzones.
+// Every index answers the same queries: CheckPoison reports whether an access of readWidth bytes at
+// probe overlaps a redzone, and remove_between drops every redzone starting in [start, end].
+
+//#define DEBUG_PRINT_ENABLE
+
+#ifdef DEBUG_PRINT_ENABLE
+#define DBG(x) x
+#else
+#define DBG(x)
+#endif
+
+// Common interface, so the runtime can pick an index at startup (see STRUCTZONE_INDEX).
+class RedzoneIndex {
+  public:
+    virtual ~RedzoneIndex() {}
+    // Returns false if a redzone with this start was already registered.
+    virtual bool InsertRedzone(uint64_t start, uint64_t size) = 0;
+    virtual void RemoveRedzone(uint64_t start) = 0;
+    // Returns the size of the redzone starting at `start`, or 0 if there is none.
+    virtual uint64_t RedzoneSize(uint64_t start) = 0;
+    // Finds the redzone with the highest start that is not above `key`; false if there is none.
+    virtual bool Predecessor(uint64_t key, std::pair<uint64_t, uint64_t> *zone) = 0;
+    virtual bool CheckPoison(uint64_t probe, uint8_t readWidth) = 0;
+    // Checks n independent probes at once; hits[i] is set to the result for probes[i].
+    virtual void CheckPoisonBatch(const uint64_t *probes, const uint8_t *widths, size_t n,
+                                  bool *hits);
+    virtual void reset() = 0;
+    virtual void printTree() = 0;
+    virtual void remove_between(uint64_t start, uint64_t end,
+                                std::vector<std::pair<uint64_t, uint64_t>> *removed = NULL) = 0;
+    // Adds many redzones at once. `zones` must be sorted by start; entries that are already
+    // registered are kept as they are. The newly added redzones are appended to `inserted`.
+    virtual void InsertSorted(const std::vector<std::pair<uint64_t, uint64_t>> &zones,
+                              std::vector<std::pair<uint64_t, uint64_t>> *inserted = NULL) = 0;
+    virtual size_t size() = 0;
+    // Remembers the current redzones, so that restore() can go back to them later (e.g. for every
+    // input of a persistent fuzzing loop). Both return false if the index does not support it.
+    virtual bool snapshot();
+    virtual bool restore();
+    // For the statistics: how many nodes a lookup of `key` visits (0 for flat indices), and how
+    // much memory the index holds.
+    virtual unsigned LookupDepth(uint64_t key);
+    virtual size_t bytes() = 0;
+};
+
+class Node {
+  public:
+    uint64_t key;
+    uint64_t size;
+    Node *left;
+    Node *right;
+    int height;
+};
+
+/**
+ * Hands out tree nodes from one contiguous region of address space, which is reserved up front and
+ * only backed by memory as it fills up. Freed nodes are recycled through a free list, and reset()
+ * rewinds the bump pointer in O(1) instead of freeing the nodes one by one.
+ *
+ * Keeping all nodes in one place is what makes snapshots cheap: snapshot() saves the used part of
+ * the region to a memfd, and restore() maps it back over the region, so only the pages that are
+ * touched afterwards cost a (copy-on-write) fault. The nodes that exist at the time of a snapshot
+ * are never handed out again until the next reset; new nodes are packed above them, so a forked
+ * child or a fuzzing input dirties as few of the snapshot's pages as possible.
+ */
+class NodeArena {
+  private:
+    static const size_t RESERVED_NODES = 1ul << 28;
+    Node *base = NULL;
+    // Nodes [0, top) have been handed out; those below floor belong to the snapshot.
+    size_t top = 0;
+    size_t floor = 0;
+    // Linked through the left pointers. Only holds nodes above floor.
+    Node *freeList = NULL;
+    int snapshotFd = -1;
+    // The size of the snapshot file, which only grows.
+    size_t snapshotFileBytes = 0;
+    size_t snapshotTop = 0;
+    bool hasSnapshot = false;
+
+  public:
+    NodeArena() {}
+    NodeArena(const NodeArena &) = delete;
+    ~NodeArena();
+    Node *alloc();
+    void free(Node *node);
+    void reset();
+    bool snapshot();
+    bool restore();
+    size_t bytes() { return top * sizeof(Node); }
+};
+
+// Thanks to Micheal Sambol on youtube & github for their AVL tree implementation
+// https://github.com/msambol/dsa/blob/master/trees/avl_tree.py (MIT license)
+
+class AVLTree : public RedzoneIndex {
+  private:
+    Node *root = NULL;
+    size_t count = 0;
+    NodeArena arena;
+    Node *snapshotRoot = NULL;
+    size_t snapshotCount = 0;
+
+    int height(Node *N);
+    Node *newNode(uint64_t key, uint64_t size);
+    Node *rightRotate(Node *y);
+    Node *leftRotate(Node *x);
+    int getBalanceFactor(Node *N);
+    Node *insertNode(Node *node, uint64_t key, uint64_t size, bool *inserted);
+    Node *nodeWithMimumValue(Node *node);
+    Node *buildBalanced(const std::vector<std::pair<uint64_t, uint64_t>> &zones, size_t begin,
+                        size_t end);
+    Node *deleteNode(Node *root, uint64_t key);
+    bool _CheckPoison(Node *root, uint64_t probe, uint8_t readWidth, Node *leftPar, Node *rightPar);
+    void _printTree(Node *root, std::string indent, bool last);
+    void _get_between(Node *root, uint64_t start, uint64_t end, std::vector<Node *> *to_Rm);
+
+  public:
+    // Smallest tree for which CheckPoisonBatch interleaves its descents.
+    static const size_t BATCH_MIN_NODES = 8192;
+
+    bool InsertRedzone(uint64_t start, uint64_t size) override;
+    void RemoveRedzone(uint64_t start) override;
+    uint64_t RedzoneSize(uint64_t start) override;
+    bool Predecessor(uint64_t key, std::pair<uint64_t, uint64_t> *zone) override;
+    bool CheckPoison(uint64_t probe, uint8_t readWidth) override;
+    void reset() override;
+    void printTree() override;
+    void remove_between(uint64_t start, uint64_t end,
+                        std::vector<std::pair<uint64_t, uint64_t>> *removed = NULL) override;
+    size_t size() override;
+    void InsertSorted(const std::vector<std::pair<uint64_t, uint64_t>> &zones,
+                      std::vector<std::pair<uint64_t, uint64_t>> *inserted = NULL) override;
+    void collect(std::vector<std::pair<uint64_t, uint64_t>> *zones);
+    void CheckPoisonBatch(const uint64_t *probes, const uint8_t *widths, size_t n,
+                          bool *hits) override;
+    bool snapshot() override;
+    bool restore() override;
+    unsigned LookupDepth(uint64_t key) override;
+    size_t bytes() override;
+};
+
+/**
+ * Packed sorted array of redzones. For a few dozen redzones a vectorized scan over contiguous keys
+ * beats chasing (and allocating) tree nodes.
+ */
+class RedzoneVector : public RedzoneIndex {
+  private:
+    // Kept as two arrays so that the predecessor search only streams over the keys.
+    std::vector<uint64_t> keys;
+    std::vector<uint64_t> sizes;
+    std::vector<uint64_t> snapshotKeys;
+    std::vector<uint64_t> snapshotSizes;
+
+    size_t countNotAbove(uint64_t probe);
+
+  public:
+    bool InsertRedzone(uint64_t start, uint64_t size) override;
+    void RemoveRedzone(uint64_t start) override;
+    uint64_t RedzoneSize(uint64_t start) override;
+    bool Predecessor(uint64_t key, std::pair<uint64_t, uint64_t> *zone) override;
+    bool CheckPoison(uint64_t probe, uint8_t readWidth) override;
+    void reset() override;
+    void printTree() override;
+    void remove_between(uint64_t start, uint64_t end,
+                        std::vector<std::pair<uint64_t, uint64_t>> *removed = NULL) override;
+    size_t size() override;
+    void InsertSorted(const std::vector<std::pair<uint64_t, uint64_t>> &zones,
+                      std::vector<std::pair<uint64_t, uint64_t>> *inserted = NULL) override;
+    void collect(std::vector<std::pair<uint64_t, uint64_t>> *zones);
+    bool snapshot() override;
+    bool restore() override;
+    size_t bytes() override;
+};
+
+/**
+ * Starts out as a RedzoneVector and promotes itself to an AVLTree once it holds more than
+ * SMALL_INDEX_MAX redzones. It moves back to the vector when the tree shrinks to a quarter of that,
+ * so a set hovering around the threshold does not keep converting.
+ * See RuntimeBench.cpp for the measurements behind the threshold.
+ */
+class AdaptiveIndex : public RedzoneIndex {
+  private:
+    RedzoneVector small;
+    AVLTree tree;
+    bool promoted = false;
+    bool snapshotPromoted = false;
+
+    void promote();
+    void maybeDemote();
+
+  public:
+#ifdef __AVX2__
+    static const size_t SMALL_INDEX_MAX = 64;
+#else
+    // Without AVX2 the unsigned 64-bit compares are emulated, which moves the crossover down.
+    static const size_t SMALL_INDEX_MAX = 32;
+#endif
+
+    void CheckPoisonBatch(const uint64_t *probes, const uint8_t *widths, size_t n,
+                          bool *hits) override;
+
+    bool InsertRedzone(uint64_t start, uint64_t size) override;
+    void RemoveRedzone(uint64_t start) override;
+    uint64_t RedzoneSize(uint64_t start) override;
+    bool Predecessor(uint64_t key, std::pair<uint64_t, uint64_t> *zone) override;
+    bool CheckPoison(uint64_t probe, uint8_t readWidth) override;
+    void reset() override;
+    void printTree() override;
+    void remove_between(uint64_t start, uint64_t end,
+                        std::vector<std::pair<uint64_t, uint64_t>> *removed = NULL) override;
+    size_t size() override;
+    void InsertSorted(const std::vector<std::pair<uint64_t, uint64_t>> &zones,
+                      std::vector<std::pair<uint64_t, uint64_t>> *inserted = NULL) override;
+    bool snapshot() override;
+    bool restore() override;
+    unsigned LookupDepth(uint64_t key) override;
+    size_t bytes() override;
+};
+
+/**
+ * LSM-style index: checks are answered from an immutable, densely packed sorted snapshot plus a
+ * small delta of recent changes. Inserts go to the delta and removals of snapshot entries become
+ * tombstones. Once the delta holds more than DELTA_MAX changes it is merged into a fresh snapshot.
+ *
+ * The snapshot and the delta are published together as one immutable version: an update copies
+ * the delta (at most DELTA_MAX entries) into a new version that shares the snapshot, and swaps it
+ * in. Readers (CheckPoison, Predecessor, RedzoneSize) never lock and only see whole versions. The
+ * versions they may still be reading are retired and freed later, once no reader can hold them
+ * (see ReadGuard in RedzoneIndex.cpp). Like the other indices, updates must be serialized by the
+ * caller.
+ */
+class SnapshotIndex : public RedzoneIndex {
+  private:
+    struct Snapshot {
+        std::vector<uint64_t> keys;
+        std::vector<uint64_t> sizes;
+    };
+    typedef std::pair<uint64_t, uint64_t> Zone;
+    struct Version {
+        std::shared_ptr<const Snapshot> base;
+        // Redzones added since the last merge, sorted by start.
+        std::vector<Zone> added;
+        // Snapshot entries removed since the last merge, sorted.
+        std::vector<uint64_t> tombstones;
+    };
+
+    std::atomic<const Version *> current{NULL};
+    // Unpublished versions, with the epoch at which they were unpublished.
+    std::vector<std::pair<uint64_t, const Version *>> retired;
+
+    static bool tombstoned(const Version *version, uint64_t key);
+    // Index of the snapshot entry starting at key, or -1 if it is absent or tombstoned.
+    static long liveInSnapshot(const Version *version, uint64_t key);
+    // A copy of the current version to make an update on.
+    Version *edit();
+    // Folds the delta of the version into a new snapshot.
+    void fold(Version *version);
+    void publish(Version *next);
+    void reclaim();
+
+  public:
+    static const size_t DELTA_MAX = 256;
+    // Retired versions are only freed in batches of this many.
+    static const size_t RETIRE_BATCH = 64;
+
+    ~SnapshotIndex();
+    bool InsertRedzone(uint64_t start, uint64_t size) override;
+    void RemoveRedzone(uint64_t start) override;
+    uint64_t RedzoneSize(uint64_t start) override;
+    bool Predecessor(uint64_t key, std::pair<uint64_t, uint64_t> *zone) override;
+    bool CheckPoison(uint64_t probe, uint8_t readWidth) override;
+    void reset() override;
+    void printTree() override;
+    void remove_between(uint64_t start, uint64_t end,
+                        std::vector<std::pair<uint64_t, uint64_t>> *removed = NULL) override;
+    size_t size() override;
+    void InsertSorted(const std::vector<std::pair<uint64_t, uint64_t>> &zones,
+                      std::vector<std::pair<uint64_t, uint64_t>> *inserted = NULL) override;
+    size_t bytes() override;
+    // Folds the delta into a new snapshot.
+    void merge();
+};
+#endif
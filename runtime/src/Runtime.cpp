@@ -1,362 +1,1454 @@
 #include <stdio.h>
 
+#include "RedzoneIndex.h"
 #include "Runtime.h"
+#include "StatsPage.h"
 #include <string.h>
 #include <assert.h>
+#include <atomic>
 #include <iostream>
+#include <iterator>
+#include <algorithm>
+#include <execinfo.h>
+#include <fcntl.h>
 #include <malloc.h>
 #include <signal.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <string>
+#include <sys/mman.h>
+#include <time.h>
 #include <unistd.h>
 #include <vector>
 
-// AVL tree implementation in C++
-
-#define max(a, b) ((a > b) ? a : b)
 const char COLOR = 0xaa;
 
-//#define DEBUG_PRINT_ENABLE
+using namespace std;
 
-#ifdef DEBUG_PRINT_ENABLE
-#define DBG(x) x
-#else
-#define DBG(x)
-#endif
+/**
+ * Sparse two-level directory of the 64 KiB regions that hold at least one redzone.
+ * Most colored bytes live in memory that never contains a struct (buffers, strings, ...), so
+ * checks whose region bit is clear can skip the index altogether.
+ *
+ * The root table covers the 48-bit user address space in 4 GiB slices. Each slice lazily gets a
+ * leaf with a bitmap (used by the check) and a per-region count of redzones (used to clear the bit
+ * again once the last redzone in a region is removed).
+ */
+class RegionFilter {
+  private:
+    static const int REGION_SHIFT = 16;
+    static const int LEAF_BITS = 16;
+    static const int ROOT_BITS = 16;
+    static const uint64_t LEAF_REGIONS = 1ul << LEAF_BITS;
 
-using namespace std;
+    struct Leaf {
+        uint64_t bits[LEAF_REGIONS / 64];
+        uint32_t counts[LEAF_REGIONS];
+        uint64_t slice;
+        // The leaves in use are chained, so that reset() only visits those.
+        Leaf *next;
+    };
+    Leaf *leaves[1ul << ROOT_BITS];
+    Leaf *allocated;
+    // The count changes since the last snapshot, as (region, added) pairs. Undoing them is much
+    // cheaper than copying whole leaves back.
+    std::vector<std::pair<uint64_t, bool>> *journal;
+
+    void update(uint64_t start, uint64_t size, bool add);
+    bool regionSet(uint64_t region);
+    void count(Leaf *leaf, uint64_t idx, bool add);
 
-class Node {
   public:
-    uint64_t key;
-    uint64_t size;
-    Node *left;
-    Node *right;
-    int height;
+    void add(uint64_t start, uint64_t size);
+    void remove(uint64_t start, uint64_t size);
+    bool mayContain(uint64_t probe, uint8_t width);
+    void reset();
+    void snapshot();
+    void restore();
+    size_t bytes();
 };
 
-// Thanks to Micheal Sambol on youtube & github for their AVL tree implementation
-// https://github.com/msambol/dsa/blob/master/trees/avl_tree.py (MIT license)
+#pragma region RegionFilter
+
+void RegionFilter::update(uint64_t start, uint64_t size, bool add) {
+    uint64_t first = start >> REGION_SHIFT;
+    uint64_t last = (start + (size ? size - 1 : 0)) >> REGION_SHIFT;
+    for (uint64_t region = first; region <= last; region++) {
+        uint64_t slice = region >> LEAF_BITS;
+        if (slice >= (1ul << ROOT_BITS)) {
+            // Outside the 48-bit address space; mayContain stays conservative for these.
+            continue;
+        }
+        Leaf *leaf = leaves[slice];
+        if (leaf == NULL) {
+            if (!add) {
+                continue;
+            }
+            // calloc hands out fresh zeroed pages for an allocation this size, so the counts only
+            // cost memory for the regions that are actually used.
+            leaf = (Leaf *)calloc(1, sizeof(Leaf));
+            leaf->slice = slice;
+            leaf->next = allocated;
+            allocated = leaf;
+            leaves[slice] = leaf;
+        }
+        uint64_t idx = region & (LEAF_REGIONS - 1);
+        if (add || leaf->counts[idx] > 0) {
+            count(leaf, idx, add);
+            if (journal != NULL) {
+                journal->push_back({region, add});
+            }
+        }
+    }
+}
+
+void RegionFilter::count(Leaf *leaf, uint64_t idx, bool add) {
+    if (add) {
+        if (leaf->counts[idx]++ == 0)
+            leaf->bits[idx / 64] |= 1ul << (idx % 64);
+    } else {
+        if (--leaf->counts[idx] == 0)
+            leaf->bits[idx / 64] &= ~(1ul << (idx % 64));
+    }
+}
+
+bool RegionFilter::regionSet(uint64_t region) {
+    uint64_t slice = region >> LEAF_BITS;
+    if (slice >= (1ul << ROOT_BITS)) {
+        return true;
+    }
+    Leaf *leaf = leaves[slice];
+    if (leaf == NULL) {
+        return false;
+    }
+    uint64_t idx = region & (LEAF_REGIONS - 1);
+    return (leaf->bits[idx / 64] >> (idx % 64)) & 1;
+}
+
+void RegionFilter::add(uint64_t start, uint64_t size) { update(start, size, true); }
+
+void RegionFilter::remove(uint64_t start, uint64_t size) { update(start, size, false); }
+
+/**
+ * A probe can only hit a redzone that overlaps [probe, probe + width), so it suffices to look at
+ * the regions of the first and last byte of the access.
+ */
+bool RegionFilter::mayContain(uint64_t probe, uint8_t width) {
+    uint64_t first = probe >> REGION_SHIFT;
+    uint64_t last = (probe + (width ? width - 1 : 0)) >> REGION_SHIFT;
+    return regionSet(first) || (last != first && regionSet(last));
+}
+
+void RegionFilter::reset() {
+    while (allocated != NULL) {
+        Leaf *leaf = allocated;
+        allocated = leaf->next;
+        leaves[leaf->slice] = NULL;
+        free(leaf);
+    }
+    delete journal;
+    journal = NULL;
+}
+
+void RegionFilter::snapshot() {
+    if (journal == NULL) {
+        journal = new std::vector<std::pair<uint64_t, bool>>();
+    }
+    journal->clear();
+}
+
+size_t RegionFilter::bytes() {
+    size_t total = sizeof(leaves);
+    for (Leaf *leaf = allocated; leaf != NULL; leaf = leaf->next) {
+        total += sizeof(Leaf);
+    }
+    return total + (journal != NULL ? journal->capacity() * sizeof(journal->front()) : 0);
+}
+
+// Leaves that were allocated since the snapshot are kept, they just end up empty.
+void RegionFilter::restore() {
+    for (auto it = journal->rbegin(); it != journal->rend(); it++) {
+        uint64_t region = it->first;
+        count(leaves[region >> LEAF_BITS], region & (LEAF_REGIONS - 1), !it->second);
+    }
+    journal->clear();
+}
+
+#pragma endregion
+
+#pragma region TagTable
+
+/**
+ * Remembers which struct a typed redzone belongs to, keyed by the start of the redzone. It is only
+ * read when reporting a violation, so it lives next to the index instead of in it: an open
+ * addressing hash table with linear probing, so registering a redzone costs one or two cache
+ * misses at most. A start of 0 marks an empty slot.
+ */
+class TagTable {
+  public:
+    struct Tag {
+        uint64_t start;
+        const struct rdzone_type *type;
+        // Of the redzone within the struct.
+        uint32_t offset;
+        uint32_t kind;
+    };
 
-class AVLTree {
   private:
-    Node *root;
-
-    int height(Node *N);
-    Node *newNode(uint64_t key, uint64_t size);
-    Node *rightRotate(Node *y);
-    Node *leftRotate(Node *x);
-    int getBalanceFactor(Node *N);
-    Node *insertNode(Node *node, uint64_t key, uint64_t size);
-    Node *nodeWithMimumValue(Node *node);
-    Node *deleteNode(Node *root, uint64_t key);
-    bool _CheckPoison(Node *root, uint64_t probe, uint8_t readWidth, Node *leftPar, Node *rightPar);
-    void _reset(Node *root);
-    void _printTree(Node *root, std::string indent, bool last);
-    void _get_between(Node *root, uint64_t start, uint64_t end, std::vector<Node *> *to_Rm);
+    static const size_t MIN_CAPACITY = 1024;
+    Tag *slots;
+    size_t capacity;
+    size_t used;
+    // The changes since the last snapshot, as (previous tag, whether there was one) pairs, so that
+    // restore only undoes those instead of copying the whole table back.
+    std::vector<std::pair<Tag, bool>> *journal;
+
+    size_t home(uint64_t start) { return (start * 0x9e3779b97f4a7c15ul >> 29) & (capacity - 1); }
+    void grow();
 
   public:
-    void InsertRedzone(uint64_t start, uint64_t size);
-    void RemoveRedzone(uint64_t start);
-    bool CheckPoison(uint64_t probe, uint8_t readWidth);
-    void reset();
-    void printTree();
-    void remove_between(uint64_t start, uint64_t end);
+    void insert(uint64_t start, const struct rdzone_type *type, uint64_t offset, uint32_t kind);
+    void erase(uint64_t start);
+    const Tag *find(uint64_t start);
+    void clear();
+    void snapshot();
+    void restore();
+    size_t bytes() {
+        return capacity * sizeof(Tag) +
+               (journal != NULL ? journal->capacity() * sizeof(journal->front()) : 0);
+    }
 };
 
-#pragma region AVLtree
+void TagTable::grow() {
+    Tag *old = slots;
+    size_t oldCapacity = capacity;
+    capacity = capacity ? capacity * 2 : MIN_CAPACITY;
+    slots = (Tag *)calloc(capacity, sizeof(Tag));
+    for (size_t i = 0; i < oldCapacity; i++) {
+        if (old[i].start != 0) {
+            size_t slot = home(old[i].start);
+            while (slots[slot].start != 0) {
+                slot = (slot + 1) & (capacity - 1);
+            }
+            slots[slot] = old[i];
+        }
+    }
+    free(old);
+}
 
-// New node creation
-Node *AVLTree::newNode(uint64_t key, uint64_t size) {
-    Node *node = new Node();
-    node->key = key;
-    node->size = size;
-    node->left = NULL;
-    node->right = NULL;
-    node->height = 1;
-    return (node);
+void TagTable::insert(uint64_t start, const struct rdzone_type *type, uint64_t offset,
+                      uint32_t kind) {
+    if (2 * (used + 1) > capacity) {
+        grow();
+    }
+    size_t slot = home(start);
+    while (slots[slot].start != 0 && slots[slot].start != start) {
+        slot = (slot + 1) & (capacity - 1);
+    }
+    bool existed = slots[slot].start == start;
+    if (journal != NULL) {
+        journal->push_back({existed ? slots[slot] : Tag{start, NULL, 0, 0}, existed});
+    }
+    if (!existed) {
+        used++;
+    }
+    slots[slot] = {start, type, (uint32_t)offset, kind};
 }
 
-// Calculate height
-int AVLTree::height(Node *N) {
-    if (N == NULL)
-        return 0;
-    return N->height;
-}
-
-// Rotate right
-Node *AVLTree::rightRotate(Node *y) {
-    Node *x = y->left;
-    Node *T2 = x->right;
-    x->right = y;
-    y->left = T2;
-    y->height = max(height(y->left), height(y->right)) + 1;
-    x->height = max(height(x->left), height(x->right)) + 1;
-    return x;
-}
-
-// Rotate left
-Node *AVLTree::leftRotate(Node *x) {
-    Node *y = x->right;
-    Node *T2 = y->left;
-    y->left = x;
-    x->right = T2;
-    x->height = max(height(x->left), height(x->right)) + 1;
-    y->height = max(height(y->left), height(y->right)) + 1;
-    return y;
-}
-
-// Get the balance factor of each node
-int AVLTree::getBalanceFactor(Node *N) {
-    if (N == NULL)
-        return 0;
-    return height(N->left) - height(N->right);
-}
-
-// Insert a node
-Node *AVLTree::insertNode(Node *node, uint64_t key, uint64_t size) {
-    // Find the correct postion and insert the node
-    if (node == NULL)
-        return (newNode(key, size));
-    if (key < node->key)
-        node->left = insertNode(node->left, key, size);
-    else if (key > node->key)
-        node->right = insertNode(node->right, key, size);
-    else
-        return node;
-
-    // Update the balance factor of each node and
-    // balance the tree
-    node->height = 1 + max(height(node->left), height(node->right));
-    int balanceFactor = getBalanceFactor(node);
-    if (balanceFactor > 1) {
-        if (key < node->left->key) {
-            return rightRotate(node);
-        } else if (key > node->left->key) {
-            node->left = leftRotate(node->left);
-            return rightRotate(node);
-        }
-    }
-    if (balanceFactor < -1) {
-        if (key > node->right->key) {
-            return leftRotate(node);
-        } else if (key < node->right->key) {
-            node->right = rightRotate(node->right);
-            return leftRotate(node);
-        }
-    }
-    return node;
-}
-
-// Node with minimum value
-Node *AVLTree::nodeWithMimumValue(Node *node) {
-    Node *current = node;
-    while (current->left != NULL)
-        current = current->left;
-    return current;
-}
-
-// Delete a node
-Node *AVLTree::deleteNode(Node *root, uint64_t key) {
-    // Find the node and delete it
-    if (root == NULL)
-        return root;
-    if (key < root->key)
-        root->left = deleteNode(root->left, key);
-    else if (key > root->key)
-        root->right = deleteNode(root->right, key);
-    else {
-        if ((root->left == NULL) || (root->right == NULL)) {
-            Node *temp = root->left ? root->left : root->right;
-            if (temp == NULL) {
-                temp = root;
-                root = NULL;
-            } else
-                *root = *temp;
-            delete (temp);
-        } else {
-            Node *temp = nodeWithMimumValue(root->right);
-            root->key = temp->key;
-            root->right = deleteNode(root->right, temp->key);
+// Shifts the rest of the probe sequence back instead of leaving a tombstone.
+void TagTable::erase(uint64_t start) {
+    if (used == 0) {
+        return;
+    }
+    size_t mask = capacity - 1;
+    size_t hole = home(start);
+    while (slots[hole].start != start) {
+        if (slots[hole].start == 0) {
+            return;
+        }
+        hole = (hole + 1) & mask;
+    }
+    if (journal != NULL) {
+        journal->push_back({slots[hole], true});
+    }
+    for (size_t next = (hole + 1) & mask; slots[next].start != 0; next = (next + 1) & mask) {
+        size_t want = home(slots[next].start);
+        // Entries that may move into the hole are those whose home is not in (hole, next].
+        bool between = hole <= next ? (hole < want && want <= next) : (hole < want || want <= next);
+        if (!between) {
+            slots[hole] = slots[next];
+            hole = next;
+        }
+    }
+    slots[hole].start = 0;
+    used--;
+}
+
+const TagTable::Tag *TagTable::find(uint64_t start) {
+    if (used == 0) {
+        return NULL;
+    }
+    for (size_t slot = home(start); slots[slot].start != 0; slot = (slot + 1) & (capacity - 1)) {
+        if (slots[slot].start == start) {
+            return &slots[slot];
         }
     }
+    return NULL;
+}
+
+void TagTable::clear() {
+    if (used > 0) {
+        memset(slots, 0, capacity * sizeof(Tag));
+        used = 0;
+    }
+    delete journal;
+    journal = NULL;
+}
 
-    if (root == NULL)
-        return root;
+void TagTable::snapshot() {
+    if (journal == NULL) {
+        journal = new std::vector<std::pair<Tag, bool>>();
+    }
+    journal->clear();
+}
 
-    // Update the balance factor of each node and
-    // balance the tree
-    root->height = 1 + max(height(root->left), height(root->right));
-    int balanceFactor = getBalanceFactor(root);
-    if (balanceFactor > 1) {
-        if (getBalanceFactor(root->left) >= 0) {
-            return rightRotate(root);
+// The table keeps the capacity it grew to since the snapshot.
+void TagTable::restore() {
+    std::vector<std::pair<Tag, bool>> *undo = journal;
+    journal = NULL;
+    for (auto it = undo->rbegin(); it != undo->rend(); it++) {
+        const Tag &tag = it->first;
+        if (it->second) {
+            insert(tag.start, tag.type, tag.offset, tag.kind);
         } else {
-            root->left = leftRotate(root->left);
-            return rightRotate(root);
+            erase(tag.start);
         }
     }
-    if (balanceFactor < -1) {
-        if (getBalanceFactor(root->right) <= 0) {
-            return leftRotate(root);
-        } else {
-            root->right = rightRotate(root->right);
-            return leftRotate(root);
+    undo->clear();
+    journal = undo;
+}
+
+#pragma endregion
+
+RedzoneIndex *redzones;
+RegionFilter regions;
+TagTable tags;
+// The redzones of globals, sorted. They outlive __rdzone_iteration_reset.
+std::vector<std::pair<uint64_t, uint64_t>> *staticZones;
+// The descriptors of all registered globals, sorted by base, to tell reports which one was hit.
+std::vector<const struct rdzone_global *> *globalDescs;
+bool snapshotTaken;
+
+#pragma region Stats
+
+/**
+ * Counters for STRUCTZONE_STATS and STRUCTZONE_STATS_FILE. They are always compiled in; while
+ * disabled, counting costs one well-predicted branch. Each thread counts into its own block and
+ * folds it into the shared totals every STATS_FLUSH_EVERY events, so threads that check a lot do
+ * not fight over the cache lines of the totals. The depth of index lookups is sampled, since
+ * measuring it means a second descent.
+ */
+enum StatCounter {
+    STAT_CHECKS,
+    STAT_COLOR_HITS,
+    STAT_INDEX_LOOKUPS,
+    STAT_VIOLATIONS,
+    STAT_ADDS,
+    STAT_REMOVES,
+    STAT_RANGE_REMOVES,
+    STAT_COUNTERS
+};
+static const char *const STAT_NAMES[STAT_COUNTERS] = {
+    "checks", "color_hits", "index_lookups", "violations", "adds", "removes", "range_removes"};
+// Lookups that visit more nodes land in the last bucket.
+static const unsigned DEPTH_BUCKETS = RDZONE_STATS_DEPTH_BUCKETS;
+static const uint32_t STATS_FLUSH_EVERY = 4096;
+static const uint32_t DEPTH_SAMPLE_EVERY = 64;
+static const uint64_t PUBLISH_INTERVAL_NS = 100 * 1000 * 1000;
+
+enum StatsFormat { STATS_OFF, STATS_TEXT, STATS_JSON };
+bool statsEnabled;
+// How the statistics are printed at exit and on SIGUSR1.
+StatsFormat statsFormat;
+// The mapped STRUCTZONE_STATS_FILE, if any.
+struct rdzone_stats_page *statsPage;
+std::atomic<bool> publishing;
+std::atomic<uint64_t> nextPublishNs;
+// Set by SIGUSR1. The handler cannot safely read the index or format output, so the statistics
+// are printed by the next thread that counts an event.
+static volatile sig_atomic_t statsRequested;
+
+struct LocalStats {
+    uint64_t counts[STAT_COUNTERS];
+    uint64_t depths[DEPTH_BUCKETS];
+    uint32_t pending;
+    uint32_t lookups;
+};
+static thread_local LocalStats localStats;
+std::atomic<uint64_t> statTotals[STAT_COUNTERS];
+std::atomic<uint64_t> depthTotals[DEPTH_BUCKETS];
+uint64_t peakRedzones;
+
+struct StatsValues {
+    uint64_t counts[STAT_COUNTERS];
+    uint64_t depths[DEPTH_BUCKETS];
+    uint64_t live;
+    uint64_t peak;
+    uint64_t held;
+};
+
+static void flush_stats() {
+    LocalStats &local = localStats;
+    for (unsigned i = 0; i < STAT_COUNTERS; i++) {
+        if (local.counts[i] != 0) {
+            statTotals[i].fetch_add(local.counts[i], std::memory_order_relaxed);
+            local.counts[i] = 0;
         }
     }
-    return root;
+    for (unsigned i = 0; i < DEPTH_BUCKETS; i++) {
+        if (local.depths[i] != 0) {
+            depthTotals[i].fetch_add(local.depths[i], std::memory_order_relaxed);
+            local.depths[i] = 0;
+        }
+    }
+    local.pending = 0;
 }
 
-// Print the tree
-void AVLTree::_printTree(Node *root, string indent, bool last) {
-    if (root != nullptr) {
-        cerr << indent;
-        if (last) {
-            cerr << "R----";
-            indent += "   ";
-        } else {
-            cerr << "L----";
-            indent += "|  ";
+// The totals so far. The counters of threads other than the calling one are only included up to
+// their last flush.
+static void collect_stats(StatsValues *values) {
+    flush_stats();
+    for (unsigned i = 0; i < STAT_COUNTERS; i++) {
+        values->counts[i] = statTotals[i].load(std::memory_order_relaxed);
+    }
+    for (unsigned i = 0; i < DEPTH_BUCKETS; i++) {
+        values->depths[i] = depthTotals[i].load(std::memory_order_relaxed);
+    }
+    values->live = redzones->size();
+    values->peak = peakRedzones > values->live ? peakRedzones : values->live;
+    values->held = redzones->bytes() + regions.bytes() + tags.bytes();
+}
+
+static uint64_t monotonic_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+/**
+ * Writes the statistics to the stats page, at most every PUBLISH_INTERVAL_NS unless forced. Only
+ * one thread publishes at a time; the others skip it, since the totals include their counts anyway.
+ */
+static void publish_stats(bool force) {
+    uint64_t now = monotonic_ns();
+    if (!force && now < nextPublishNs.load(std::memory_order_relaxed)) {
+        return;
+    }
+    if (publishing.exchange(true, std::memory_order_acquire)) {
+        return;
+    }
+    nextPublishNs.store(now + PUBLISH_INTERVAL_NS, std::memory_order_relaxed);
+    StatsValues values;
+    collect_stats(&values);
+
+    struct rdzone_stats_page *page = statsPage;
+    uint64_t seq = page->seq;
+    auto store = [](uint64_t *field, uint64_t value) {
+        __atomic_store_n(field, value, __ATOMIC_RELAXED);
+    };
+    store(&page->seq, seq + 1);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    store(&page->timestamp_ns, now);
+    store(&page->checks, values.counts[STAT_CHECKS]);
+    store(&page->color_hits, values.counts[STAT_COLOR_HITS]);
+    store(&page->index_lookups, values.counts[STAT_INDEX_LOOKUPS]);
+    store(&page->violations, values.counts[STAT_VIOLATIONS]);
+    store(&page->adds, values.counts[STAT_ADDS]);
+    store(&page->removes, values.counts[STAT_REMOVES]);
+    store(&page->range_removes, values.counts[STAT_RANGE_REMOVES]);
+    store(&page->live_redzones, values.live);
+    store(&page->peak_redzones, values.peak);
+    store(&page->bytes_held, values.held);
+    for (unsigned i = 0; i < DEPTH_BUCKETS; i++) {
+        store(&page->depth_histogram[i], values.depths[i]);
+    }
+    __atomic_store_n(&page->seq, seq + 2, __ATOMIC_RELEASE);
+    publishing.store(false, std::memory_order_release);
+}
+
+static void print_stats();
+
+static __attribute__((noinline)) void flush_and_publish() {
+    flush_stats();
+    if (statsPage != NULL) {
+        publish_stats(false);
+    }
+    if (statsRequested) {
+        statsRequested = 0;
+        print_stats();
+    }
+}
+
+static inline void count_stat(StatCounter counter, uint64_t n = 1) {
+    if (__builtin_expect(statsEnabled, 0)) {
+        localStats.counts[counter] += n;
+        if (++localStats.pending >= STATS_FLUSH_EVERY || statsRequested) {
+            flush_and_publish();
+        }
+    }
+}
+
+// Counts a probe that made it past the color and region filters to the index.
+static inline void count_lookup(uint64_t probe) {
+    if (__builtin_expect(statsEnabled, 0)) {
+        if (++localStats.lookups % DEPTH_SAMPLE_EVERY == 0) {
+            unsigned depth = redzones->LookupDepth(probe);
+            localStats.depths[depth < DEPTH_BUCKETS ? depth : DEPTH_BUCKETS - 1]++;
         }
-        cerr << std::hex << root->key << std::endl;
-        _printTree(root->left, indent, false);
-        _printTree(root->right, indent, true);
+        count_stat(STAT_INDEX_LOOKUPS);
+    }
+}
+
+static inline void track_peak() {
+    if (__builtin_expect(statsEnabled, 0) && redzones->size() > peakRedzones) {
+        peakRedzones = redzones->size();
+    }
+}
+
+// Formats the statistics into buf.
+static size_t format_stats(char *buf, size_t len) {
+    StatsValues values;
+    collect_stats(&values);
+
+    size_t used = 0;
+    auto append = [&](const char *format, auto... args) {
+        if (used < len) {
+            int n = snprintf(buf + used, len - used, format, args...);
+            used += n > 0 ? n : 0;
+        }
+    };
+    bool json = statsFormat == STATS_JSON;
+    append(json ? "{" : "structzone stats:\n");
+    for (unsigned i = 0; i < STAT_COUNTERS; i++) {
+        append(json ? "\"%s\":%llu," : "  %-16s %llu\n", STAT_NAMES[i],
+               (unsigned long long)values.counts[i]);
+    }
+    append(json ? "\"%s\":%llu,\"%s\":%llu,\"%s\":%llu,"
+                : "  %-16s %llu\n  %-16s %llu\n  %-16s %llu\n",
+           "live_redzones", (unsigned long long)values.live, "peak_redzones",
+           (unsigned long long)values.peak, "bytes_held", (unsigned long long)values.held);
+    append(json ? "\"depth_histogram\":[" : "  lookup depth (1 in %u lookups):\n",
+           DEPTH_SAMPLE_EVERY);
+    for (unsigned i = 0; i < DEPTH_BUCKETS; i++) {
+        if (json) {
+            append(i + 1 < DEPTH_BUCKETS ? "%llu," : "%llu]}\n",
+                   (unsigned long long)values.depths[i]);
+        } else if (values.depths[i] != 0) {
+            append("    %2u%s%llu\n", i, i + 1 < DEPTH_BUCKETS ? ": " : "+:",
+                   (unsigned long long)values.depths[i]);
+        }
+    }
+    return used < len ? used : len;
+}
+
+static void print_stats() {
+    char buf[4096];
+    size_t n = format_stats(buf, sizeof(buf));
+    if (write(STDERR_FILENO, buf, n) < 0) {
+        // Nothing left to report the failure to.
+    }
+}
+
+static void print_stats_on_signal(int) { statsRequested = 1; }
+
+static void publish_stats_at_exit() { publish_stats(true); }
+
+// Creates and maps the stats file; returns false (after saying why) if that fails.
+static bool map_stats_file(const char *path) {
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror(path);
+        return false;
     }
+    size_t size = sizeof(struct rdzone_stats_page);
+    void *page = MAP_FAILED;
+    if (ftruncate(fd, size) == 0) {
+        page = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (page == MAP_FAILED) {
+        perror(path);
+        close(fd);
+        return false;
+    }
+    close(fd);
+    statsPage = (struct rdzone_stats_page *)page;
+    statsPage->version = RDZONE_STATS_VERSION;
+    statsPage->size = sizeof(struct rdzone_stats_page);
+    statsPage->pid = getpid();
+    // Readers check the magic last, so they never see a half initialized header.
+    __atomic_store_n(&statsPage->magic, RDZONE_STATS_MAGIC, __ATOMIC_RELEASE);
+    return true;
 }
 
 /**
- * If you go left, you're the right parent and vice versa
- * When done, one is exactly between the left and right node.
+ * STRUCTZONE_STATS=1 (or text) prints the statistics to stderr at exit, STRUCTZONE_STATS=json
+ * prints them as one JSON object. Either way, SIGUSR1 prints them while the program runs, at the
+ * next checked access or redzone change after the signal.
+ *
+ * STRUCTZONE_STATS_FILE=path publishes them to a file with the layout of StatsPage.h instead, about
+ * every PUBLISH_INTERVAL_NS while redzones are checked and once more at exit, so that tools like
+ * StatsReader can watch a running process without signals or a debugger.
  */
-bool AVLTree::_CheckPoison(Node *root, uint64_t probe, uint8_t readWidth, Node *leftPar,
-                           Node *rightPar) {
-
-    DBG(cerr << std::hex << "probe: " << probe << " on node " << (root ? root->key : 0);)
-
-    if (root == NULL) {
-        // cerr << " is null\n";
-        // return false;
-    } else if (root->key == probe) {
-        DBG(cerr << " exact hit";)
-        leftPar = root;
-    } else if (root->key < probe) {
-        DBG(cerr << " Right\n";)
-        return _CheckPoison(root->right, probe, readWidth, root, rightPar);
-    } else if (root->key > probe) {
-        DBG(cerr << " Left\n";)
-        return _CheckPoison(root->left, probe, readWidth, leftPar, root);
-    }
-
-    uint64_t leftKey = leftPar != NULL ? leftPar->key : 0;
-    uint64_t rightKey = rightPar != NULL ? rightPar->key : 0;
-    DBG(cerr << " left: " << leftKey << " right: " << rightKey;)
-
-    /**
-     * Left parent is the node which is immediately left in the ordering. If null,
-     * there is no node immediately left of us in the ordering, which happens if
-     * we are the left-most node. Right is similar.
-     */
-    if (leftPar != NULL && (leftPar->key + leftPar->size) > probe) {
-        DBG(cerr << " first byte hit\n";)
-        return true;
-    } else if (rightPar != NULL && (rightPar->key) < (probe + readWidth)) {
-        DBG(cerr << " partial overflow detected!\n";)
-        return true;
+static void read_stats_options() {
+    const char *stats = getenv("STRUCTZONE_STATS");
+    if (stats != NULL && strcmp(stats, "0") != 0) {
+        statsFormat = strcmp(stats, "json") == 0 ? STATS_JSON : STATS_TEXT;
+        atexit(print_stats);
+        struct sigaction action = {};
+        action.sa_handler = print_stats_on_signal;
+        action.sa_flags = SA_RESTART;
+        sigaction(SIGUSR1, &action, NULL);
+    }
+    const char *file = getenv("STRUCTZONE_STATS_FILE");
+    if (file != NULL && *file != '\0' && map_stats_file(file)) {
+        atexit(publish_stats_at_exit);
+        publish_stats(true);
     }
-    DBG(cerr << " all clear\n";)
-    return false;
+    statsEnabled = statsFormat != STATS_OFF || statsPage != NULL;
 }
 
-void AVLTree::_reset(Node *root) {
-    if (root == nullptr) {
-        return;
+#pragma endregion
+
+#pragma region Profile
+
+/**
+ * With STRUCTZONE_PROFILE=path, the counts of the check sites of modules built with
+ * -structzone-profile-sites are written to path at exit. The pass reads such profiles back with
+ * -structzone-profile to drop hot checks that never touched a colored byte.
+ */
+extern "C" {
+extern struct rdzone_site __start_structzone_sites[] __attribute__((weak));
+extern struct rdzone_site __stop_structzone_sites[] __attribute__((weak));
+}
+
+const char *profilePath;
+
+static void write_profile_at_exit() {
+    if (!__rdzone_write_profile(profilePath)) {
+        perror(profilePath);
+    }
+}
+
+static void read_profile_options() {
+    profilePath = getenv("STRUCTZONE_PROFILE");
+    if (profilePath != NULL && *profilePath != '\0') {
+        atexit(write_profile_at_exit);
+    }
+}
+
+#pragma endregion
+
+#pragma region Multiversioning
+
+/**
+ * Functions of a -structzone-multiversion build come in a checked and an unchecked version, and
+ * dispatch on this flag whenever they are called. Both versions keep the redzones up to date, so
+ * checks can be switched on and off at any time; code that is already running keeps its version
+ * until it returns.
+ */
+uint8_t __rdzone_checks_enabled = 1;
+
+void __rdzone_set_checks(int enabled) {
+    __atomic_store_n(&__rdzone_checks_enabled, enabled != 0, __ATOMIC_RELAXED);
+}
+
+static void read_check_options() {
+    const char *checks = getenv("STRUCTZONE_CHECKS");
+    if (checks != NULL) {
+        __rdzone_set_checks(strcmp(checks, "0") != 0);
     }
-    _reset(root->right);
-    _reset(root->left);
-    delete root;
 }
 
-void AVLTree::_get_between(Node *root, uint64_t start, uint64_t end, std::vector<Node *> *to_Ret) {
-    DBG(cerr << std::hex << "looking for: " << start << " to " << end << " on node "
-             << (root ? root->key : 0);)
-    assert(start < end);
-    if (root == NULL) {
-        DBG(cerr << "\n");
+#pragma endregion
+
+#pragma region Sampling
+
+/**
+ * STRUCTZONE_SAMPLE_RATE=N makes a -structzone-sample-checks build check about one in N accesses
+ * per thread (default 1, i.e. all of them). The distance to the next sampled access is drawn
+ * uniformly from [1, 2N - 1], so that loops whose accesses repeat with a period dividing N do not
+ * always sample the same access. The redzones themselves are all registered, so a sampled access
+ * finds a violation just like a full check would.
+ */
+__thread int32_t __rdzone_sample_countdown;
+static __thread uint64_t sampleState;
+uint32_t sampleRate = 1;
+
+static void read_sample_options() {
+    const char *rate = getenv("STRUCTZONE_SAMPLE_RATE");
+    if (rate == NULL) {
         return;
-    } else if (root->key >= start && root->key <= end) {
-        DBG(cerr << " M\n");
-        to_Ret->push_back(root);
-        _get_between(root->left, start, end, to_Ret);
-        _get_between(root->right, start, end, to_Ret);
+    }
+    unsigned long value = strtoul(rate, NULL, 10);
+    if (value == 0 || value > INT32_MAX / 2) {
+        cerr << "STRUCTZONE_SAMPLE_RATE: expected a rate between 1 and " << INT32_MAX / 2
+             << ", checking all accesses\n";
+        return;
+    }
+    sampleRate = value;
+}
 
-    } else if (root->key > end) {
-        DBG(cerr << " L\n");
-        _get_between(root->left, start, end, to_Ret);
-    } else if (root->key < start) {
-        DBG(cerr << " R\n");
-        _get_between(root->right, start, end, to_Ret);
+static inline void next_sample() {
+    if (sampleRate == 1) {
+        __rdzone_sample_countdown = 1;
+        return;
+    }
+    if (sampleState == 0) {
+        sampleState = (uint64_t)&sampleState * 0x9e3779b97f4a7c15ul | 1;
     }
+    // xorshift64
+    sampleState ^= sampleState << 13;
+    sampleState ^= sampleState >> 7;
+    sampleState ^= sampleState << 17;
+    __rdzone_sample_countdown = 1 + sampleState % (2 * sampleRate - 1);
 }
 
 #pragma endregion
 
-#pragma region
+#pragma region Reports
+
+/**
+ * With STRUCTZONE_RECOVER=1 a violation is reported and execution continues. Every check site is
+ * only reported the first time it fires for a given struct type and redzone; later hits are just
+ * counted and summarized at exit. A site is the return address of the check call, plus the
+ * position of the access for batched checks, which share a call. At most STRUCTZONE_MAX_REPORTS
+ * (default 100) sites are reported.
+ */
+struct ReportSite {
+    uint64_t pc;
+    uint64_t lane;
+    const struct rdzone_type *type;
+    uint64_t offset;
+    uint64_t hits;
+};
+static const size_t REPORT_SITES = 4096;
+ReportSite reportSites[REPORT_SITES];
+size_t reportSiteCount;
+bool recoverMode;
+uint64_t maxReports;
+uint64_t droppedReports;
+
+// Finds or claims the table slot of a site; NULL once the table is full.
+static ReportSite *find_site(uint64_t pc, uint64_t lane, const struct rdzone_type *type,
+                             uint64_t offset) {
+    size_t mask = REPORT_SITES - 1;
+    size_t slot = ((pc >> 2) ^ ((lane + offset) * 0x9e3779b97f4a7c15ul) ^ ((uint64_t)type >> 4)) &
+                  mask;
+    for (size_t probes = 0; probes < REPORT_SITES; probes++, slot = (slot + 1) & mask) {
+        ReportSite *site = &reportSites[slot];
+        if (site->hits == 0) {
+            if (reportSiteCount == REPORT_SITES / 2) {
+                return NULL;
+            }
+            reportSiteCount++;
+            site->pc = pc;
+            site->lane = lane;
+            site->type = type;
+            site->offset = offset;
+            return site;
+        }
+        if (site->pc == pc && site->lane == lane && site->type == type && site->offset == offset) {
+            return site;
+        }
+    }
+    return NULL;
+}
+
+static void print_report_summary() {
+    uint64_t total = droppedReports;
+    for (size_t i = 0; i < REPORT_SITES; i++) {
+        total += reportSites[i].hits;
+    }
+    if (total == 0) {
+        return;
+    }
+    cerr << "structzone: " << total << " violations at " << reportSiteCount << " sites\n";
+    for (size_t i = 0; i < REPORT_SITES; i++) {
+        if (reportSites[i].hits > 0) {
+            cerr << "  pc " << (void *)reportSites[i].pc;
+            if (reportSites[i].lane > 0) {
+                cerr << " access " << reportSites[i].lane;
+            }
+            if (reportSites[i].type != NULL) {
+                cerr << " struct " << reportSites[i].type->name << " redzone at offset "
+                     << reportSites[i].offset;
+            }
+            cerr << ": " << reportSites[i].hits << "\n";
+        }
+    }
+    if (droppedReports > 0) {
+        cerr << "  (" << droppedReports << " violations at sites that were not tracked)\n";
+    }
+}
+
+static void read_report_options() {
+    const char *recover = getenv("STRUCTZONE_RECOVER");
+    recoverMode = recover != NULL && strcmp(recover, "0") != 0;
+    const char *max = getenv("STRUCTZONE_MAX_REPORTS");
+    maxReports = max != NULL ? strtoull(max, NULL, 10) : 100;
+    if (recoverMode) {
+        atexit(print_report_summary);
+    }
+}
+
+// The struct object a violation hit, as far as the runtime knows.
+struct HitObject {
+    const struct rdzone_type *type;
+    uint64_t base;
+    uint32_t kind;
+};
+
+static HitObject find_object(uint64_t zoneStart, uint64_t probe) {
+    if (const TagTable::Tag *tag = tags.find(zoneStart)) {
+        return {tag->type, zoneStart - tag->offset, tag->kind};
+    }
+    auto next = std::upper_bound(globalDescs->begin(), globalDescs->end(), probe,
+                                 [](uint64_t probe, const struct rdzone_global *global) {
+                                     return probe < (uint64_t)global->base;
+                                 });
+    if (next != globalDescs->begin()) {
+        const struct rdzone_global *global = *(next - 1);
+        uint64_t offset = probe - (uint64_t)global->base;
+        if (offset < global->stride * global->count) {
+            return {global->type, probe - offset % global->stride, RDZONE_GLOBAL};
+        }
+    }
+    return {NULL, 0, RDZONE_UNKNOWN};
+}
+
+static const char *field_name(const struct rdzone_field *field, std::string *buf) {
+    if (field->name && field->name[0]) {
+        return field->name;
+    }
+    *buf = "<at offset " + std::to_string(field->offset) + ">";
+    return buf->c_str();
+}
+
+/**
+ * Prints where `offset` lies within a struct of the given type: in which field, or between which
+ * two fields. Descends into fields that are structs themselves.
+ */
+static void describe_offset(const struct rdzone_type *type, uint64_t offset, int depth) {
+    std::string buf;
+    const struct rdzone_field *before = NULL;
+    for (uint64_t i = 0; i < type->field_count; i++) {
+        const struct rdzone_field *field = &type->fields[i];
+        if (offset < field->offset) {
+            break;
+        }
+        if (offset < field->offset + field->size) {
+            cerr << "field '" << field_name(field, &buf) << "'";
+            uint64_t inner = offset - field->offset;
+            if (field->type && field->type->size > 0 && depth < 8) {
+                if (field->size > field->type->size) {
+                    cerr << "[" << inner / field->type->size << "]";
+                    inner %= field->type->size;
+                }
+                cerr << " (struct " << field->type->name << "), ";
+                describe_offset(field->type, inner, depth + 1);
+            } else {
+                cerr << " at offset " << inner;
+            }
+            return;
+        }
+        before = field;
+    }
+    if (before == NULL) {
+        cerr << "the redzone before the first field";
+    } else {
+        cerr << "the redzone after field '" << field_name(before, &buf) << "'";
+    }
+}
 
-void AVLTree::InsertRedzone(uint64_t start, uint64_t size) { root = insertNode(root, start, size); }
+// Prints the redzone bytes around the probe, a line of 16 bytes at a time, bounded to the object.
+static void dump_neighborhood(uint64_t probe, std::pair<uint64_t, uint64_t> zone, HitObject object) {
+    uint64_t from = zone.first > 16 ? zone.first - 16 : zone.first;
+    uint64_t to = zone.first + zone.second + 16;
+    if (object.type != NULL) {
+        from = std::max(from, object.base);
+        to = std::min(to, object.base + object.type->size);
+    } else {
+        // Only the redzone itself is known to be mapped.
+        from = zone.first;
+        to = zone.first + zone.second;
+    }
+    char line[128];
+    for (uint64_t row = from & ~15ul; row < to; row += 16) {
+        int len = snprintf(line, sizeof(line), "  %#014lx:", row);
+        for (uint64_t addr = row; addr < row + 16; addr++) {
+            if (addr < from || addr >= to) {
+                len += snprintf(line + len, sizeof(line) - len, "   ");
+            } else {
+                len += snprintf(line + len, sizeof(line) - len, "%c%02x", addr == probe ? '>' : ' ',
+                                *(uint8_t *)addr);
+            }
+        }
+        cerr << line << "\n";
+    }
+}
 
-void AVLTree::RemoveRedzone(uint64_t start) { root = deleteNode(root, start); }
+static void print_stack_trace() {
+    void *frames[32];
+    int n = backtrace(frames, 32);
+    cerr << "  stack trace:\n" << std::flush;
+    // Skips print_stack_trace and describe_violation.
+    int skip = n > 2 ? 2 : 0;
+    backtrace_symbols_fd(frames + skip, n - skip, STDERR_FILENO);
+}
 
-bool AVLTree::CheckPoison(uint64_t probe, uint8_t readWidth) {
-    return _CheckPoison(root, probe, readWidth, NULL, NULL);
+static const char *kind_name(uint32_t kind) {
+    switch (kind) {
+    case RDZONE_STACK:
+        return "stack";
+    case RDZONE_HEAP:
+        return "heap";
+    case RDZONE_GLOBAL:
+        return "global";
+    default:
+        return "unknown";
+    }
 }
-void AVLTree::reset() {
-    _reset(root);
-    root = nullptr;
+
+/**
+ * Reports a violation without looking at more than a handful of redzones, so that the time it
+ * takes does not depend on how many are registered.
+ */
+static void describe_violation(void *probe, uint8_t width, std::pair<uint64_t, uint64_t> zone,
+                               HitObject object) {
+    uint64_t addr = (uint64_t)probe;
+    cerr << "  " << (int)width << "-byte access, " << (addr - zone.first)
+         << " bytes into the redzone at " << (void *)zone.first << " (" << zone.second
+         << " bytes)\n";
+    if (object.type != NULL) {
+        cerr << "  " << kind_name(object.kind) << " struct " << object.type->name << " at "
+             << (void *)object.base << " (" << object.type->size << " bytes): ";
+        describe_offset(object.type, addr - object.base, 0);
+        cerr << "\n";
+    } else {
+        cerr << "  unknown struct (" << kind_name(object.kind) << ")\n";
+    }
+    dump_neighborhood(addr, zone, object);
+    print_stack_trace();
 }
-void AVLTree::printTree() { _printTree(root, "", false); }
-void AVLTree::remove_between(uint64_t start, uint64_t end) {
-    assert(start < end);
-    std::vector<Node *> nodesToRm;
-    _get_between(root, start, end, &nodesToRm);
 
-    DBG(cerr << "Removing " << nodesToRm.size() << " nodes\n");
-    for (Node *node : nodesToRm) {
-        DBG(cerr << "rm " << node->key << "\n");
-        RemoveRedzone(node->key);
+static void report_violation(void *probe, uint8_t width, void *pc, uint64_t lane) {
+    count_stat(STAT_VIOLATIONS);
+    std::pair<uint64_t, uint64_t> zone = {(uint64_t)probe, 0};
+    redzones->Predecessor((uint64_t)probe + (width ? width - 1 : 0), &zone);
+    HitObject object = find_object(zone.first, (uint64_t)probe);
+    if (!recoverMode) {
+        cerr << "ILLEGAL ACCESS AT " << probe << "\n";
+        describe_violation(probe, width, zone, object);
+        kill(getpid(), SIGABRT);
+        return;
+    }
+    ReportSite *site = find_site((uint64_t)pc, lane, object.type, zone.first - object.base);
+    if (site == NULL) {
+        droppedReports++;
+        return;
+    }
+    if (site->hits++ > 0 || reportSiteCount > maxReports) {
+        return;
+    }
+    cerr << "ILLEGAL ACCESS AT " << probe << " (pc " << pc << ")\n";
+    describe_violation(probe, width, zone, object);
+    if (reportSiteCount == maxReports) {
+        cerr << "structzone: reported " << maxReports << " sites, not reporting any more\n";
     }
 }
+
 #pragma endregion
 
-AVLTree redzones;
+/**
+ * Picks the index based on the STRUCTZONE_INDEX environment variable:
+ *  adaptive (default): sorted vector for small sets, AVL tree for large ones.
+ *  avl: always the AVL tree.
+ *  snapshot: immutable sorted snapshot plus a delta, for check-heavy workloads.
+ */
+static RedzoneIndex *create_index() {
+    const char *choice = getenv("STRUCTZONE_INDEX");
+    if (choice == NULL || strcmp(choice, "adaptive") == 0) {
+        return new AdaptiveIndex();
+    } else if (strcmp(choice, "avl") == 0) {
+        return new AVLTree();
+    } else if (strcmp(choice, "snapshot") == 0) {
+        return new SnapshotIndex();
+    }
+    cerr << "STRUCTZONE_INDEX: unknown index '" << choice << "', using adaptive\n";
+    return new AdaptiveIndex();
+}
+
+// Runs before the constructors of instrumented code, which may already register redzones.
+__attribute__((constructor(101))) static void init_runtime() {
+    redzones = create_index();
+    read_report_options();
+    read_stats_options();
+    read_profile_options();
+    read_sample_options();
+    read_check_options();
+    staticZones = new std::vector<std::pair<uint64_t, uint64_t>>();
+    globalDescs = new std::vector<const struct rdzone_global *>();
+}
+
+// Bulk loads sorted redzones into the index and the region filter.
+static void insert_sorted(const std::vector<std::pair<uint64_t, uint64_t>> &zones) {
+    std::vector<std::pair<uint64_t, uint64_t>> inserted;
+    redzones->InsertSorted(zones, &inserted);
+    for (auto &zone : inserted) {
+        regions.add(zone.first, zone.second);
+    }
+    count_stat(STAT_ADDS, inserted.size());
+    track_peak();
+}
+
+// The part of a check after the color test, for a probe that hit a colored byte.
+static inline void check_colored(void *probe, uint8_t op_width, void *pc) {
+    count_stat(STAT_COLOR_HITS);
+    if (regions.mayContain((uint64_t)probe, op_width)) {
+        count_lookup((uint64_t)probe);
+        if (redzones->CheckPoison((uint64_t)probe, op_width)) {
+            report_violation(probe, op_width, pc, 0);
+        }
+    }
+}
 
 void __rdzone_check(void *probe, uint8_t op_width) {
     char load = *(char*)probe;
-    if (load == COLOR && redzones.CheckPoison((uint64_t)probe, op_width)) {
-        cerr << "ILLEGAL ACCESS AT " << probe << "\n";
-        redzones.printTree();
-        kill(getpid(), SIGABRT);
+    count_stat(STAT_CHECKS);
+    if (load == COLOR) {
+        check_colored(probe, op_width, __builtin_return_address(0));
+    }
+}
+
+void __rdzone_check_sampled(void *probe, uint8_t op_width) {
+    next_sample();
+    char load = *(char *)probe;
+    count_stat(STAT_CHECKS);
+    if (load == COLOR) {
+        check_colored(probe, op_width, __builtin_return_address(0));
     }
 }
 
+// Like __rdzone_check, but also counts the check and its color hits for the site's profile.
+void __rdzone_check_site(void *probe, uint8_t op_width, struct rdzone_site *site) {
+    char load = *(char *)probe;
+    count_stat(STAT_CHECKS);
+    site->executions++;
+    if (load == COLOR) {
+        site->color_hits++;
+        check_colored(probe, op_width, __builtin_return_address(0));
+    }
+}
+
+/**
+ * Writes the counts of all check sites that ran to path, one site per line:
+ *   id executions color_hits function file:line:column
+ * Returns 0 if the file could not be written.
+ */
+int __rdzone_write_profile(const char *path) {
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        return 0;
+    }
+    fprintf(file, "# structzone profile v1\n");
+    for (struct rdzone_site *site = __start_structzone_sites; site < __stop_structzone_sites;
+         site++) {
+        if (site->executions > 0) {
+            fprintf(file, "%016llx %llu %llu %s %s:%u:%u\n", (unsigned long long)site->id,
+                    (unsigned long long)site->executions, (unsigned long long)site->color_hits,
+                    site->function, site->file, site->line, site->column);
+        }
+    }
+    bool ok = !ferror(file);
+    return fclose(file) == 0 && ok;
+}
+
+/**
+ * Checks n independent accesses at once. Only the probes that pass the color and region filters
+ * reach the index, where their lookups are interleaved.
+ */
+static inline void check_batch(void **probes, uint8_t *widths, uint64_t n, void *pc) {
+    const size_t CHUNK = 32;
+    uint64_t candidates[CHUNK];
+    uint8_t candidateWidths[CHUNK];
+    uint64_t candidateLanes[CHUNK];
+    bool hits[CHUNK];
+    count_stat(STAT_CHECKS, n);
+    for (uint64_t base = 0; base < n; base += CHUNK) {
+        size_t count = 0;
+        for (uint64_t i = base; i < n && i < base + CHUNK; i++) {
+            if (*(char *)probes[i] != COLOR) {
+                continue;
+            }
+            count_stat(STAT_COLOR_HITS);
+            if (regions.mayContain((uint64_t)probes[i], widths[i])) {
+                count_lookup((uint64_t)probes[i]);
+                candidates[count] = (uint64_t)probes[i];
+                candidateWidths[count] = widths[i];
+                candidateLanes[count] = i + 1;
+                count++;
+            }
+        }
+        if (count == 0) {
+            continue;
+        }
+        redzones->CheckPoisonBatch(candidates, candidateWidths, count, hits);
+        for (size_t i = 0; i < count; i++) {
+            if (hits[i]) {
+                report_violation((void *)candidates[i], candidateWidths[i], pc, candidateLanes[i]);
+            }
+        }
+    }
+}
+
+void __rdzone_check_batch(void **probes, uint8_t *widths, uint64_t n) {
+    check_batch(probes, widths, n, __builtin_return_address(0));
+}
+
+void __rdzone_check_batch_sampled(void **probes, uint8_t *widths, uint64_t n) {
+    next_sample();
+    check_batch(probes, widths, n, __builtin_return_address(0));
+}
+
 void __rdzone_add(void *start, uint64_t size) {
-    redzones.InsertRedzone((uint64_t)start, size); 
+    if (redzones->InsertRedzone((uint64_t)start, size)) {
+        regions.add((uint64_t)start, size);
+        count_stat(STAT_ADDS);
+        track_peak();
+    }
+    memset(start, COLOR, size);
+}
+
+/**
+ * Like __rdzone_add, but also remembers for error reports that the redzone lies `offset` bytes into
+ * a struct of the given type, which was allocated on the stack or heap (see rdzone_kind).
+ */
+void __rdzone_add_typed(void *start, uint64_t size, const struct rdzone_type *type,
+                        uint64_t offset, uint32_t kind) {
+    if (redzones->InsertRedzone((uint64_t)start, size)) {
+        regions.add((uint64_t)start, size);
+        tags.insert((uint64_t)start, type, offset, kind);
+        count_stat(STAT_ADDS);
+        track_peak();
+    }
     memset(start, COLOR, size);
 }
-void __rdzone_rm(void *start) { 
-    redzones.RemoveRedzone((uint64_t)start); 
+
+void __rdzone_rm(void *start) {
+    uint64_t size = redzones->RedzoneSize((uint64_t)start);
+    if (size) {
+        redzones->RemoveRedzone((uint64_t)start);
+        regions.remove((uint64_t)start, size);
+        tags.erase((uint64_t)start);
+        count_stat(STAT_REMOVES);
+    }
+}
+
+// Forgets all redzones, including those of globals.
+void __rdzone_reset() {
+    redzones->reset();
+    regions.reset();
+    tags.clear();
+    staticZones->clear();
+    globalDescs->clear();
+    snapshotTaken = false;
 }
 
-void __rdzone_reset() { redzones.reset(); }
+/**
+ * Remembers the current redzones, so that __rdzone_restore can go back to them. Meant to be called
+ * once the target is initialized, before a fork server starts forking or a persistent loop starts.
+ * Returns 0 if the index in use cannot take snapshots.
+ */
+int __rdzone_snapshot() {
+    snapshotTaken = redzones->snapshot();
+    if (snapshotTaken) {
+        regions.snapshot();
+        tags.snapshot();
+    }
+    return snapshotTaken;
+}
+
+// Returns to the redzones of the last snapshot; 0 if there is none.
+int __rdzone_restore() {
+    if (!snapshotTaken) {
+        return 0;
+    }
+    if (!redzones->restore()) {
+        return 0;
+    }
+    regions.restore();
+    tags.restore();
+    return 1;
+}
+
+/**
+ * Resets the runtime between two inputs of a persistent fuzzing loop. The stack and heap redzones
+ * of the previous input are dropped wholesale: the frames that held them are gone, and whatever it
+ * allocated is either freed or unreachable garbage. If a snapshot was taken, the runtime returns to
+ * it; otherwise only the redzones of globals are loaded again.
+ */
+void __rdzone_iteration_reset() {
+    if (__rdzone_restore()) {
+        return;
+    }
+    redzones->reset();
+    regions.reset();
+    tags.clear();
+    insert_sorted(*staticZones);
+}
 
-void __rdzone_dbg_print() { redzones.printTree(); }
+void __rdzone_dbg_print() { redzones->printTree(); }
 
 void __rdzone_heaprm(void *freed_ptr) {
     size_t size = malloc_usable_size(freed_ptr);
-    redzones.remove_between((uint64_t)freed_ptr, (uint64_t)((char *)freed_ptr + size));
+    __rdzone_rm_between(freed_ptr, size);
 }
 
 void __rdzone_rm_between(void *freed_ptr, size_t size) {
-    redzones.remove_between((uint64_t)freed_ptr, (uint64_t)((char *)freed_ptr + size));
+    std::vector<std::pair<uint64_t, uint64_t>> removed;
+    redzones->remove_between((uint64_t)freed_ptr, (uint64_t)((char *)freed_ptr + size), &removed);
+    for (auto &zone : removed) {
+        regions.remove(zone.first, zone.second);
+        tags.erase(zone.first);
+    }
+    count_stat(STAT_RANGE_REMOVES);
+    count_stat(STAT_REMOVES, removed.size());
+}
+
+/**
+ * Registers the redzones of a module's globals in one go. The globals do not overlap, so expanding
+ * them in address order yields sorted redzones, which the index can bulk load. The redzones are
+ * already colored by the initializers of the globals, which may live in read-only memory.
+ */
+void __rdzone_register_globals(const struct rdzone_global *globals, uint64_t n) {
+    std::vector<const struct rdzone_global *> order;
+    size_t total = 0;
+    for (uint64_t i = 0; i < n; i++) {
+        order.push_back(&globals[i]);
+        total += globals[i].count * globals[i].layout_len;
+    }
+    std::sort(order.begin(), order.end(),
+              [](const struct rdzone_global *a, const struct rdzone_global *b) {
+                  return a->base < b->base;
+              });
+
+    std::vector<std::pair<uint64_t, uint64_t>> zones;
+    zones.reserve(total);
+    for (const struct rdzone_global *global : order) {
+        for (uint64_t elem = 0; elem < global->count; elem++) {
+            uint64_t base = (uint64_t)global->base + elem * global->stride;
+            for (uint64_t i = 0; i < global->layout_len; i++) {
+                zones.push_back({base + global->layout[2 * i], global->layout[2 * i + 1]});
+            }
+        }
+    }
+
+    insert_sorted(zones);
+
+    std::vector<const struct rdzone_global *> descs(globalDescs->size() + order.size());
+    std::merge(globalDescs->begin(), globalDescs->end(), order.begin(), order.end(), descs.begin(),
+               [](const struct rdzone_global *a, const struct rdzone_global *b) {
+                   return a->base < b->base;
+               });
+    globalDescs->swap(descs);
+
+    std::vector<std::pair<uint64_t, uint64_t>> merged;
+    merged.reserve(staticZones->size() + zones.size());
+    std::merge(staticZones->begin(), staticZones->end(), zones.begin(), zones.end(),
+               std::back_inserter(merged));
+    staticZones->swap(merged);
+}
+
+uint64_t __rdzone_usable_size(void *ptr) { return ptr ? malloc_usable_size(ptr) : 0; }
+
+/**
+ * Follows a realloc of a block holding structs: the redzones registered in the old block (of
+ * old_size usable bytes) are rebased onto the new one, and the ones that no longer fit into
+ * new_size bytes are dropped. The bytes were copied by realloc, so they are still colored.
+ * Returns the offset up to which the new block is covered by redzones, i.e. where registering the
+ * grown tail has to start (see __rdzone_add_elems).
+ */
+uint64_t __rdzone_move(void *old_ptr, void *new_ptr, uint64_t old_size, uint64_t new_size) {
+    uint64_t oldBase = (uint64_t)old_ptr;
+    uint64_t newBase = (uint64_t)new_ptr;
+    if (new_ptr == NULL) {
+        // Either realloc failed and the old block is untouched, or realloc(ptr, 0) freed it.
+        if (new_size == 0 && old_ptr != NULL && old_size > 0) {
+            __rdzone_rm_between(old_ptr, old_size);
+        }
+        return 0;
+    }
+    if (old_ptr == NULL || old_size == 0) {
+        return 0;
+    }
+
+    uint64_t kept = old_size < new_size ? old_size : new_size;
+    if (newBase != oldBase) {
+        std::vector<std::pair<uint64_t, uint64_t>> removed;
+        std::vector<std::pair<uint64_t, uint64_t>> moved;
+        redzones->remove_between(oldBase, oldBase + old_size - 1, &removed);
+        // remove_between does not promise any order.
+        std::sort(removed.begin(), removed.end());
+        std::vector<TagTable::Tag> movedTags;
+        for (auto &zone : removed) {
+            regions.remove(zone.first, zone.second);
+            const TagTable::Tag *tag = tags.find(zone.first);
+            if (zone.first - oldBase + zone.second <= kept) {
+                moved.push_back({zone.first - oldBase + newBase, zone.second});
+                if (tag != NULL) {
+                    movedTags.push_back(*tag);
+                    movedTags.back().start = zone.first - oldBase + newBase;
+                }
+            }
+            if (tag != NULL) {
+                tags.erase(zone.first);
+            }
+        }
+        insert_sorted(moved);
+        for (auto &tag : movedTags) {
+            tags.insert(tag.start, tag.type, tag.offset, tag.kind);
+        }
+    } else if (new_size < old_size) {
+        __rdzone_rm_between((void *)(newBase + new_size), old_size - new_size);
+    }
+
+    // Drop a redzone that got cut in half by shrinking; what is left of it is not ours anymore.
+    std::pair<uint64_t, uint64_t> last;
+    if (redzones->Predecessor(newBase + kept - 1, &last) && last.first >= newBase &&
+        last.first + last.second > newBase + kept) {
+        __rdzone_rm((void *)last.first);
+    }
+    if (redzones->Predecessor(newBase + kept - 1, &last) && last.first >= newBase) {
+        return last.first + last.second - newBase;
+    }
+    return 0;
+}
+
+/**
+ * Registers and colors the redzones of the elements of an array that are not covered yet: the
+ * elements from the first one starting at or after `from` (as returned by __rdzone_move) up to
+ * `count`. Every element is `stride` bytes and has the redzones given by `layout`, as (offset,
+ * size) pairs sorted by offset. `type` describes the elements for error reports, if known.
+ */
+void __rdzone_add_elems(void *base, const uint64_t *layout, uint64_t layout_len, uint64_t stride,
+                        uint64_t from, uint64_t count, const struct rdzone_type *type) {
+    if (base == NULL) {
+        return;
+    }
+    std::vector<std::pair<uint64_t, uint64_t>> zones;
+    for (uint64_t elem = (from + stride - 1) / stride; elem < count; elem++) {
+        for (uint64_t i = 0; i < layout_len; i++) {
+            uint64_t start = (uint64_t)base + elem * stride + layout[2 * i];
+            zones.push_back({start, layout[2 * i + 1]});
+            memset((void *)start, COLOR, layout[2 * i + 1]);
+            if (type != NULL) {
+                tags.insert(start, type, layout[2 * i], RDZONE_HEAP);
+            }
+        }
+    }
+    insert_sorted(zones);
+}
+
+/**
+ * Reports the redzone that [start, start + size) runs into, if any, with a single index lookup:
+ * since redzones do not overlap, only the last one starting before the end of the range can reach
+ * into it.
+ */
+static void check_range(const void *start, size_t size, void *pc) {
+    if (size == 0 || !__atomic_load_n(&__rdzone_checks_enabled, __ATOMIC_RELAXED)) {
+        return;
+    }
+    count_stat(STAT_CHECKS);
+    uint64_t first = (uint64_t)start;
+    // Clamped to the end of the address space, where a bogus size would wrap around.
+    uint64_t last = first + std::min<uint64_t>(size - 1, UINT64_MAX - first);
+    std::pair<uint64_t, uint64_t> zone;
+    count_lookup(last);
+    if (redzones->Predecessor(last, &zone) && zone.first + zone.second > first) {
+        uint64_t hit = std::max(first, zone.first);
+        uint64_t width = std::min(last + 1, zone.first + zone.second) - hit;
+        report_violation((void *)hit, (uint8_t)std::min<uint64_t>(width, 255), pc, 0);
+    }
+}
+
+// The libc functions the pass redirects here. They check the whole range they are about to touch
+// and then work on the (inflated) memory directly.
+
+void *__rdzone_memcpy(void *dst, const void *src, size_t n) {
+    check_range(dst, n, __builtin_return_address(0));
+    check_range(src, n, __builtin_return_address(0));
+    return memcpy(dst, src, n);
+}
+
+void *__rdzone_memmove(void *dst, const void *src, size_t n) {
+    check_range(dst, n, __builtin_return_address(0));
+    check_range(src, n, __builtin_return_address(0));
+    return memmove(dst, src, n);
+}
+
+void *__rdzone_memset(void *dst, int c, size_t n) {
+    check_range(dst, n, __builtin_return_address(0));
+    return memset(dst, c, n);
+}
+
+char *__rdzone_strcpy(char *dst, const char *src) {
+    size_t n = strlen(src) + 1;
+    check_range(dst, n, __builtin_return_address(0));
+    check_range(src, n, __builtin_return_address(0));
+    return (char *)memcpy(dst, src, n);
+}
+
+char *__rdzone_strncpy(char *dst, const char *src, size_t n) {
+    // Pads dst with zeroes up to n bytes, but stops reading src at its terminator.
+    check_range(dst, n, __builtin_return_address(0));
+    check_range(src, std::min(strnlen(src, n) + 1, n), __builtin_return_address(0));
+    return strncpy(dst, src, n);
+}
+
+int __rdzone_snprintf(char *buf, size_t size, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    if (size > 0) {
+        // Only the bytes that are actually written count, which takes a dry run to know.
+        va_list dry;
+        va_copy(dry, args);
+        int length = vsnprintf(NULL, 0, format, dry);
+        va_end(dry);
+        if (length >= 0) {
+            check_range(buf, std::min((size_t)length + 1, size), __builtin_return_address(0));
+        }
+    }
+    int written = vsnprintf(buf, size, format, args);
+    va_end(args);
+    return written;
+}
+
+// How much read and fread store depends on the input, so these check the bytes that were actually
+// transferred, once the call returns.
+
+ssize_t __rdzone_read(int fd, void *buf, size_t count) {
+    ssize_t transferred = read(fd, buf, count);
+    if (transferred > 0) {
+        check_range(buf, transferred, __builtin_return_address(0));
+    }
+    return transferred;
+}
+
+size_t __rdzone_fread(void *ptr, size_t size, size_t nmemb, FILE *stream) {
+    // All of these elements are in memory, so their size cannot overflow.
+    size_t elements = fread(ptr, size, nmemb, stream);
+    check_range(ptr, elements * size, __builtin_return_address(0));
+    return elements;
 }
 
 // You can write anything here and it will be invisible to the outside as it
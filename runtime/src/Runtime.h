@@ -1,16 +1,103 @@
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <sys/types.h>
 #ifdef __cplusplus
 extern "C" {
 #endif
+struct rdzone_type;
+
+// A field of an instrumented struct. `offset` is relative to the start of the inflated struct. For
+// fields that are structs (or arrays of them), `type` describes the struct; otherwise it is NULL.
+// `name` is empty if the module had no debug info for the field.
+struct rdzone_field {
+    const char *name;
+    uint64_t offset;
+    uint64_t size;
+    const struct rdzone_type *type;
+};
+
+// Describes an inflated struct for error reports. The pass emits these into the structzone_types
+// section.
+struct rdzone_type {
+    const char *name;
+    uint64_t size;
+    uint64_t field_count;
+    const struct rdzone_field *fields;
+};
+
+// Where the memory of a struct came from, for error reports.
+enum rdzone_kind { RDZONE_UNKNOWN = 0, RDZONE_STACK = 1, RDZONE_HEAP = 2, RDZONE_GLOBAL = 3 };
+
+// The redzones of one instrumented global, as described by the pass: `count` elements of `stride`
+// bytes starting at `base`, each with `layout_len` redzones given as (offset, size) pairs in
+// `layout`, sorted by offset. `type` describes the elements, if they are structs.
+struct rdzone_global {
+    void *base;
+    const uint64_t *layout;
+    uint64_t layout_len;
+    uint64_t stride;
+    uint64_t count;
+    const struct rdzone_type *type;
+};
+
+// A check site of the pass's -structzone-profile-sites, counted by __rdzone_check_site. `id`
+// identifies the site across builds of the same source (see the pass). The pass puts the sites into
+// the structzone_sites section, where the runtime finds them to write the profile.
+struct rdzone_site {
+    uint64_t id;
+    const char *function;
+    const char *file;
+    uint32_t line;
+    uint32_t column;
+    uint64_t executions;
+    uint64_t color_hits;
+};
+
+// Checks of a -structzone-sample-checks build left until the next sampled one, per thread. The
+// instrumented code decrements it by the number of accesses it is about to make, and calls the
+// _sampled check functions (which reload it) once it drops to 0 or below.
+extern __thread int32_t __rdzone_sample_countdown;
+
+// Whether the functions of a -structzone-multiversion build run their checked version (the
+// default) or the unchecked one. Set with STRUCTZONE_CHECKS=0|1 or __rdzone_set_checks.
+extern uint8_t __rdzone_checks_enabled;
+
 void test_runtime_link();
 void __rdzone_add(void *start, uint64_t size);
+void __rdzone_add_typed(void *start, uint64_t size, const struct rdzone_type *type,
+                        uint64_t offset, uint32_t kind);
 void __rdzone_check(void *probe, uint8_t op_width);
+void __rdzone_check_batch(void **probes, uint8_t *widths, uint64_t n);
+void __rdzone_check_sampled(void *probe, uint8_t op_width);
+void __rdzone_check_batch_sampled(void **probes, uint8_t *widths, uint64_t n);
+void __rdzone_check_site(void *probe, uint8_t op_width, struct rdzone_site *site);
+int __rdzone_write_profile(const char *path);
+void __rdzone_set_checks(int enabled);
 void __rdzone_rm(void *start);
 void __rdzone_reset();
+void __rdzone_iteration_reset();
+int __rdzone_snapshot();
+int __rdzone_restore();
 void __rdzone_dbg_print();
 void __rdzone_heaprm(void *freed_ptr);
 void __rdzone_rm_between(void *freed_ptr, size_t size);
+void __rdzone_register_globals(const struct rdzone_global *globals, uint64_t n);
+uint64_t __rdzone_usable_size(void *ptr);
+uint64_t __rdzone_move(void *old_ptr, void *new_ptr, uint64_t old_size, uint64_t new_size);
+void __rdzone_add_elems(void *base, const uint64_t *layout, uint64_t layout_len, uint64_t stride,
+                        uint64_t from, uint64_t count, const struct rdzone_type *type);
+
+// Checked versions of libc functions that write to (or read from) memory in bulk, which the pass
+// calls instead. Each checks the range it touches against the redzones once.
+void *__rdzone_memcpy(void *dst, const void *src, size_t n);
+void *__rdzone_memmove(void *dst, const void *src, size_t n);
+void *__rdzone_memset(void *dst, int c, size_t n);
+char *__rdzone_strcpy(char *dst, const char *src);
+char *__rdzone_strncpy(char *dst, const char *src, size_t n);
+int __rdzone_snprintf(char *buf, size_t size, const char *format, ...);
+ssize_t __rdzone_read(int fd, void *buf, size_t count);
+size_t __rdzone_fread(void *ptr, size_t size, size_t nmemb, FILE *stream);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,115 @@
+#include "RedzoneIndex.h"
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Microbenchmarks for the redzone indices, around the point where AdaptiveIndex switches from the
+// sorted vector to the tree. The indices only store addresses, so no real memory is needed.
+
+const uint64_t BASE = 0x7f0000000000;
+const uint64_t STRIDE = 0xa0; // Roughly one inflated struct per redzone.
+const int PROBES = 1 << 20;
+const int ROUNDS = 64;
+
+// Probes are drawn up front so the random number generator is not part of the measurement.
+std::vector<uint64_t> makeProbes(size_t redzones) {
+    std::vector<uint64_t> probes;
+    srand(42);
+    for (int i = 0; i < PROBES; i++) {
+        probes.push_back(BASE + rand() % (redzones * STRIDE + STRIDE));
+    }
+    return probes;
+}
+
+template <typename Index> double timeChecks(Index *index, std::vector<uint64_t> &probes) {
+    size_t hits = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (uint64_t probe : probes) {
+        hits += index->CheckPoison(probe, 4);
+    }
+    auto end = std::chrono::steady_clock::now();
+    // Keep the loop from being optimized away.
+    if (hits == (size_t)-1) {
+        printf("impossible\n");
+    }
+    return std::chrono::duration<double, std::nano>(end - start).count() / probes.size();
+}
+
+// Same probes, handed to CheckPoisonBatch in groups of the size the pass emits.
+template <typename Index> double timeBatchChecks(Index *index, std::vector<uint64_t> &probes) {
+    const size_t BATCH = 16;
+    uint8_t widths[BATCH];
+    bool hits[BATCH];
+    size_t hitCount = 0;
+    for (size_t i = 0; i < BATCH; i++) {
+        widths[i] = 4;
+    }
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i + BATCH <= probes.size(); i += BATCH) {
+        index->CheckPoisonBatch(&probes[i], widths, BATCH, hits);
+        hitCount += hits[0];
+    }
+    auto end = std::chrono::steady_clock::now();
+    if (hitCount == (size_t)-1) {
+        printf("impossible\n");
+    }
+    return std::chrono::duration<double, std::nano>(end - start).count() / probes.size();
+}
+
+// The lifetime of a stack frame: register all redzones, then remove them again.
+template <typename Index> double timeChurn(Index *index, size_t redzones) {
+    auto start = std::chrono::steady_clock::now();
+    for (int round = 0; round < ROUNDS; round++) {
+        for (size_t i = 0; i < redzones; i++) {
+            index->InsertRedzone(BASE + i * STRIDE, 32);
+        }
+        for (size_t i = 0; i < redzones; i++) {
+            index->RemoveRedzone(BASE + i * STRIDE);
+        }
+    }
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(end - start).count() / (ROUNDS * redzones);
+}
+
+template <typename Index> void fill(Index *index, size_t redzones) {
+    for (size_t i = 0; i < redzones; i++) {
+        index->InsertRedzone(BASE + i * STRIDE, 32);
+    }
+}
+
+int main() {
+    size_t sizes[] = {4, 8, 16, 32, 48, 64, 96, 128, 256, 1024};
+    printf("%8s | %12s %12s %12s %12s %12s | %12s %12s %12s %12s\n", "redzones", "check avl",
+           "batch avl", "check vec", "check adapt", "check snap", "churn avl", "churn vec",
+           "churn adapt", "churn snap");
+    for (size_t redzones : sizes) {
+        std::vector<uint64_t> probes = makeProbes(redzones);
+        AVLTree tree;
+        RedzoneVector vec;
+        AdaptiveIndex adaptive;
+        SnapshotIndex snapshot;
+
+        double churnTree = timeChurn(&tree, redzones);
+        double churnVec = timeChurn(&vec, redzones);
+        double churnAdaptive = timeChurn(&adaptive, redzones);
+        double churnSnapshot = timeChurn(&snapshot, redzones);
+
+        fill(&tree, redzones);
+        fill(&vec, redzones);
+        fill(&adaptive, redzones);
+        fill(&snapshot, redzones);
+        // Checks should see the steady state, where everything has been merged.
+        snapshot.merge();
+        double checkTree = timeChecks(&tree, probes);
+        double batchTree = timeBatchChecks(&tree, probes);
+        double checkVec = timeChecks(&vec, probes);
+        double checkAdaptive = timeChecks(&adaptive, probes);
+        double checkSnapshot = timeChecks(&snapshot, probes);
+        tree.reset();
+
+        printf("%8zu | %10.2fns %10.2fns %10.2fns %10.2fns %10.2fns | %10.2fns %10.2fns %10.2fns "
+               "%10.2fns\n",
+               redzones, checkTree, batchTree, checkVec, checkAdaptive, checkSnapshot, churnTree,
+               churnVec, churnAdaptive, churnSnapshot);
+    }
+}
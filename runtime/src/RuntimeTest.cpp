@@ -1,8 +1,18 @@
+#include "RedzoneIndex.h"
 #include "Runtime.h"
+#include "StatsPage.h"
 #include <exception>
+#include <fcntl.h>
 #include <iomanip>
 #include <signal.h>
+#include <sstream>
 #include <stdexcept>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
 
 #define KNRM "\x1B[0m"
 #define KRED "\x1B[31m"
@@ -15,6 +25,13 @@
 
 typedef bool (*tcase)();
 bool aborted;
+
+// The runtime paints the redzones it registers, so the tests need real memory to play with.
+// It is aligned to the 64 KiB regions the runtime tracks, so tests can reason about them.
+const uint64_t TEST_MEM_SIZE = 0x40000;
+char *test_mem;
+uint64_t at(uint64_t offset) { return (uint64_t)test_mem + offset; }
+
 void catch_abrt(int sig) {
     aborted = true;
     signal(SIGABRT, catch_abrt);
@@ -44,27 +61,748 @@ void assert_ok(uint64_t probe, uint8_t width) {
 }
 
 bool test_rm_between() {
-    __rdzone_add((void *)0x400000, 32);
-    __rdzone_add((void *)0x400100, 32);
-    __rdzone_add((void *)0x400200, 32);
-    __rdzone_add((void *)0x400300, 32);
-    __rdzone_add((void *)0x400400, 32);
-    __rdzone_rm_between((void *)0x400180, 0x27f);
+    __rdzone_add((void *)at(0x000), 32);
+    __rdzone_add((void *)at(0x100), 32);
+    __rdzone_add((void *)at(0x200), 32);
+    __rdzone_add((void *)at(0x300), 32);
+    __rdzone_add((void *)at(0x400), 32);
+    __rdzone_rm_between((void *)at(0x180), 0x27f);
+
+    assert_abort(at(0x000), 1);
+
+    assert_ok(at(0x200), 1);
+    assert_ok(at(0x210), 1);
+    assert_ok(at(0x300), 1);
+    assert_ok(at(0x310), 1);
+    assert_abort(at(0x400), 1);
+    assert_abort(at(0x410), 1);
+    return true;
+}
+
+bool test_region_filter() {
+    // A colored byte in a region without redzones must not be reported.
+    memset((void *)at(0x20000), 0xaa, 32);
+    __rdzone_add((void *)at(0x100), 32);
+    assert_ok(at(0x20000), 1);
+    assert_abort(at(0x100), 1);
 
-    assert_abort(0x400000, 1);
+    // A redzone straddling two regions marks both of them.
+    __rdzone_add((void *)at(0x1fff0), 32);
+    assert_abort(at(0x1fff8), 1);
+    assert_abort(at(0x20008), 1);
 
-    assert_ok(0x400200, 1);
-    assert_ok(0x400210, 1);
-    assert_ok(0x400300, 1);
-    assert_ok(0x400310, 1);
-    assert_abort(0x400400, 1);
-    assert_abort(0x400410, 1);
+    // Removing the last redzone of a region clears it again.
+    __rdzone_rm_between((void *)at(0x1ff00), 0x200);
+    assert_ok(at(0x20008), 1);
+    __rdzone_rm((void *)at(0x100));
+    assert_ok(at(0x100), 1);
     return true;
 }
 
-int main() {
+// Crosses the point where the index switches from a sorted vector to a tree, and back.
+bool test_adaptive_index() {
+    const int count = 200;
+    for (int i = 0; i < count; i++) {
+        __rdzone_add((void *)at(0x100 + i * 0x40), 32);
+        assert_abort(at(0x100 + i * 0x40 + 31), 1);
+        assert_ok(at(0x100 + i * 0x40 + 32), 1);
+    }
+    for (int i = 0; i < count; i++) {
+        assert_abort(at(0x100 + i * 0x40), 1);
+        assert_abort(at(0x100 + i * 0x40 + 16), 8);
+    }
+    // Leave a handful behind, so the index has to shrink back.
+    __rdzone_rm_between((void *)at(0x100), (count - 5) * 0x40 - 1);
+    for (int i = 0; i < count; i++) {
+        if (i < count - 5) {
+            assert_ok(at(0x100 + i * 0x40), 1);
+        } else {
+            assert_abort(at(0x100 + i * 0x40), 1);
+        }
+    }
+    return true;
+}
+
+// Differential test of the snapshot index against the AVL tree, across several merges.
+bool test_snapshot_index() {
+    AVLTree reference;
+    SnapshotIndex snapshot;
+    srand(1);
+    for (int round = 0; round < 2000; round++) {
+        uint64_t start = 0x1000 + (rand() % 4096) * 0x10;
+        uint64_t size = 8 + rand() % 24;
+        switch (rand() % 4) {
+        case 0:
+        case 1:
+            if (reference.InsertRedzone(start, size) != snapshot.InsertRedzone(start, size)) {
+                throw std::runtime_error("insert of " + to_hex(start) + " disagrees");
+            }
+            break;
+        case 2:
+            reference.RemoveRedzone(start);
+            snapshot.RemoveRedzone(start);
+            break;
+        case 3:
+            reference.remove_between(start, start + 0x100);
+            snapshot.remove_between(start, start + 0x100);
+            break;
+        }
+        if (reference.size() != snapshot.size()) {
+            throw std::runtime_error("size disagrees after round " + std::to_string(round));
+        }
+        for (int i = 0; i < 16; i++) {
+            uint64_t probe = 0x1000 + rand() % 0x10100;
+            uint8_t width = 1 << (rand() % 4);
+            if (reference.CheckPoison(probe, width) != snapshot.CheckPoison(probe, width)) {
+                throw std::runtime_error("probe " + to_hex(probe) + " disagrees");
+            }
+        }
+    }
+    reference.reset();
+    return true;
+}
+
+// Readers check a snapshot index while it is being updated and merged: they always see the
+// redzone that stays registered, and (under ASan) never a freed version.
+bool test_snapshot_concurrent_reads() {
+    SnapshotIndex index;
+    index.InsertRedzone(0x100, 32);
+    std::atomic<bool> done{false};
+    std::atomic<int> misses{0};
+    std::vector<std::thread> readers;
+    for (int t = 0; t < 4; t++) {
+        readers.emplace_back([&]() {
+            while (!done.load()) {
+                if (!index.CheckPoison(0x110, 4) || index.CheckPoison(0x80, 4)) {
+                    misses++;
+                }
+                std::pair<uint64_t, uint64_t> zone;
+                if (!index.Predecessor(0x110, &zone) || zone.first != 0x100) {
+                    misses++;
+                }
+            }
+        });
+    }
+    srand(2);
+    for (int round = 0; round < 20000; round++) {
+        uint64_t start = 0x1000 + (rand() % 1024) * 0x40;
+        if (rand() % 3 == 0) {
+            index.RemoveRedzone(start);
+        } else {
+            index.InsertRedzone(start, 32);
+        }
+    }
+    done = true;
+    for (auto &reader : readers) {
+        reader.join();
+    }
+    if (misses > 0) {
+        throw std::runtime_error(std::to_string(misses.load()) + " reads saw a wrong version");
+    }
+    return true;
+}
+
+bool test_check_batch() {
+    __rdzone_add((void *)at(0x100), 32);
+    __rdzone_add((void *)at(0x200), 32);
+    void *fine[] = {(void *)at(0x0f0), (void *)at(0x120), (void *)at(0x1f8)};
+    uint8_t fineWidths[] = {8, 4, 8};
+    aborted = false;
+    __rdzone_check_batch(fine, fineWidths, 3);
+    if (aborted) {
+        throw std::runtime_error("batch without violations triggered a redzone");
+    }
+    void *bad[] = {(void *)at(0x0f0), (void *)at(0x21f), (void *)at(0x120)};
+    uint8_t badWidths[] = {8, 1, 4};
+    __rdzone_check_batch(bad, badWidths, 3);
+    if (!aborted) {
+        throw std::runtime_error("batch with a violation flew under the radar");
+    }
+
+    // The interleaved descents must agree with the one-by-one lookup.
+    AVLTree tree;
+    const int zones = AVLTree::BATCH_MIN_NODES;
+    for (int i = 0; i < zones; i++) {
+        tree.InsertRedzone(0x10000 + i * 0x40, 16 + i % 16);
+    }
+    uint64_t probes[100];
+    uint8_t widths[100];
+    bool hits[100];
+    for (int i = 0; i < 100; i++) {
+        probes[i] = 0xff00 + rand() % (zones * 0x40 + 0x200);
+        widths[i] = 1 << (rand() % 4);
+    }
+    tree.CheckPoisonBatch(probes, widths, 100, hits);
+    for (int i = 0; i < 100; i++) {
+        if (hits[i] != tree.CheckPoison(probes[i], widths[i])) {
+            throw std::runtime_error("batched probe " + to_hex(probes[i]) + " disagrees");
+        }
+    }
+    tree.reset();
+    return true;
+}
+
+// Bulk loading must end up with the same redzones as inserting them one by one, on every index.
+bool test_insert_sorted() {
+    RedzoneIndex *indices[] = {new AVLTree(), new RedzoneVector(), new AdaptiveIndex(),
+                               new SnapshotIndex()};
+    for (RedzoneIndex *index : indices) {
+        AVLTree reference;
+        srand(2);
+        for (int round = 0; round < 20; round++) {
+            // A few scattered inserts, then a sorted batch that overlaps some of them.
+            for (int i = 0; i < 10; i++) {
+                uint64_t start = 0x1000 + (rand() % 4096) * 0x10;
+                reference.InsertRedzone(start, 8);
+                index->InsertRedzone(start, 8);
+            }
+            std::vector<std::pair<uint64_t, uint64_t>> zones;
+            std::vector<std::pair<uint64_t, uint64_t>> inserted;
+            uint64_t start = 0x1000 + (rand() % 4096) * 0x10;
+            for (int i = 0; i < rand() % 200; i++) {
+                zones.push_back({start + i * 0x10, 4});
+            }
+            size_t expected = 0;
+            for (auto &zone : zones) {
+                expected += reference.InsertRedzone(zone.first, zone.second);
+            }
+            index->InsertSorted(zones, &inserted);
+            if (inserted.size() != expected || index->size() != reference.size()) {
+                throw std::runtime_error("bulk insert size disagrees in round " +
+                                         std::to_string(round));
+            }
+            for (int i = 0; i < 64; i++) {
+                uint64_t probe = 0x1000 + rand() % 0x10100;
+                if (reference.CheckPoison(probe, 1) != index->CheckPoison(probe, 1)) {
+                    throw std::runtime_error("probe " + to_hex(probe) + " disagrees");
+                }
+                std::pair<uint64_t, uint64_t> expectedZone = {0, 0};
+                std::pair<uint64_t, uint64_t> zone = {0, 0};
+                if (reference.Predecessor(probe, &expectedZone) !=
+                        index->Predecessor(probe, &zone) ||
+                    expectedZone != zone) {
+                    throw std::runtime_error("predecessor of " + to_hex(probe) + " disagrees");
+                }
+            }
+        }
+        reference.reset();
+        delete index;
+    }
+    return true;
+}
+
+// Globals are registered from tables; their redzones are colored by the initializers already.
+bool test_register_globals() {
+    // Two redzones per 0x40 byte element, like a two-field struct.
+    const uint64_t layout[] = {0x00, 0x10, 0x20, 0x10};
+    // Deliberately out of address order.
+    struct rdzone_global globals[] = {{(void *)at(0x3000), layout, 2, 0x40, 4, NULL},
+                                      {(void *)at(0x1000), layout, 2, 0x40, 100, NULL}};
+    for (uint64_t elem = 0; elem < 100; elem++) {
+        memset((void *)at(0x1000 + elem * 0x40), 0xaa, 0x10);
+        memset((void *)at(0x1000 + elem * 0x40 + 0x20), 0xaa, 0x10);
+    }
+    for (uint64_t elem = 0; elem < 4; elem++) {
+        memset((void *)at(0x3000 + elem * 0x40), 0xaa, 0x10);
+        memset((void *)at(0x3000 + elem * 0x40 + 0x20), 0xaa, 0x10);
+    }
+    __rdzone_register_globals(globals, 2);
+    for (uint64_t elem = 0; elem < 100; elem++) {
+        assert_abort(at(0x1000 + elem * 0x40), 1);
+        assert_abort(at(0x1000 + elem * 0x40 + 0x2f), 1);
+    }
+    assert_abort(at(0x30e0), 4);
+    assert_ok(at(0x1010), 8);
+    assert_ok(at(0x30f0), 8);
+    return true;
+}
+
+// realloc of an array of structs: the redzones move along, and only the grown tail is added.
+bool test_realloc() {
+    const uint64_t layout[] = {0x00, 0x10, 0x20, 0x10};
+    const uint64_t stride = 0x40;
+    __rdzone_add_elems((void *)at(0x1000), layout, 2, stride, 0, 4, NULL);
+    assert_abort(at(0x10e0), 1);
+
+    // Move and grow from 4 to 8 elements.
+    memcpy((void *)at(0x4000), (void *)at(0x1000), 4 * stride);
+    uint64_t covered = __rdzone_move((void *)at(0x1000), (void *)at(0x4000), 4 * stride,
+                                     8 * stride);
+    if (covered != 3 * stride + 0x30) {
+        throw std::runtime_error("move covers " + to_hex(covered) + " bytes");
+    }
+    memset((void *)at(0x1000), 0xaa, 4 * stride);
+    assert_ok(at(0x1000), 1);
+    __rdzone_add_elems((void *)at(0x4000), layout, 2, stride, covered, 8, NULL);
+    for (uint64_t elem = 0; elem < 8; elem++) {
+        assert_abort(at(0x4000 + elem * stride), 1);
+        assert_abort(at(0x4000 + elem * stride + 0x2f), 1);
+        assert_ok(at(0x4000 + elem * stride + 0x10), 8);
+    }
+
+    // Shrink in place to 2.5 elements, which cuts the last kept redzone in half.
+    covered = __rdzone_move((void *)at(0x4000), (void *)at(0x4000), 8 * stride,
+                            2 * stride + 0x28);
+    if (covered != 2 * stride + 0x10) {
+        throw std::runtime_error("shrink covers " + to_hex(covered) + " bytes");
+    }
+    assert_ok(at(0x40a0), 1);
+    assert_ok(at(0x40c0), 1);
+    assert_abort(at(0x4080), 1);
+    return true;
+}
+
+// Between fuzzing inputs everything but the globals is forgotten, and the index is reused.
+bool test_iteration_reset() {
+    const uint64_t layout[] = {0x00, 0x10};
+    struct rdzone_global global = {(void *)at(0x1000), layout, 1, 0x20, 8, NULL};
+    for (uint64_t elem = 0; elem < 8; elem++) {
+        memset((void *)at(0x1000 + elem * 0x20), 0xaa, 0x10);
+    }
+    __rdzone_register_globals(&global, 1);
+
+    for (int iteration = 0; iteration < 3; iteration++) {
+        // More redzones than fit into one chunk of the node arena.
+        for (uint64_t i = 0; i < 5000; i++) {
+            __rdzone_add((void *)at(0x8000 + i * 0x20), 0x10);
+        }
+        assert_abort(at(0x8000 + 4999 * 0x20), 1);
+        assert_abort(at(0x10e0), 1);
+
+        __rdzone_iteration_reset();
+        // The bytes stay colored, only the index forgot about them.
+        assert_ok(at(0x8000 + 4999 * 0x20), 1);
+        assert_ok(at(0x8000), 8);
+        for (uint64_t elem = 0; elem < 8; elem++) {
+            assert_abort(at(0x1000 + elem * 0x20 + 0xf), 1);
+        }
+        assert_ok(at(0x1010), 8);
+    }
+    return true;
+}
+
+// Restoring a snapshot undoes both additions and removals.
+bool test_snapshot_restore() {
+    for (uint64_t i = 0; i < 200; i++) {
+        __rdzone_add((void *)at(0x1000 + i * 0x20), 0x10);
+    }
+    if (!__rdzone_snapshot()) {
+        // Not every index supports snapshots; __rdzone_iteration_reset covers the fallback.
+        return true;
+    }
+    for (int iteration = 0; iteration < 3; iteration++) {
+        for (uint64_t i = 0; i < 5000; i++) {
+            __rdzone_add((void *)at(0x8000 + i * 0x20), 0x10);
+        }
+        __rdzone_rm((void *)at(0x1000));
+        __rdzone_rm_between((void *)at(0x1800), 0x400);
+        assert_ok(at(0x1000), 1);
+        assert_ok(at(0x1800), 1);
+
+        __rdzone_iteration_reset();
+        for (uint64_t i = 0; i < 200; i++) {
+            assert_abort(at(0x1000 + i * 0x20 + 0xf), 1);
+            assert_ok(at(0x1010 + i * 0x20), 8);
+        }
+        assert_ok(at(0x8000), 1);
+        assert_ok(at(0x8000 + 4999 * 0x20), 1);
+    }
+
+    // A smaller snapshot after a reset must not cut off the nodes mapped from the bigger one.
+    for (uint64_t i = 0; i < 100000; i++) {
+        __rdzone_add((void *)at(i * 2), 1);
+    }
+    __rdzone_snapshot();
+    __rdzone_restore();
+    __rdzone_reset();
+    for (uint64_t i = 0; i < 100; i++) {
+        __rdzone_add((void *)at(i * 2), 1);
+    }
+    __rdzone_snapshot();
+    for (uint64_t i = 100; i < 50100; i++) {
+        __rdzone_add((void *)at(i * 2), 1);
+    }
+    assert_abort(at(0), 1);
+    assert_abort(at(50099 * 2), 1);
+    assert_ok(at(50099 * 2 + 1), 1);
+    // Take the paint off again, so that later tests do not hit it.
+    memset(test_mem, 0, 100000 * 2);
+    return true;
+}
+
+// Runs `fn` with stderr going to a temporary file, and returns what was written.
+std::string capture_stderr(void (*fn)()) {
+    fflush(stderr);
+    FILE *tmp = tmpfile();
+    int saved = dup(STDERR_FILENO);
+    dup2(fileno(tmp), STDERR_FILENO);
+    fn();
+    fflush(stderr);
+    dup2(saved, STDERR_FILENO);
+    close(saved);
+    std::string out;
+    char buf[4096];
+    rewind(tmp);
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), tmp)) > 0) {
+        out.append(buf, n);
+    }
+    fclose(tmp);
+    return out;
+}
+
+void expect_report(const std::string &report, const std::string &part) {
+    if (report.find(part) == std::string::npos) {
+        throw std::runtime_error("expected '" + part + "' in the report:\n" + report);
+    }
+}
+
+// struct Pair { long a; long b; }, inflated to rz a rz b rz.
+const struct rdzone_field pairFields[] = {{"a", 32, 8, NULL}, {"b", 72, 8, NULL}};
+const struct rdzone_type pairType = {"Pair", 112, 2, pairFields};
+// struct Outer { struct Pair pairs[2]; }, inflated to rz pairs rz.
+const struct rdzone_field outerFields[] = {{"pairs", 32, 224, &pairType}};
+const struct rdzone_type outerType = {"Outer", 288, 1, outerFields};
+
+// Reports name the struct and the fields around the redzone, for any number of redzones.
+bool test_typed_reports() {
+    for (uint64_t i = 0; i < 3; i++) {
+        __rdzone_add_typed((void *)at(0x1000 + 40 * i), 32, &pairType, 40 * i, RDZONE_HEAP);
+    }
+    std::string report = capture_stderr([] { assert_abort(at(0x1000 + 45), 4); });
+    expect_report(report, "ILLEGAL ACCESS AT");
+    expect_report(report, "heap struct Pair");
+    expect_report(report, "after field 'a'");
+
+    // The tags move along with a realloc.
+    memcpy((void *)at(0x2000), (void *)at(0x1000), 112);
+    __rdzone_move((void *)at(0x1000), (void *)at(0x2000), 112, 112);
+    report = capture_stderr([] { assert_abort(at(0x2000), 1); });
+    expect_report(report, "before the first field");
+
+    // Globals are found through their descriptors; this one holds two Outers.
+    const uint64_t layout[] = {0, 32, 32, 32, 72, 32, 112, 32, 144, 32, 184, 32, 224, 32, 256, 32};
+    struct rdzone_global global = {(void *)at(0x3000), layout, 8, 288, 2, &outerType};
+    for (uint64_t i = 0; i < 8; i++) {
+        memset((void *)at(0x3000 + 288 + layout[2 * i]), 0xaa, 32);
+    }
+    __rdzone_register_globals(&global, 1);
+    report = capture_stderr([] { assert_abort(at(0x3000 + 288 + 32 + 112 + 80), 1); });
+    expect_report(report, "global struct Outer");
+    expect_report(report, "field 'pairs'[1] (struct Pair), the redzone after field 'b'");
+
+    // Removing redzones drops their tags, so the slots can be reused.
+    for (uint64_t i = 0; i < 5000; i++) {
+        __rdzone_add_typed((void *)at(0x8000 + i * 0x20), 0x10, &pairType, 0, RDZONE_STACK);
+    }
+    __rdzone_rm_between((void *)at(0x8000), 2500 * 0x20);
+    for (uint64_t i = 2500; i < 5000; i++) {
+        __rdzone_rm((void *)at(0x8000 + i * 0x20));
+    }
+    __rdzone_add((void *)at(0x8000), 0x10);
+    report = capture_stderr([] { assert_abort(at(0x8000), 1); });
+    expect_report(report, "unknown struct");
+
+    // Restoring a snapshot undoes the tag changes made since.
+    __rdzone_add_typed((void *)at(0x9000), 0x10, &pairType, 0, RDZONE_HEAP);
+    if (__rdzone_snapshot()) {
+        __rdzone_rm((void *)at(0x9000));
+        __rdzone_add_typed((void *)at(0x9000), 0x10, &outerType, 0, RDZONE_STACK);
+        for (uint64_t i = 0; i < 200; i++) {
+            __rdzone_add_typed((void *)at(0xa000 + i * 0x20), 0x10, &outerType, 0, RDZONE_STACK);
+        }
+        __rdzone_restore();
+        report = capture_stderr([] { assert_abort(at(0x9000), 1); });
+        expect_report(report, "heap struct Pair");
+        __rdzone_add((void *)at(0xa000), 0x10);
+        report = capture_stderr([] { assert_abort(at(0xa000), 1); });
+        expect_report(report, "unknown struct");
+    }
+    return true;
+}
+
+// Stands in for a site emitted by the pass with -structzone-profile-sites.
+__attribute__((section("structzone_sites"), used)) struct rdzone_site testSite = {
+    0x1234, "test_check_sites", "RuntimeTest.cpp", 1, 2, 0, 0};
+
+bool test_check_sites() {
+    __rdzone_add((void *)at(0x100), 32);
+    memset((void *)at(0x180), 0xaa, 8);
+    aborted = false;
+    __rdzone_check_site((void *)at(0x0f0), 8, &testSite);
+    __rdzone_check_site((void *)at(0x180), 4, &testSite);
+    if (aborted) {
+        throw std::runtime_error("colored bytes outside of a redzone triggered a site check");
+    }
+    __rdzone_check_site((void *)at(0x110), 1, &testSite);
+    if (!aborted) {
+        throw std::runtime_error("site check missed a violation");
+    }
+    if (testSite.executions != 3 || testSite.color_hits != 2) {
+        throw std::runtime_error("site counted " + std::to_string(testSite.executions) + " checks, " +
+                                 std::to_string(testSite.color_hits) + " color hits");
+    }
+
+    char path[] = "/tmp/structzone_profileXXXXXX";
+    int fd = mkstemp(path);
+    close(fd);
+    if (!__rdzone_write_profile(path)) {
+        throw std::runtime_error("could not write the profile");
+    }
+    FILE *file = fopen(path, "r");
+    char line[256];
+    std::string profile;
+    while (fgets(line, sizeof(line), file)) {
+        profile += line;
+    }
+    fclose(file);
+    unlink(path);
+    expect_report(profile, "0000000000001234 3 2 test_check_sites RuntimeTest.cpp:1:2\n");
+    return true;
+}
+
+bool test_sampled_checks() {
+    __rdzone_add((void *)at(0x100), 32);
+    aborted = false;
+    __rdzone_sample_countdown = 0;
+    __rdzone_check_sampled((void *)at(0x0f0), 8);
+    if (aborted) {
+        throw std::runtime_error("sampled check without a violation triggered a redzone");
+    }
+    // Without STRUCTZONE_SAMPLE_RATE every access is sampled.
+    if (__rdzone_sample_countdown != 1) {
+        throw std::runtime_error("sampled check did not rearm the countdown");
+    }
+    __rdzone_check_sampled((void *)at(0x11f), 1);
+    if (!aborted) {
+        throw std::runtime_error("sampled check missed a violation");
+    }
+    aborted = false;
+    void *probes[] = {(void *)at(0x0f0), (void *)at(0x104)};
+    uint8_t widths[] = {8, 4};
+    __rdzone_check_batch_sampled(probes, widths, 2);
+    if (!aborted) {
+        throw std::runtime_error("sampled batch missed a violation");
+    }
+    return true;
+}
+
+bool test_interceptors() {
+    __rdzone_add((void *)at(0x100), 32);
+    char *buf = (char *)at(0x0c0);
+    aborted = false;
+    __rdzone_memset(buf, 0, 0x40);
+    __rdzone_strcpy(buf, "fits");
+    __rdzone_snprintf(buf, 0x100, "%d", 42);
+    if (aborted || strcmp(buf, "42") != 0) {
+        throw std::runtime_error("interceptor within bounds triggered a redzone");
+    }
+    __rdzone_memcpy(buf + 0x30, buf, 0x11);
+    if (!aborted) {
+        throw std::runtime_error("memcpy into a redzone was not caught");
+    }
+    aborted = false;
+    // A range that starts behind the redzone and covers it completely.
+    __rdzone_memset(buf, 0, 0x80);
+    if (!aborted) {
+        throw std::runtime_error("memset over a redzone was not caught");
+    }
+    aborted = false;
+    __rdzone_memmove(buf, (void *)at(0x11f), 1);
+    if (!aborted) {
+        throw std::runtime_error("memmove out of a redzone was not caught");
+    }
+
+    // read and fread only count the bytes they transfer.
+    char input[0x20] = {};
+    int fds[2];
+    if (pipe(fds) != 0) {
+        throw std::runtime_error("could not make a pipe");
+    }
+    aborted = false;
+    write(fds[1], input, 0x10);
+    __rdzone_read(fds[0], buf + 0x30, 0x40);
+    if (aborted) {
+        throw std::runtime_error("short read in front of a redzone triggered it");
+    }
+    write(fds[1], input, 0x11);
+    __rdzone_read(fds[0], buf + 0x30, 0x40);
+    if (!aborted) {
+        throw std::runtime_error("read into a redzone was not caught");
+    }
+    close(fds[0]);
+    close(fds[1]);
+
+    FILE *file = tmpfile();
+    fwrite(input, 1, 0x10, file);
+    rewind(file);
+    aborted = false;
+    __rdzone_fread(buf + 0x30, 4, 0x10, file);
+    if (aborted) {
+        throw std::runtime_error("short fread in front of a redzone triggered it");
+    }
+    fwrite(input, 1, 4, file);
+    rewind(file);
+    __rdzone_fread(buf + 0x30, 4, 0x10, file);
+    fclose(file);
+    if (!aborted) {
+        throw std::runtime_error("fread into a redzone was not caught");
+    }
+    return true;
+}
+
+bool test_set_checks() {
+    __rdzone_add((void *)at(0x100), 32);
+    char *buf = (char *)at(0x0c0);
+    aborted = false;
+    __rdzone_set_checks(0);
+    __rdzone_memset(buf, 0, 0x80);
+    if (aborted) {
+        __rdzone_set_checks(1);
+        throw std::runtime_error("memset over a redzone was caught with the checks off");
+    }
+    __rdzone_set_checks(1);
+    __rdzone_memset(buf, 0, 0x80);
+    if (!aborted) {
+        throw std::runtime_error("memset over a redzone was not caught with the checks back on");
+    }
+    return true;
+}
+
+// The runtime reads its options once, when it starts. Tests of those run a scenario (see main) in a
+// fresh copy of this program with the options in its environment, and get back what it wrote to
+// stderr.
+std::string run_scenario(const char *scenario,
+                         const std::vector<std::pair<const char *, const char *>> &env) {
+    fflush(stdout);
+    fflush(stderr);
+    int fds[2];
+    if (pipe(fds) != 0) {
+        throw std::runtime_error("could not make a pipe");
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        for (auto &[name, value] : env) {
+            setenv(name, value, 1);
+        }
+        dup2(fds[1], STDERR_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        execl("/proc/self/exe", "runtimetest", scenario, (char *)NULL);
+        _exit(127);
+    }
+    close(fds[1]);
+    std::string out;
+    char buf[4096];
+    ssize_t n;
+    while ((n = read(fds[0], buf, sizeof(buf))) > 0) {
+        out.append(buf, n);
+    }
+    close(fds[0]);
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        throw std::runtime_error(std::string(scenario) + " did not exit normally:\n" + out);
+    }
+    return out;
+}
+
+// Adds three redzones and removes one again, then checks 100 bytes outside of them and 64 inside.
+void stats_scenario() {
+    for (uint64_t i = 0; i < 3; i++) {
+        __rdzone_add((void *)at(0x100 + i * 0x100), 32);
+    }
+    __rdzone_rm((void *)at(0x300));
+    for (int i = 0; i < 100; i++) {
+        __rdzone_check((void *)at(0x0f0), 1);
+    }
+    for (int i = 0; i < 64; i++) {
+        __rdzone_check((void *)at(0x100), 1);
+    }
+}
+
+bool test_stats() {
+    std::string stats =
+        run_scenario("stats", {{"STRUCTZONE_STATS", "json"}, {"STRUCTZONE_RECOVER", "1"}});
+    for (const char *count : {"\"checks\":164,", "\"color_hits\":64,", "\"index_lookups\":64,",
+                              "\"violations\":64,", "\"adds\":3,", "\"removes\":1,",
+                              "\"range_removes\":0,", "\"live_redzones\":2,",
+                              "\"peak_redzones\":3,"}) {
+        expect_report(stats, count);
+    }
+    // One in 64 lookups is sampled, so the histogram holds a single lookup.
+    size_t histogram = stats.find("\"depth_histogram\":[");
+    expect_report(stats, "\"depth_histogram\":[");
+    std::istringstream buckets(stats.substr(stats.find('[', histogram) + 1));
+    uint64_t sampled = 0, bucket;
+    char separator = ',';
+    while (separator == ',' && buckets >> bucket >> separator) {
+        sampled += bucket;
+    }
+    if (sampled != 1 || separator != ']') {
+        throw std::runtime_error("depth histogram holds " + std::to_string(sampled) +
+                                 " lookups:\n" + stats);
+    }
+    return true;
+}
+
+// The same scenario, published to a stats file instead. The copy publishes once more at exit, so
+// the page holds the final counts.
+bool test_stats_page() {
+    char path[] = "/tmp/structzone_statsXXXXXX";
+    close(mkstemp(path));
+    run_scenario("stats", {{"STRUCTZONE_STATS_FILE", path}, {"STRUCTZONE_RECOVER", "1"}});
+    int fd = open(path, O_RDONLY);
+    void *mapping = mmap(NULL, sizeof(struct rdzone_stats_page), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    unlink(path);
+    if (mapping == MAP_FAILED) {
+        throw std::runtime_error("could not map the stats file");
+    }
+    const struct rdzone_stats_page *page = (const struct rdzone_stats_page *)mapping;
+    struct rdzone_stats_page copy;
+    bool read = rdzone_read_stats_page(page, &copy);
+    munmap(mapping, sizeof(struct rdzone_stats_page));
+    if (!read) {
+        throw std::runtime_error("could not read the stats page");
+    }
+    if (copy.magic != RDZONE_STATS_MAGIC || copy.version != RDZONE_STATS_VERSION ||
+        copy.size != sizeof(struct rdzone_stats_page)) {
+        throw std::runtime_error("stats page has a bad header");
+    }
+    uint64_t sampled = 0;
+    for (uint64_t bucket : copy.depth_histogram) {
+        sampled += bucket;
+    }
+    if (copy.seq % 2 != 0 || copy.checks != 164 || copy.color_hits != 64 ||
+        copy.index_lookups != 64 || copy.violations != 64 || copy.adds != 3 ||
+        copy.removes != 1 || copy.range_removes != 0 || copy.live_redzones != 2 ||
+        copy.peak_redzones != 3 || sampled != 1) {
+        throw std::runtime_error("stats page holds " + std::to_string(copy.checks) + " checks, " +
+                                 std::to_string(copy.adds) + " adds, " +
+                                 std::to_string(sampled) + " sampled lookups");
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
     signal(SIGABRT, catch_abrt);
-    tcase testcases[] = {&test_rm_between};
+    test_mem = (char *)aligned_alloc(0x10000, TEST_MEM_SIZE);
+    if (argc == 2) {
+        // A scenario of run_scenario.
+        if (strcmp(argv[1], "stats") == 0) {
+            stats_scenario();
+            return 0;
+        }
+        fprintf(stderr, "unknown scenario '%s'\n", argv[1]);
+        return 1;
+    }
+    tcase testcases[] = {&test_rm_between, &test_region_filter, &test_adaptive_index,
+                         &test_snapshot_index, &test_check_batch, &test_insert_sorted,
+                         &test_register_globals, &test_realloc, &test_iteration_reset,
+                         &test_snapshot_restore, &test_typed_reports, &test_check_sites,
+                         &test_sampled_checks, &test_interceptors, &test_set_checks,
+                         &test_stats, &test_stats_page, &test_snapshot_concurrent_reads};
 
     // is this cheating?
     for (int i = 0; i < sizeof(testcases) / sizeof(testcases[0]); i++) {
@@ -0,0 +1,59 @@
+#ifndef STATS_PAGE_H
+#define STATS_PAGE_H
+#include <stddef.h>
+#include <stdint.h>
+
+// Layout of the file the runtime publishes its statistics to (see STRUCTZONE_STATS_FILE), shared
+// with StatsReader.cpp. All fields are native-endian. The writer bumps `seq` to an odd value before
+// it updates the page and to the next even value after, so a reader copies the page, checks that
+// `seq` was even and did not change in between, and retries otherwise.
+
+#define RDZONE_STATS_MAGIC 0x5354415453445a52ull // "RZDSTATS"
+#define RDZONE_STATS_VERSION 1
+#define RDZONE_STATS_DEPTH_BUCKETS 32
+
+struct rdzone_stats_page {
+    uint64_t magic;
+    uint32_t version;
+    // Of this struct, so that fields can be appended without bumping the version.
+    uint32_t size;
+    uint64_t pid;
+    uint64_t seq;
+    // CLOCK_MONOTONIC time of the last update.
+    uint64_t timestamp_ns;
+    uint64_t checks;
+    uint64_t color_hits;
+    uint64_t index_lookups;
+    uint64_t violations;
+    uint64_t adds;
+    uint64_t removes;
+    uint64_t range_removes;
+    uint64_t live_redzones;
+    uint64_t peak_redzones;
+    uint64_t bytes_held;
+    // How many of the sampled index lookups visited i nodes; the last bucket also counts deeper ones.
+    uint64_t depth_histogram[RDZONE_STATS_DEPTH_BUCKETS];
+};
+
+// Copies a consistent version of the page, following the protocol above. Returns 0 if the writer
+// kept it busy for too long.
+static inline int rdzone_read_stats_page(const struct rdzone_stats_page *page,
+                                         struct rdzone_stats_page *copy) {
+    for (int attempt = 0; attempt < 1000; attempt++) {
+        uint64_t before = __atomic_load_n(&page->seq, __ATOMIC_ACQUIRE);
+        if (before & 1) {
+            continue;
+        }
+        const uint64_t *from = (const uint64_t *)page;
+        uint64_t *to = (uint64_t *)copy;
+        for (size_t i = 0; i < sizeof(*page) / sizeof(uint64_t); i++) {
+            to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&page->seq, __ATOMIC_RELAXED) == before) {
+            return 1;
+        }
+    }
+    return 0;
+}
+#endif
@@ -0,0 +1,92 @@
+#include "StatsPage.h"
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/**
+ * Watches a process that runs with STRUCTZONE_STATS_FILE=path:
+ *
+ *   statsreader path [interval seconds, default 1]
+ *
+ * Every interval it prints the live redzones, the memory held by the runtime and the rates of
+ * checks, color hits, index lookups, violations and redzone updates since the previous line. The
+ * rates are computed from the timestamps the runtime publishes with its counters, so they do not
+ * depend on when this tool happens to wake up. It stops once the process is gone.
+ */
+
+static void print_rate(const char *name, uint64_t now, uint64_t then, double seconds) {
+    double rate = seconds > 0 ? (now - then) / seconds : 0;
+    if (rate >= 1e6) {
+        printf("  %s %.2fM/s", name, rate / 1e6);
+    } else if (rate >= 1e3) {
+        printf("  %s %.2fk/s", name, rate / 1e3);
+    } else {
+        printf("  %s %.0f/s", name, rate);
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "usage: %s STATS_FILE [INTERVAL_SECONDS]\n", argv[0]);
+        return 1;
+    }
+    double interval = argc == 3 ? atof(argv[2]) : 1;
+    if (interval <= 0) {
+        fprintf(stderr, "%s: invalid interval '%s'\n", argv[0], argv[2]);
+        return 1;
+    }
+
+    int fd = open(argv[1], O_RDONLY);
+    if (fd < 0) {
+        perror(argv[1]);
+        return 1;
+    }
+    void *mapping = mmap(NULL, sizeof(struct rdzone_stats_page), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        perror(argv[1]);
+        return 1;
+    }
+    const struct rdzone_stats_page *page = (const struct rdzone_stats_page *)mapping;
+    if (__atomic_load_n(&page->magic, __ATOMIC_ACQUIRE) != RDZONE_STATS_MAGIC ||
+        page->version != RDZONE_STATS_VERSION || page->size < sizeof(*page)) {
+        fprintf(stderr, "%s: not a structzone stats file (or an incompatible version)\n", argv[1]);
+        return 1;
+    }
+
+    struct rdzone_stats_page last;
+    if (!rdzone_read_stats_page(page, &last)) {
+        fprintf(stderr, "%s: the stats keep changing under us\n", argv[1]);
+        return 1;
+    }
+    printf("pid %llu\n", (unsigned long long)last.pid);
+    for (;;) {
+        usleep(interval * 1e6);
+        bool alive = kill(last.pid, 0) == 0;
+        struct rdzone_stats_page now;
+        if (!rdzone_read_stats_page(page, &now)) {
+            continue;
+        }
+        double seconds = (now.timestamp_ns - last.timestamp_ns) / 1e9;
+        printf("redzones %llu (peak %llu)  %.1f MiB", (unsigned long long)now.live_redzones,
+               (unsigned long long)now.peak_redzones, now.bytes_held / (1024.0 * 1024.0));
+        print_rate("checks", now.checks, last.checks, seconds);
+        print_rate("color hits", now.color_hits, last.color_hits, seconds);
+        print_rate("lookups", now.index_lookups, last.index_lookups, seconds);
+        print_rate("adds", now.adds, last.adds, seconds);
+        print_rate("removes", now.removes, last.removes, seconds);
+        printf("  violations %llu\n", (unsigned long long)now.violations);
+        fflush(stdout);
+        if (!alive) {
+            printf("process %llu exited\n", (unsigned long long)now.pid);
+            return 0;
+        }
+        if (now.timestamp_ns != last.timestamp_ns) {
+            last = now;
+        }
+    }
+}
@@ -0,0 +1,21 @@
+// Instrumented with -structzone-abi=exported, like the file of the tests that call it: the
+// functions taking a struct are exported in their inflated version as well.
+
+struct Pair {
+    int count;
+    char name[4];
+    long total;
+};
+
+void bump(struct Pair *pair) {
+    pair->count += 1;
+    pair->total += 10;
+}
+
+void fill_name(struct Pair *pair, int length, char c) {
+    for (int i = 0; i < length; i++) {
+        pair->name[i] = c;
+    }
+}
+
+int twice(int x) { return 2 * x; }
@@ -0,0 +1,22 @@
+// Built without the sanitizer, like a library the program links against: it sees the structs with
+// their original layout.
+
+struct Inner {
+    int value;
+    char tag[3];
+};
+
+struct Outer {
+    long id;
+    struct Inner items[3];
+    int count;
+};
+
+void update_outer(struct Outer *outer) {
+    outer->id += 1;
+    for (int i = 0; i < outer->count; i++) {
+        outer->items[i].value *= 10;
+        outer->items[i].tag[2] = 'a' + i;
+    }
+    outer->count = -outer->count;
+}
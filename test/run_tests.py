@@ -21,6 +21,40 @@ FAILING_TESTS = [
     "toy.nested.internal_overflow",
     "toy.funccall.external_overflow",
     "toy.global.internal_overflow",
+    "toy.global.arr.external_overflow",
+    "toy.heap.realloc.external_overflow",
+    "toy.recover.loop_overflow",
+    "toy.memset.internal_overflow",
+    "toy.protection.tail.external_overflow",
+    "toy.protection.buffers.internal_overflow",
+    "toy.layout.planned.internal_overflow",
+    "toy.layout.padding.internal_overflow",
+    "toy.struct_copy.internal_overflow",
+    "toy.abi.exported.internal_overflow",
+    "toy.global.common.internal_overflow",
+    "toy.multiversion.internal_overflow",
+    "toy.sample.internal_overflow",
+    "toy.batch.internal_overflow",
+]
+
+# Failing tests that are run once more with STRUCTZONE_RECOVER=1, where they should run to the end
+# and report their (single) overflowing site exactly once.
+RECOVERED_TESTS = [
+    "toy.recover.loop_overflow",
+]
+
+# Failing tests built with -structzone-multiversion, which are run once more with
+# STRUCTZONE_CHECKS=0, where they should run to the end without a report, and with
+# STRUCTZONE_CHECKS=1, where they should fail like they do by default.
+MULTIVERSION_TESTS = [
+    "toy.multiversion.internal_overflow",
+]
+
+# Succeeding tests built with -structzone-profile-sites. Their profile is fed back to the pass with
+# -structzone-profile, which should drop the checks of the hot loop. A profile with malformed lines
+# should be reported line by line and leave all checks in place.
+PROFILED_TESTS = [
+    "toy.profile.safe",
 ]
 
 SUCCEEDING_TESTS = [
@@ -33,6 +67,7 @@ SUCCEEDING_TESTS = [
     "toy.nested.arr.safe",
     "toy.libc.stat",
     "toy.libc.timezone",
+    "toy.libc.localtime",
     "toy.heap.reuse.safe",
     "toy.heap.calloc.safe",
     "toy.ptr.safe",
@@ -40,8 +75,31 @@ SUCCEEDING_TESTS = [
     "toy.funccall.ret.safe",
     "toy.func_ptr.safe",
     "toy.phi.safe",
+    "toy.global.init.safe",
+    "toy.heap.realloc.safe",
+    "toy.memset.safe",
+    "toy.protection.tail.safe",
+    "toy.protection.buffers.safe",
+    "toy.layout.planned.safe",
+    "toy.layout.padding.safe",
+    "toy.struct_copy.safe",
+    "toy.library.nested_arr.safe",
+    "toy.abi.exported.safe",
+    "toy.tbaa.safe",
+    "toy.libc.fread.safe",
+    "toy.sample.safe",
+    "toy.batch.safe",
+    "toy.profile.safe",
 ]
 
+# Files from ./lib that tests are linked with, as in LIBS_<test> and INSTRUMENTED_LIBS_<test> of the
+# Makefile.
+TEST_LIBS = {
+    "toy.library.nested_arr.safe": ["nested_arr"],
+    "toy.abi.exported.safe": ["abi_exported"],
+    "toy.abi.exported.internal_overflow": ["abi_exported"],
+}
+
 
 def check_test_existence():
     testsource_files = os.listdir("./src")
@@ -68,7 +126,8 @@ def run_test():
 
         if expected_succ:
             # Compile the source file with gcc, so that we can check against its unaltered output.
-            sp.check_call(["gcc", f"./src/{i}.c", "-o", f"./bin/{i}.orig"])
+            libs = [f"./lib/{lib}.c" for lib in TEST_LIBS.get(i, [])]
+            sp.check_call(["gcc", f"./src/{i}.c", *libs, "-o", f"./bin/{i}.orig"])
             orig_res = sp.run(
                 ["stdbuf", "-oL", f"./bin/{i}.orig"], capture_output=True, text=True
             )
@@ -86,9 +145,87 @@ def run_test():
         print(f"{COLORS['KGRN']}[PASSED]{COLORS['KNRM']} {i}")
 
 
+def run_recovered_test():
+    for i in RECOVERED_TESTS:
+        env = dict(os.environ, STRUCTZONE_RECOVER="1")
+        res = sp.run(
+            ["stdbuf", "-oL", f"./bin/{i}"], capture_output=True, text=True, env=env
+        )
+        reports = res.stderr.count("ILLEGAL ACCESS AT")
+        if res.returncode != 0 or reports != 1:
+            print(f"{COLORS['KRED']}[FAILED]{COLORS['KNRM']} {i} (recover)")
+            print(
+                f"\tExpected a normal exit with one report, got exit code {res.returncode} and {reports} reports."
+            )
+            continue
+        print(f"{COLORS['KGRN']}[PASSED]{COLORS['KNRM']} {i} (recover)")
+
+
+def run_multiversion_test():
+    for i in MULTIVERSION_TESTS:
+        for checks in ["0", "1"]:
+            env = dict(os.environ, STRUCTZONE_CHECKS=checks)
+            res = sp.run(
+                ["stdbuf", "-oL", f"./bin/{i}"], capture_output=True, text=True, env=env
+            )
+            reported = "ILLEGAL ACCESS AT" in res.stderr
+            if checks == "0" and (res.returncode != 0 or reported):
+                print(f"{COLORS['KRED']}[FAILED]{COLORS['KNRM']} {i} (checks={checks})")
+                print(
+                    f"\tExpected a normal exit without a report, got exit code {res.returncode}."
+                )
+                continue
+            if checks == "1" and (res.returncode == 0 or not reported):
+                print(f"{COLORS['KRED']}[FAILED]{COLORS['KNRM']} {i} (checks={checks})")
+                print("\tExpected the sanitizer error message, but this did not happen.")
+                continue
+            print(f"{COLORS['KGRN']}[PASSED]{COLORS['KNRM']} {i} (checks={checks})")
+
+
+def count_checks(test, flags):
+    """Instruments the test once more with the given flags, and counts the checks left in it."""
+    plugin = "../llvm-pass/bin/Sanitizer.so"
+    res = sp.run(
+        ["opt", f"-load={plugin}", f"-load-pass-plugin={plugin}", *flags, "-S",
+         "-passes=function(mem2reg),structzone-sanitizer", f"./llvm-in/{test}.ll", "-o", "-"],
+        capture_output=True, text=True, check=True,
+    )
+    return res.stdout.count("call void @__rdzone_check("), res.stderr
+
+
+def run_profile_test():
+    for i in PROFILED_TESTS:
+        profile = f"./llvm-out/{i}.profile"
+        env = dict(os.environ, STRUCTZONE_PROFILE=profile)
+        sp.run(["./bin/" + i], capture_output=True, env=env, check=True)
+        unprofiled, _ = count_checks(i, [])
+        profiled, _ = count_checks(i, [f"-structzone-profile={profile}"])
+        if profiled >= unprofiled:
+            print(f"{COLORS['KRED']}[FAILED]{COLORS['KNRM']} {i} (profile)")
+            print(f"\tExpected the profile to drop checks, but {profiled} of {unprofiled} are left.")
+            continue
+
+        malformed = f"./llvm-out/{i}.malformed.profile"
+        with open(malformed, "w") as f:
+            f.write("# structzone profile v1\n")
+            f.write("not a profile line\n")
+            f.write("0000000000001234 many 0 main a.c:1:1\n")
+            f.write("0000000000001234 20000\n")
+        checks, errors = count_checks(i, [f"-structzone-profile={malformed}"])
+        if checks != unprofiled or errors.count("malformed line in profile") != 3:
+            print(f"{COLORS['KRED']}[FAILED]{COLORS['KNRM']} {i} (malformed profile)")
+            print(f"\tExpected 3 malformed lines and {unprofiled} checks, got {checks} and:")
+            print(errors)
+            continue
+        print(f"{COLORS['KGRN']}[PASSED]{COLORS['KNRM']} {i} (profile)")
+
+
 if __name__ == "__main__":
     abspath = os.path.abspath(__file__)
     dname = os.path.dirname(abspath)
     os.chdir(dname)
     check_test_existence()
     run_test()
+    run_recovered_test()
+    run_multiversion_test()
+    run_profile_test()
@@ -0,0 +1,20 @@
+#include <stdio.h>
+
+struct Pair {
+    int count;
+    char name[4];
+    long total;
+};
+
+// From lib/abi_exported.c, built with -structzone-abi=exported like this file.
+void fill_name(struct Pair *pair, int length, char c);
+
+int main() {
+    struct Pair pair;
+    pair.count = 1;
+    pair.total = 5;
+    // Overflows 'name' in the other file, which sees the same redzones.
+    fill_name(&pair, 8, 'q');
+    printf("count %i total %ld\n", pair.count, pair.total);
+    return 0;
+}
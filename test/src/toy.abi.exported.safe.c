@@ -0,0 +1,35 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+struct Pair {
+    int count;
+    char name[4];
+    long total;
+};
+
+// From lib/abi_exported.c. Both files are built with -structzone-abi=exported, so these calls pass
+// the inflated structs directly.
+void bump(struct Pair *pair);
+void fill_name(struct Pair *pair, int length, char c);
+int twice(int x);
+
+int main() {
+    struct Pair pair;
+    pair.count = 1;
+    pair.total = 5;
+    fill_name(&pair, 4, 'q');
+    bump(&pair);
+    struct Pair *heap = malloc(2 * sizeof(struct Pair));
+    for (int x = 0; x < 2; x++) {
+        heap[x].count = x;
+        heap[x].total = 100 * x;
+        bump(&heap[x]);
+    }
+    printf("count %i total %ld name %.4s twice %i\n", pair.count, pair.total, pair.name,
+           twice(21));
+    for (int x = 0; x < 2; x++) {
+        printf("count %i total %ld\n", heap[x].count, heap[x].total);
+    }
+    free(heap);
+    return 0;
+}
@@ -0,0 +1,25 @@
+#include <stdio.h>
+
+struct Record {
+    int id;
+    char flags[2];
+    long size;
+    short parts[3];
+};
+
+// The stores sit in one basic block without calls in between, so their checks are batched. The
+// one to flags[flag] overflows into the redzone behind flags when flag is 2.
+void fill(struct Record *record, int flag) {
+    record->id = flag;
+    record->flags[0] = 1;
+    record->flags[flag] = 2;
+    record->size = 42;
+    record->parts[2] = 7;
+}
+
+int main(int argc, char **argv) {
+    struct Record record;
+    fill(&record, argc + 1);
+    printf("%d %ld %d\n", record.id, record.size, record.parts[2]);
+    return 0;
+}
@@ -0,0 +1,26 @@
+#include <stdio.h>
+
+struct Record {
+    int id;
+    char flags[2];
+    long size;
+    short parts[3];
+};
+
+// The stores sit in one basic block without calls in between, so their checks are batched.
+void fill(struct Record *record, int id) {
+    record->id = id;
+    record->flags[0] = 1;
+    record->flags[1] = 2;
+    record->size = 42;
+    record->parts[0] = 5;
+    record->parts[2] = 7;
+}
+
+int main() {
+    struct Record record;
+    fill(&record, 3);
+    printf("%d %d %d %ld %d %d\n", record.id, record.flags[0], record.flags[1], record.size,
+           record.parts[0], record.parts[2]);
+    return 0;
+}
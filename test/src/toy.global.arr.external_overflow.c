@@ -0,0 +1,29 @@
+#include <stdio.h>
+
+struct Simple {
+    int zero;
+    char one[2];
+    char two[3];
+    char three;
+};
+
+struct Simple examples[2] = {{7, {1, 2}, {3, 4, 5}, 6}, {0, {0, 0}, {0, 0, 0}, 0}};
+
+int main() {
+    // overflow from the second struct back into the first, which is a global this time.
+    for (int i = -12; i < 5; i++) {
+        examples[1].one[i] = 0;
+    }
+    // Print to see what the contents are;
+    for (int x = 0; x < 2; x++) {
+        printf("zero %i\n", examples[x].zero);
+        for (int i = 0; i < 2; i++) {
+            printf("one %i %i\n", i, examples[x].one[i]);
+        }
+        for (int i = 0; i < 3; i++) {
+            printf("two %i %i\n", i, examples[x].two[i]);
+        }
+        printf("three %i\n", examples[x].three);
+    }
+    return 0;
+}
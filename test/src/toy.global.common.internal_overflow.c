@@ -0,0 +1,22 @@
+#include <stdio.h>
+
+struct Simple {
+    int zero;
+    char one[2];
+    int two;
+};
+
+// A tentative definition: with -fcommon, a common global.
+struct Simple examples[2];
+
+int main(int argc, char **argv) {
+    examples[0].zero = 7;
+    examples[1].two = 9;
+    printf("%d %d\n", examples[0].zero, examples[1].two);
+    // overflow out of the buffer into the redzone behind it, which the initializer colored.
+    for (int i = 0; i < 2 + argc; i++) {
+        examples[0].one[i] = 1;
+    }
+    printf("one %i\n", examples[0].one[0]);
+    return 0;
+}
@@ -0,0 +1,30 @@
+#include <stdio.h>
+
+struct Simple {
+    int zero;
+    char one[2];
+    char two[3];
+    char three;
+};
+
+// Initialized globals must keep their values once the struct is inflated, also when they are
+// constant (and thus live in read-only memory).
+struct Simple example = {7, {1, 2}, {3, 4, 5}, 6};
+const struct Simple constant = {8, {9, 10}, {11, 12, 13}, 14};
+struct Simple examples[3] = {{1, {2, 3}, {4, 5, 6}, 7}, {0}, {8, {9, 10}, {11, 12, 13}, 14}};
+
+int main() {
+    printf("zero %i three %i\n", example.zero, example.three);
+    printf("zero %i three %i\n", constant.zero, constant.three);
+    for (int x = 0; x < 3; x++) {
+        printf("zero %i\n", examples[x].zero);
+        for (int i = 0; i < 2; i++) {
+            printf("one %i %i\n", i, examples[x].one[i]);
+        }
+        for (int i = 0; i < 3; i++) {
+            printf("two %i %i\n", i, examples[x].two[i]);
+        }
+        printf("three %i\n", examples[x].three);
+    }
+    return 0;
+}
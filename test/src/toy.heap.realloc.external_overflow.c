@@ -0,0 +1,23 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+struct Simple {
+    int zero;
+    char one[2];
+    char two[3];
+    char three;
+};
+
+int main() {
+    struct Simple *examples = malloc(2 * sizeof(struct Simple));
+    examples[0].zero = 7;
+    examples[1].zero = 8;
+    examples = realloc(examples, 4 * sizeof(struct Simple));
+    // The redzones of the elements that were copied by realloc must still be there.
+    for (int i = 0; i < 12; i++) {
+        examples[0].one[i] = 0;
+    }
+    printf("zero %i %i\n", examples[0].zero, examples[1].zero);
+    free(examples);
+    return 0;
+}
@@ -0,0 +1,33 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+struct Simple {
+    int zero;
+    char one[2];
+    char two[3];
+    char three;
+};
+
+int main() {
+    struct Simple *examples = malloc(2 * sizeof(struct Simple));
+    for (int x = 0; x < 2; x++) {
+        examples[x].zero = x;
+        examples[x].three = x;
+    }
+    // Grow the array; the old elements keep their values and their redzones move along.
+    examples = realloc(examples, 8 * sizeof(struct Simple));
+    for (int x = 2; x < 8; x++) {
+        examples[x].zero = x;
+        examples[x].three = x;
+    }
+    for (int x = 0; x < 8; x++) {
+        printf("zero %i three %i\n", examples[x].zero, examples[x].three);
+    }
+    // And shrink it again.
+    examples = realloc(examples, 3 * sizeof(struct Simple));
+    for (int x = 0; x < 3; x++) {
+        printf("zero %i three %i\n", examples[x].zero, examples[x].three);
+    }
+    free(examples);
+    return 0;
+}
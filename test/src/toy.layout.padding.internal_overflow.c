@@ -0,0 +1,35 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+enum OperandType {
+    ADD,
+    SUB,
+    MUL,
+};
+
+// The node of the benchmark.
+struct Container {
+    unsigned int val;
+    enum OperandType operand;
+    struct Container *next;
+};
+
+struct Entry {
+    enum OperandType operand;
+    char label[6];
+    struct Container *first;
+};
+
+int main() {
+    // Built with -structzone-layout=padding. Overflowing 'label' runs into the redzone after it
+    // before it reaches 'first'.
+    struct Entry entry;
+    entry.operand = ADD;
+    entry.first = calloc(1, sizeof(struct Container));
+    for (int i = 0; i < 10; i++) {
+        entry.label[i] = 'x';
+    }
+    printf("operand %i val %u\n", entry.operand, entry.first->val);
+    free(entry.first);
+    return 0;
+}
@@ -0,0 +1,60 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+enum OperandType {
+    ADD,
+    SUB,
+    MUL,
+};
+
+// The node of the benchmark.
+struct Container {
+    unsigned int val;
+    enum OperandType operand;
+    struct Container *next;
+};
+
+struct Entry {
+    enum OperandType operand;
+    char label[6];
+    struct Container *first;
+};
+
+struct Container *push(struct Container *curr, unsigned int val, enum OperandType operand) {
+    struct Container *new = calloc(1, sizeof(struct Container));
+    new->val = val;
+    new->operand = operand;
+    if (curr) {
+        curr->next = new;
+    }
+    return new;
+}
+
+int main() {
+    // Built with -structzone-layout=padding.
+    struct Container *first = push(NULL, 1, ADD);
+    struct Container *curr = first;
+    for (unsigned int i = 2; i < 8; i++) {
+        curr = push(curr, i, i % 2 ? MUL : ADD);
+    }
+    struct Entry entry;
+    entry.operand = SUB;
+    entry.first = first;
+    for (int i = 0; i < 6; i++) {
+        entry.label[i] = 'a' + i;
+    }
+    for (curr = entry.first; curr->next; curr = curr->next) {
+        if (curr->operand == MUL) {
+            curr->next->val = curr->next->val * curr->val;
+        } else {
+            curr->next->val = curr->next->val + curr->val;
+        }
+    }
+    printf("%.6s operand %i result %u\n", entry.label, entry.operand, curr->val);
+    while (first) {
+        curr = first->next;
+        free(first);
+        first = curr;
+    }
+    return 0;
+}
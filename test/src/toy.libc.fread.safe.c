@@ -0,0 +1,24 @@
+#include <stdio.h>
+
+struct Record {
+    int id;
+    char name[16];
+    int checksum;
+};
+
+int main() {
+    FILE *file = tmpfile();
+    fputs("structzone", file);
+    rewind(file);
+
+    struct Record record;
+    record.id = 1;
+    record.checksum = 2;
+    // Reads the whole file, which is shorter than the buffer.
+    size_t read = fread(record.name, 1, sizeof(record.name) - 1, file);
+    record.name[read] = '\0';
+    fclose(file);
+
+    printf("%d %s %d %zu\n", record.id, record.name, record.checksum, read);
+    return 0;
+}
@@ -0,0 +1,26 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+// Uses enough stack to overwrite whatever a returned struct pointer might have been left
+// pointing at.
+static int clobber_stack(int n) {
+    volatile char buf[1024];
+    memset((char *)buf, 0xff, sizeof(buf));
+    return buf[n];
+}
+
+int main() {
+    time_t t = 1000000000;
+    // gmtime and localtime return a pointer to storage that outlives the call.
+    struct tm *utc = gmtime(&t);
+    clobber_stack(1);
+    printf("year %i month %i day %i hour %i\n", utc->tm_year, utc->tm_mon, utc->tm_mday,
+           utc->tm_hour);
+    struct tm *local = localtime(&t);
+    clobber_stack(2);
+    printf("year %i day of year %i\n", local->tm_year, local->tm_yday);
+    char text[64];
+    strftime(text, sizeof(text), "%Y-%m-%d", gmtime(&t));
+    printf("%s\n", text);
+}
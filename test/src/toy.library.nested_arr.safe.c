@@ -0,0 +1,35 @@
+#include <stdio.h>
+
+struct Inner {
+    int value;
+    char tag[3];
+};
+
+struct Outer {
+    long id;
+    struct Inner items[3];
+    int count;
+};
+
+// From lib/nested_arr.c, which is not instrumented: the call goes through a wrapper that converts
+// the struct, including the array of nested structs, to the original layout and back.
+void update_outer(struct Outer *outer);
+
+int main() {
+    struct Outer outer;
+    outer.id = 100;
+    for (int i = 0; i < 3; i++) {
+        outer.items[i].value = i + 1;
+        outer.items[i].tag[0] = 'x';
+        outer.items[i].tag[1] = 'y';
+        outer.items[i].tag[2] = 'z';
+    }
+    outer.count = 3;
+    update_outer(&outer);
+    printf("id %ld count %i\n", outer.id, outer.count);
+    for (int i = 0; i < 3; i++) {
+        printf("item %i value %i tag %c%c%c\n", i, outer.items[i].value, outer.items[i].tag[0],
+               outer.items[i].tag[1], outer.items[i].tag[2]);
+    }
+    return 0;
+}
@@ -0,0 +1,22 @@
+#include <stdio.h>
+#include <string.h>
+
+struct Simple {
+    int zero;
+    char one[2];
+    char two[3];
+    char three;
+};
+
+int main() {
+    struct Simple examples[9];
+    memset(examples, 0, sizeof(examples));
+    // The memset must not have taken the color off the redzones, so reading past 'two' of the
+    // last element is still caught.
+    int sum = 0;
+    for (int i = 0; i < 4; i++) {
+        sum += examples[8].two[i];
+    }
+    printf("sum %i\n", sum);
+    return 0;
+}
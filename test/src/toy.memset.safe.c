@@ -0,0 +1,24 @@
+#include <stdio.h>
+#include <string.h>
+
+struct Simple {
+    int zero;
+    char one[2];
+    char two[3];
+    char three;
+};
+
+int main() {
+    // Clearing the whole array sets the payload of every element, while the redzones in between
+    // keep their color.
+    struct Simple examples[9];
+    memset(examples, 1, sizeof(examples));
+    for (int x = 0; x < 9; x++) {
+        printf("zero %i one %i two %i three %i\n", examples[x].zero, examples[x].one[1],
+               examples[x].two[2], examples[x].three);
+    }
+    memset(&examples[8], 0, sizeof(examples[8]));
+    printf("zero %i one %i two %i three %i\n", examples[8].zero, examples[8].one[1],
+           examples[8].two[2], examples[8].three);
+    return 0;
+}
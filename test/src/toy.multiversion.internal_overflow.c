@@ -0,0 +1,28 @@
+#include <stdio.h>
+
+struct Counter {
+    int hits[4];
+    int total;
+};
+
+// Reads one element past hits, which lands in the redzone behind it.
+long count(struct Counter *counter) {
+    long sum = 0;
+    for (int i = 0; i <= 4; i++) {
+        sum += counter->hits[i];
+    }
+    return sum;
+}
+
+int main() {
+    struct Counter counter;
+    for (int i = 0; i < 4; i++) {
+        counter.hits[i] = i;
+    }
+    counter.total = 0;
+    // Reported unless the checks are switched off with STRUCTZONE_CHECKS=0, in which case the
+    // unchecked version of count runs.
+    count(&counter);
+    printf("counted\n");
+    return 0;
+}
@@ -0,0 +1,22 @@
+#include <stdio.h>
+
+struct Counter {
+    int hits[4];
+    int total;
+};
+
+int main() {
+    struct Counter counter;
+    for (int i = 0; i < 4; i++) {
+        counter.hits[i] = 0;
+    }
+    counter.total = 0;
+    // These accesses run far more often than -structzone-profile-hot asks for, and the values
+    // never contain a colored byte, so a profile of this run shows them as hot and clean.
+    for (int round = 0; round < 20000; round++) {
+        counter.hits[round % 4] = round % 2;
+        counter.total = !counter.total;
+    }
+    printf("%d %d %d\n", counter.hits[0], counter.hits[1], counter.total);
+    return 0;
+}
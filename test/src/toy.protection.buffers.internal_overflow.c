@@ -0,0 +1,21 @@
+#include <stdio.h>
+
+struct Record {
+    int id;
+    char name[4];
+    int count;
+    char tag[3];
+};
+
+int main() {
+    // Built with -structzone-protection=buffers. Overflowing 'name' would overwrite 'count'; the
+    // redzone after the buffer catches it.
+    struct Record record;
+    record.id = 5;
+    record.count = 6;
+    for (int i = 0; i < 8; i++) {
+        record.name[i] = 'x';
+    }
+    printf("id %i count %i\n", record.id, record.count);
+    return 0;
+}
@@ -0,0 +1,28 @@
+#include <stdio.h>
+
+struct Record {
+    int id;
+    char name[4];
+    int count;
+    char tag[3];
+};
+
+int main() {
+    // Built with -structzone-protection=buffers: only 'name' and 'tag' are surrounded by
+    // redzones. Reading and writing them up to their last element is fine.
+    struct Record record;
+    record.id = 5;
+    record.count = 6;
+    for (int i = 0; i < 4; i++) {
+        record.name[i] = 'w' + i;
+    }
+    for (int i = 0; i < 3; i++) {
+        record.tag[i] = 3 - i;
+    }
+    int sum = 0;
+    for (int i = 0; i < 3; i++) {
+        sum += record.tag[i];
+    }
+    printf("id %i name %.4s count %i sum %i\n", record.id, record.name, record.count, sum);
+    return 0;
+}
@@ -0,0 +1,23 @@
+#include <stdio.h>
+
+struct Record {
+    int id;
+    char name[4];
+    int count;
+    char tag[3];
+};
+
+int main() {
+    // Built with -structzone-protection=tail. Writing past 'tag' leaves the struct, which is
+    // still caught by the redzone after the last field.
+    struct Record records[2];
+    records[0].id = 1;
+    records[0].count = 2;
+    records[1].id = 3;
+    records[1].count = 4;
+    for (int i = 0; i < 8; i++) {
+        records[0].tag[i] = i;
+    }
+    printf("id %i count %i\n", records[1].id, records[1].count);
+    return 0;
+}
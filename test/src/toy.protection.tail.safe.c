@@ -0,0 +1,31 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+struct Record {
+    int id;
+    char name[4];
+    int count;
+    char tag[3];
+};
+
+int main() {
+    // Built with -structzone-protection=tail: only the redzone after 'tag' is left, and the
+    // fields keep their original offsets.
+    struct Record *records = malloc(3 * sizeof(struct Record));
+    for (int x = 0; x < 3; x++) {
+        records[x].id = x;
+        for (int i = 0; i < 4; i++) {
+            records[x].name[i] = 'a' + x + i;
+        }
+        records[x].count = 10 * x;
+        for (int i = 0; i < 3; i++) {
+            records[x].tag[i] = x + i;
+        }
+    }
+    for (int x = 0; x < 3; x++) {
+        printf("id %i name %.4s count %i tag %i %i %i\n", records[x].id, records[x].name,
+               records[x].count, records[x].tag[0], records[x].tag[1], records[x].tag[2]);
+    }
+    free(records);
+    return 0;
+}
@@ -0,0 +1,24 @@
+#include <stdio.h>
+
+struct Counter {
+    int hits[4];
+    int total;
+};
+
+int main() {
+    struct Counter counter;
+    for (int i = 0; i < 4; i++) {
+        counter.hits[i] = i;
+    }
+    counter.total = 0;
+    // Reads one element past hits on every round. Every access is sampled by default; with a
+    // higher STRUCTZONE_SAMPLE_RATE, one of the rounds is still bound to be.
+    long sum = 0;
+    for (int round = 0; round < 1000; round++) {
+        for (int i = 0; i <= 4; i++) {
+            sum += counter.hits[i];
+        }
+    }
+    printf("sum %ld\n", sum);
+    return 0;
+}
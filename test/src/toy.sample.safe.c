@@ -0,0 +1,24 @@
+#include <stdio.h>
+
+struct Counter {
+    int hits[4];
+    int total;
+};
+
+int main() {
+    struct Counter counter;
+    for (int i = 0; i < 4; i++) {
+        counter.hits[i] = 0;
+    }
+    counter.total = 0;
+    // Enough accesses for the countdown to run out many times over.
+    for (int round = 0; round < 1000; round++) {
+        counter.hits[round % 4] += round;
+        counter.total++;
+    }
+    for (int i = 0; i < 4; i++) {
+        printf("hits %i %i\n", i, counter.hits[i]);
+    }
+    printf("total %i\n", counter.total);
+    return 0;
+}
@@ -0,0 +1,27 @@
+#include <stdio.h>
+
+struct Simple {
+    int zero;
+    char one[2];
+    char two[3];
+    char three;
+};
+
+int main() {
+    struct Simple original;
+    original.zero = 7;
+    original.one[0] = 1;
+    original.one[1] = 2;
+    original.two[0] = 3;
+    original.two[1] = 4;
+    original.two[2] = 5;
+    original.three = 6;
+    struct Simple copy = original;
+    // The assignment only copied the fields, so the redzones of the copy are still colored and
+    // overflowing 'one' is caught.
+    for (int i = 0; i < 4; i++) {
+        copy.one[i] = 0;
+    }
+    printf("zero %i three %i\n", copy.zero, copy.three);
+    return 0;
+}
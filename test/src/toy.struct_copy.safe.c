@@ -0,0 +1,60 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+struct Simple {
+    int zero;
+    char one[2];
+    char two[3];
+    char three;
+};
+
+struct Nested {
+    int zero;
+    struct Simple inner;
+    struct Simple pair[2];
+};
+
+void print_simple(const char *name, struct Simple *s) {
+    printf("%s zero %i one %i %i two %i %i %i three %i\n", name, s->zero, s->one[0], s->one[1],
+           s->two[0], s->two[1], s->two[2], s->three);
+}
+
+int main() {
+    struct Simple original;
+    original.zero = 7;
+    original.one[0] = 1;
+    original.one[1] = 2;
+    original.two[0] = 3;
+    original.two[1] = 4;
+    original.two[2] = 5;
+    original.three = 6;
+    // Struct assignments are lowered to memcpy, which only copies the fields.
+    struct Simple copy = original;
+    print_simple("copy", &copy);
+
+    struct Simple *heap = malloc(3 * sizeof(struct Simple));
+    for (int x = 0; x < 3; x++) {
+        heap[x] = original;
+        heap[x].zero = x;
+    }
+    struct Simple array[3];
+    for (int x = 0; x < 3; x++) {
+        array[x] = heap[2 - x];
+    }
+    for (int x = 0; x < 3; x++) {
+        print_simple("array", &array[x]);
+    }
+
+    struct Nested outer;
+    outer.zero = 9;
+    outer.inner = copy;
+    outer.pair[0] = array[0];
+    outer.pair[1] = array[2];
+    struct Nested outer_copy = outer;
+    printf("outer zero %i\n", outer_copy.zero);
+    print_simple("inner", &outer_copy.inner);
+    print_simple("pair", &outer_copy.pair[0]);
+    print_simple("pair", &outer_copy.pair[1]);
+    free(heap);
+    return 0;
+}
@@ -0,0 +1,49 @@
+#include <stdio.h>
+
+struct Sample {
+    int count;
+    float weights[4];
+    short flags;
+    double total;
+};
+
+struct Batch {
+    long id;
+    struct Sample samples[2];
+};
+
+// Loads and stores through int, float and double pointers into the same struct, which clang tags
+// with struct-path TBAA at -O1. The pass has to remap those tags onto the inflated offsets.
+void accumulate(struct Sample *sample, float *scale, int *limit) {
+    for (int i = 0; i < *limit; i++) {
+        sample->weights[i] *= *scale;
+        sample->total += sample->weights[i];
+    }
+    sample->count += *limit;
+    sample->flags |= 1;
+}
+
+int main() {
+    struct Batch batch;
+    batch.id = 3;
+    for (int x = 0; x < 2; x++) {
+        batch.samples[x].count = x;
+        batch.samples[x].flags = 0;
+        batch.samples[x].total = 0;
+        for (int i = 0; i < 4; i++) {
+            batch.samples[x].weights[i] = i + x;
+        }
+    }
+    float scale = 1.5f;
+    int limit = 4;
+    accumulate(&batch.samples[0], &scale, &limit);
+    accumulate(&batch.samples[1], &batch.samples[0].weights[1], &batch.samples[0].count);
+    for (int x = 0; x < 2; x++) {
+        printf("count %i flags %i total %.2f weights %.2f %.2f %.2f %.2f\n",
+               batch.samples[x].count, batch.samples[x].flags, batch.samples[x].total,
+               batch.samples[x].weights[0], batch.samples[x].weights[1],
+               batch.samples[x].weights[2], batch.samples[x].weights[3]);
+    }
+    printf("id %ld\n", batch.id);
+    return 0;
+}